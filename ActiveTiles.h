@@ -0,0 +1,171 @@
+#ifndef __ACTIVETILES__
+#define __ACTIVETILES__
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+/* Set of the tiles of a grid that hold anything worth simulating.
+ *
+ * The grid is cut into fixed TILE_SIZE x TILE_SIZE tiles of cells. Scenes
+ * are mostly quiescent, so kernels only visit the active tiles and leave
+ * the rest alone. Callers keep every inactive tile at a single constant
+ * value in all of its buffers, which is what makes skipping it exact: any
+ * kernel reading into it sees the same value it would have computed.
+ *
+ * Activity is refreshed once per step. The caller marks the active tiles
+ * that are hot, i.e. hold motion or detail above its thresholds, and
+ * refresh() makes the hot tiles plus a halo of `halo' tiles around them the
+ * new active set. The halo is what lets anything leave a hot tile during
+ * the next step, so it has to cover the furthest anything moves in a step.
+ * Inactive tiles are constant and so can't become hot on their own; they
+ * only join the set through the halo or through activate().
+ */
+class ActiveTiles {
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+    int halo;
+
+    vector<uint8_t> activeFlags;
+    vector<uint8_t> hotFlags;
+    vector<Tile> activeList;
+    long activeCells;
+    /* Scratch for refresh() */
+    vector<uint8_t> nextFlags;
+
+    Tile tile(int index) const {
+        int x = (index % tilesX)*TILE_SIZE;
+        int y = (index / tilesX)*TILE_SIZE;
+        return Tile{x, y, min(x + TILE_SIZE, width), min(y + TILE_SIZE, height), index};
+    }
+
+    void rebuildList() {
+        activeList.clear();
+        activeCells = 0;
+        for (int i = 0; i < tilesX*tilesY; i++) {
+            if (activeFlags[i]) {
+                Tile t = tile(i);
+                activeList.push_back(t);
+                activeCells += (long)(t.x1 - t.x0)*(t.y1 - t.y0);
+            }
+        }
+    }
+
+public:
+    static const int TILE_SIZE = 32;
+
+    /* Tracks a width x height grid with all tiles active */
+    ActiveTiles(int w, int h, int haloTiles = 1) : width(w), height(h), halo(haloTiles) {
+        tilesX = (width  + TILE_SIZE - 1)/TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1)/TILE_SIZE;
+        activeFlags.assign(tilesX*tilesY, 1);
+        hotFlags.assign(tilesX*tilesY, 0);
+        rebuildList();
+    }
+
+    int tileCount() const {
+        return tilesX*tilesY;
+    }
+
+    /* The active tiles, ordered by index. Tile::index numbers all tiles of
+     * the grid row by row, active or not.
+     */
+    const vector<Tile> &tiles() const {
+        return activeList;
+    }
+
+    /* Whether the tile containing cell (x, y) is active. Cells outside the
+     * grid count as inactive.
+     */
+    bool activeAt(int x, int y) const {
+        if (x < 0 || y < 0 || x >= width || y >= height)
+            return false;
+        return activeFlags[(x/TILE_SIZE) + (y/TILE_SIZE)*tilesX];
+    }
+
+    /* Number of cells in the active tiles */
+    long cellCount() const {
+        return activeCells;
+    }
+
+    /* Share of the tiles that are active */
+    double fraction() const {
+        return tileCount() ? (double)activeList.size()/tileCount() : 0.0;
+    }
+
+    /* Makes every tile active, for when the contents changed wholesale */
+    void activateAll() {
+        activeFlags.assign(tilesX*tilesY, 1);
+        rebuildList();
+    }
+
+    /* Makes the tiles overlapping cells [x0, x1) x [y0, y1) active and hot,
+     * for changes made from outside the kernels
+     */
+    void activate(int x0, int y0, int x1, int y1) {
+        x0 = max(x0, 0), y0 = max(y0, 0);
+        x1 = min(x1, width), y1 = min(y1, height);
+        if (x0 >= x1 || y0 >= y1)
+            return;
+
+        bool added = false;
+        for (int ty = y0/TILE_SIZE; ty <= (y1 - 1)/TILE_SIZE; ty++) {
+            for (int tx = x0/TILE_SIZE; tx <= (x1 - 1)/TILE_SIZE; tx++) {
+                int i = tx + ty*tilesX;
+                added |= !activeFlags[i];
+                activeFlags[i] = 1;
+                hotFlags[i] = 1;
+            }
+        }
+        if (added)
+            rebuildList();
+    }
+
+    /* Marks active tile `index' as hot for the next refresh(). Safe to call
+     * for different tiles from different threads.
+     */
+    void markHot(int index) {
+        hotFlags[index] = 1;
+    }
+
+    /* Replaces the active set by the hot tiles and their halo, and clears
+     * the hot marks. retire(tile) is called for every tile that leaves the
+     * set, before the list changes, so the caller can set it to a constant.
+     * Runs in time proportional to the number of tiles, not cells.
+     */
+    template<typename Retire>
+    void refresh(Retire retire) {
+        nextFlags.assign(tilesX*tilesY, 0);
+        for (size_t k = 0; k < activeList.size(); k++) {
+            int i = activeList[k].index;
+            if (!hotFlags[i])
+                continue;
+            int tx = i % tilesX, ty = i / tilesX;
+            for (int y = max(ty - halo, 0); y <= min(ty + halo, tilesY - 1); y++)
+                for (int x = max(tx - halo, 0); x <= min(tx + halo, tilesX - 1); x++)
+                    nextFlags[x + y*tilesX] = 1;
+        }
+
+        bool changed = false;
+        for (size_t k = 0; k < activeList.size(); k++) {
+            int i = activeList[k].index;
+            hotFlags[i] = 0;
+            if (!nextFlags[i])
+                retire(activeList[k]);
+        }
+        for (int i = 0; i < tilesX*tilesY; i++) {
+            changed |= activeFlags[i] != nextFlags[i];
+            activeFlags[i] = nextFlags[i];
+        }
+        if (changed)
+            rebuildList();
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <algorithm>
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+/* How an Arena's memory is backed */
+enum HugePages {
+    HUGE_PAGES_NONE,        /* Regular pages */
+    HUGE_PAGES_TRANSPARENT, /* Transparent huge pages, as far as the kernel grants them */
+    HUGE_PAGES_EXPLICIT     /* Reserved huge pages (MAP_HUGETLB), transparent if none are free */
+};
+
+/* Alignment of every buffer an Arena hands out: a cache line, which is also
+ * the widest vector load
+ */
+const size_t ARENA_ALIGN = 64;
+/* Size of the pages buffer starts are staggered within, and of huge pages */
+const size_t ARENA_PAGE = 4096;
+const size_t ARENA_HUGE_PAGE = 2 << 20;
+
+/* Number of values of `valueSize' bytes to step between rows of a grid
+ * `count' values wide. Rows start on a cache line, and a row a multiple of
+ * a page long gets one more line: rows that far apart map to the same cache
+ * sets, which stencils reading several rows at once would keep evicting.
+ */
+inline int paddedRow(int count, size_t valueSize) {
+    size_t bytes = (count*valueSize + ARENA_ALIGN - 1)/ARENA_ALIGN*ARENA_ALIGN;
+    if (bytes % ARENA_PAGE == 0)
+        bytes += ARENA_ALIGN;
+    return (int)(bytes/valueSize);
+}
+
+/* One allocation that all buffers of a solver are carved out of.
+ *
+ * Layout and allocation are separate steps: reserve() lays out each buffer
+ * and returns its offset, allocate() then maps memory for all of them at
+ * once, and at() turns offsets into pointers. Laying out without allocating
+ * tells the footprint of a run before committing to it.
+ *
+ * Buffers are streamed side by side by the kernels, and ones whose starts
+ * are a multiple of a page apart would compete for the same cache sets
+ * cell after cell. Each buffer therefore starts a different number of cache
+ * lines into a page.
+ *
+ * Memory comes from an anonymous mapping, so it is zero and pages are only
+ * placed once first written. Callers should write each buffer first from
+ * the threads that will work on it, which places its pages on their NUMA
+ * node.
+ */
+class Arena {
+    size_t used;
+    int buffers;
+
+    char *mapping;
+    size_t mappedBytes;
+    char *base;
+    bool hugeBacked;
+
+    static size_t roundUp(size_t n, size_t to) {
+        return (n + to - 1)/to*to;
+    }
+
+    void release() {
+        if (mapping)
+            munmap(mapping, mappedBytes);
+        mapping = base = 0;
+        mappedBytes = 0;
+        hugeBacked = false;
+    }
+
+public:
+    Arena() : used(0), buffers(0), mapping(0), mappedBytes(0), base(0), hugeBacked(false) {}
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena() {
+        release();
+    }
+
+    /* Lays out room for `count' values of T and returns their offset */
+    template<typename T>
+    size_t reserve(size_t count) {
+        size_t stagger = (buffers++ % (ARENA_PAGE/ARENA_ALIGN))*ARENA_ALIGN;
+        size_t offset = roundUp(used, ARENA_PAGE) + stagger;
+        used = offset + count*sizeof(T);
+        return offset;
+    }
+
+    /* Maps memory for everything reserved so far. Throws bad_alloc if
+     * there isn't enough.
+     */
+    void allocate(HugePages mode) {
+        release();
+
+        if (mode == HUGE_PAGES_EXPLICIT) {
+            size_t bytes = roundUp(max(used, (size_t)1), ARENA_HUGE_PAGE);
+            void *address = mmap(0, bytes, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (address != MAP_FAILED) {
+                mapping = base = (char *)address;
+                mappedBytes = bytes;
+                hugeBacked = true;
+                return;
+            }
+            mode = HUGE_PAGES_TRANSPARENT;
+        }
+
+        /* Transparent huge pages need the mapping aligned to one */
+        size_t align = mode == HUGE_PAGES_TRANSPARENT ? ARENA_HUGE_PAGE : ARENA_PAGE;
+        size_t bytes = roundUp(max(used, (size_t)1), align);
+        mappedBytes = bytes + align - ARENA_PAGE;
+        void *address = mmap(0, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED) {
+            mappedBytes = 0;
+            throw bad_alloc();
+        }
+        mapping = (char *)address;
+        base = (char *)roundUp((uintptr_t)mapping, align);
+        if (mode == HUGE_PAGES_TRANSPARENT)
+            hugeBacked = madvise(base, bytes, MADV_HUGEPAGE) == 0;
+    }
+
+    /* The buffer reserved at `offset' */
+    template<typename T>
+    T *at(size_t offset) const {
+        return (T *)(base + offset);
+    }
+
+    /* Bytes laid out so far, which is what allocate() needs to map */
+    size_t footprint() const {
+        return roundUp(used, ARENA_PAGE);
+    }
+
+    /* Whether allocate() got huge pages, or asked for transparent ones */
+    bool hugePages() const {
+        return hugeBacked;
+    }
+};
+
+#endif
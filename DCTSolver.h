@@ -0,0 +1,336 @@
+#ifndef __DCTSOLVER__
+#define __DCTSOLVER__
+
+#include <algorithm>
+#include <complex>
+#include <map>
+#include <math.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "PressureStencil.h"
+#include "SolveStats.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+typedef complex<double> Complex;
+
+/* Plan for complex FFTs of one length n: its factorization into radices and
+ * the twiddle factors exp(-2*pi*i*k/n). Transforms are mixed radix
+ * Cooley-Tukey, with a dedicated butterfly for radix 2 and a direct DFT for
+ * any other factor. Every length works, but a factor p costs p operations
+ * per value, so only lengths made of small primes are fast; a prime length
+ * takes O(n^2).
+ */
+class FFTPlan {
+    int n;
+    vector<int> factors;
+    vector<Complex> twiddles;
+    /* Largest factor, for the size of the butterfly scratch */
+    int maxFactor;
+
+    /* Transforms the n/stride values of `in' `stride' apart into `out',
+     * using factors from `f' on
+     */
+    void transform(Complex *out, const Complex *in, int length, int stride, int f, Complex *scratch) const {
+        int p = factors[f];
+        int m = length/p;
+        if (m == 1) {
+            for (int j = 0; j < p; j++)
+                out[j] = in[j*stride];
+        } else {
+            for (int j = 0; j < p; j++)
+                transform(out + j*m, in + j*stride, m, stride*p, f + 1, scratch);
+        }
+
+        if (p == 2) {
+            for (int k = 0; k < m; k++) {
+                Complex a = out[k];
+                Complex b = out[k + m]*twiddles[k*stride];
+                out[k] = a + b;
+                out[k + m] = a - b;
+            }
+            return;
+        }
+
+        /* Twiddles of the length-p DFT are every (n/p)-th one */
+        int step = n/p;
+        for (int k = 0; k < m; k++) {
+            for (int j = 0; j < p; j++)
+                scratch[j] = out[k + j*m]*twiddles[(j*k*stride) % n];
+            for (int q = 0; q < p; q++) {
+                Complex sum = scratch[0];
+                for (int j = 1; j < p; j++)
+                    sum += scratch[j]*twiddles[(j*q % p)*step];
+                out[k + q*m] = sum;
+            }
+        }
+    }
+
+public:
+    explicit FFTPlan(int length) : n(length), maxFactor(1) {
+        int rest = n;
+        for (int p = 2; p*p <= rest; p++) {
+            while (rest % p == 0) {
+                factors.push_back(p);
+                rest /= p;
+            }
+        }
+        if (rest > 1 || factors.empty())
+            factors.push_back(rest);
+        maxFactor = *max_element(factors.begin(), factors.end());
+
+        twiddles.resize(n);
+        for (int k = 0; k < n; k++)
+            twiddles[k] = polar(1.0, -2.0*M_PI*k/n);
+    }
+
+    int length() const {
+        return n;
+    }
+
+    /* Values of scratch space forward() needs besides its buffers */
+    int scratchSize() const {
+        return maxFactor;
+    }
+
+    /* out = FFT(in), both n values */
+    void forward(Complex *out, const Complex *in, Complex *scratch) const {
+        transform(out, in, n, 1, 0, scratch);
+    }
+};
+
+/* Plan for DCT-II transforms of one length and their inverse, computed
+ * through an FFT of the same length (Makhoul's algorithm): the input is
+ * reordered into evens followed by reversed odds, transformed, and rotated
+ * by a quarter-sample shift.
+ *
+ * Plans are cached per length and shared, see get().
+ */
+class DCTPlan {
+    int n;
+    FFTPlan fft;
+    /* exp(-i*pi*k/(2n)) */
+    vector<Complex> shifts;
+
+public:
+    explicit DCTPlan(int length) : n(length), fft(length), shifts(length) {
+        for (int k = 0; k < n; k++)
+            shifts[k] = polar(1.0, -M_PI*k/(2.0*n));
+    }
+
+    /* The plan for length n, made on first use */
+    static shared_ptr<const DCTPlan> get(int n) {
+        static mutex lock;
+        static map<int, shared_ptr<const DCTPlan> > plans;
+
+        lock_guard<mutex> guard(lock);
+        shared_ptr<const DCTPlan> &plan = plans[n];
+        if (!plan)
+            plan = make_shared<DCTPlan>(n);
+        return plan;
+    }
+
+    int length() const {
+        return n;
+    }
+
+    /* Complex values of scratch forward() and inverse() need */
+    int scratchSize() const {
+        return 2*n + fft.scratchSize();
+    }
+
+    /* out[k] = sum over j of in[j]*cos(pi*k*(2j + 1)/(2n)). in and out may
+     * be the same.
+     */
+    void forward(double *out, const double *in, Complex *scratch) const {
+        Complex *v = scratch, *V = scratch + n;
+        for (int j = 0; 2*j < n; j++)
+            v[j] = in[2*j];
+        for (int j = 0; 2*j + 1 < n; j++)
+            v[n - 1 - j] = in[2*j + 1];
+
+        fft.forward(V, v, scratch + 2*n);
+        for (int k = 0; k < n; k++)
+            out[k] = real(V[k]*shifts[k]);
+    }
+
+    /* Undoes forward(). in and out may be the same. */
+    void inverse(double *out, const double *in, Complex *scratch) const {
+        Complex *v = scratch, *V = scratch + n;
+        /* The inverse FFT, as the conjugate of the forward one */
+        V[0] = in[0];
+        for (int k = 1; k < n; k++)
+            V[k] = conj(Complex(in[k], -in[n - k])/shifts[k]);
+
+        fft.forward(v, V, scratch + 2*n);
+        for (int j = 0; 2*j < n; j++)
+            out[2*j] = real(v[j])/n;
+        for (int j = 0; 2*j + 1 < n; j++)
+            out[2*j + 1] = real(v[n - 1 - j])/n;
+    }
+};
+
+/* Direct solver for the pressure equation of FluidSolver on a grid that is
+ * all fluid, with the solid walls of the domain border as the only
+ * boundary:
+ *
+ *     scale*(n*p[i] - sum of neighbour p) = r[i]
+ *
+ * The cosine basis of the DCT-II diagonalizes this operator, with
+ * eigenvalue
+ *
+ *     scale*((2 - 2 cos(pi*i/width)) + (2 - 2 cos(pi*j/height)))
+ *
+ * for basis function (i, j). A solve transforms r along rows and then
+ * columns, divides by the eigenvalues and transforms back: exact up to
+ * rounding in O(n log n) for lengths with small prime factors. The constant
+ * mode has eigenvalue zero, as pressure is only defined up to a constant,
+ * and is set to zero.
+ *
+ * Row and column passes are spread over the thread pool, columns in groups
+ * gathered into contiguous scratch.
+ */
+class DCTSolver {
+    int width;
+    int height;
+    shared_ptr<const DCTPlan> rowPlan;
+    shared_ptr<const DCTPlan> columnPlan;
+    /* 2 - 2 cos(pi*i/n) along either axis */
+    vector<double> rowEigen;
+    vector<double> columnEigen;
+
+    /* Transform coefficients of the whole grid */
+    vector<double> coeffs;
+    /* Per-thread scratch: complex for the transforms, and gathered columns */
+    vector<vector<Complex> > complexScratch;
+    vector<vector<double> > columnScratch;
+    vector<double> partialError;
+
+    /* Columns gathered per tile of the column pass, a cache line of them */
+    static const int COLUMN_GROUP = 8;
+
+    static vector<double> eigenvalues(int n) {
+        vector<double> e(n);
+        for (int i = 0; i < n; i++)
+            e[i] = 2.0 - 2.0*cos(M_PI*i/n);
+        return e;
+    }
+
+    /* Applies the row plan's forward or inverse transform to every row of
+     * `coeffs'
+     */
+    void rowPass(bool inverse, ThreadPool &pool) {
+        pool.forEachTile(width, height, width, COLUMN_GROUP, [&](const Tile &t, int thread) {
+            Complex *scratch = complexScratch[thread].data();
+            for (int y = t.y0; y < t.y1; y++) {
+                double *row = coeffs.data() + y*width;
+                if (inverse)
+                    rowPlan->inverse(row, row, scratch);
+                else
+                    rowPlan->forward(row, row, scratch);
+            }
+        });
+    }
+
+    /* Same as rowPass() for the columns */
+    void columnPass(bool inverse, ThreadPool &pool) {
+        pool.forEachTile(width, height, COLUMN_GROUP, height, [&](const Tile &t, int thread) {
+            Complex *scratch = complexScratch[thread].data();
+            double *columns = columnScratch[thread].data();
+            int n = t.x1 - t.x0;
+
+            for (int y = 0; y < height; y++)
+                for (int k = 0; k < n; k++)
+                    columns[k*height + y] = coeffs[t.x0 + k + y*width];
+
+            for (int k = 0; k < n; k++) {
+                double *column = columns + k*height;
+                if (inverse)
+                    columnPlan->inverse(column, column, scratch);
+                else
+                    columnPlan->forward(column, column, scratch);
+            }
+
+            for (int y = 0; y < height; y++)
+                for (int k = 0; k < n; k++)
+                    coeffs[t.x0 + k + y*width] = columns[k*height + y];
+        });
+    }
+
+    void prepare(ThreadPool &pool) {
+        int threads = pool.threadCount();
+        if ((int)complexScratch.size() == threads)
+            return;
+        complexScratch.assign(threads, vector<Complex>(max(rowPlan->scratchSize(), columnPlan->scratchSize())));
+        columnScratch.assign(threads, vector<double>(COLUMN_GROUP*height));
+    }
+
+public:
+    DCTSolver(int w, int h) : width(w), height(h), rowPlan(DCTPlan::get(w)), columnPlan(DCTPlan::get(h)),
+            rowEigen(eigenvalues(w)), columnEigen(eigenvalues(h)), coeffs(w*h) {}
+
+    /* Largest prime factor of a side length the solver takes, which keeps
+     * the transforms within a small factor of O(n log n), see FFTPlan
+     */
+    static const int MAX_FACTOR = 13;
+
+    static bool smallFactors(int n) {
+        for (int p = 2; p <= MAX_FACTOR; p++)
+            while (n % p == 0)
+                n /= p;
+        return n == 1;
+    }
+
+    /* Whether the solver applies to a w x h grid with the cells of
+     * `stencil': all fluid, with sides made of small prime factors
+     */
+    static bool applies(int w, int h, const PressureStencil &stencil) {
+        return smallFactors(w) && smallFactors(h) && !stencil.hasEmptyCells() && !stencil.hasSolidCells();
+    }
+
+    /* Solves for p given the right hand side r and scale of
+     * FluidSolver::project. p needs a ghost margin (see GhostedArray); its
+     * contents are ignored. Reports a single iteration and the maximum
+     * error the Gauss-Seidel loop would measure, which only rounding keeps
+     * from zero; the solve counts as converged if that is below
+     * `tolerance'.
+     */
+    SolveStats solve(double *p, const double *r, const PressureStencil &stencil, double scale,
+            double tolerance, ThreadPool &pool) {
+        prepare(pool);
+
+        copy(r, r + width*height, coeffs.begin());
+        rowPass(false, pool);
+        columnPass(false, pool);
+
+        pool.forEachTile(width, height, width, COLUMN_GROUP, [&](const Tile &t, int) {
+            for (int j = t.y0; j < t.y1; j++) {
+                for (int i = 0; i < width; i++) {
+                    double eigen = scale*(rowEigen[i] + columnEigen[j]);
+                    coeffs[i + j*width] = eigen > 0.0 ? coeffs[i + j*width]/eigen : 0.0;
+                }
+            }
+        });
+
+        columnPass(true, pool);
+        rowPass(true, pool);
+        copy(coeffs.begin(), coeffs.end(), p);
+
+        int tw = width, th = COLUMN_GROUP;
+        partialError.assign(ThreadPool::tileCount(width, height, tw, th), 0.0);
+        pool.forEachTile(width, height, tw, th, [&](const Tile &t, int) {
+            double m = 0.0;
+            for (int index = t.y0*width; index < t.y1*width; index++)
+                m = max(m, fabs(r[index]/scale - stencil.apply(p, index))/stencil.diagonal(index));
+            partialError[t.index] = m;
+        });
+
+        double error = *max_element(partialError.begin(), partialError.end());
+        return SolveStats{1, error, error < tolerance};
+    }
+};
+
+#endif
@@ -0,0 +1,771 @@
+
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "Arena.h"
+#include "PressureStencil.h"
+#include "Simd.h"
+#include "SolveStats.h"
+#include "Telemetry.h"
+#include "ThreadPool.h"
+#include "async_writer.h"
+
+using namespace std;
+
+/* Ensemble pressure solves stop once no cell of any member would change by
+ * more than this, the same tolerance as FluidSolver's
+ */
+const double ENSEMBLE_TOLERANCE = 1e-5;
+
+/* Members are padded to a multiple of this many bytes of values, one AVX2
+ * vector, so that every member loop runs whole vectors
+ */
+const int ENSEMBLE_VECTOR_BYTES = 32;
+
+/* Fluid quantity of every member of an ensemble, the counterpart of
+ * FluidQuantity. Values of all members at one grid point are stored side by
+ * side, `lanes' of them per point: member m of point (x, y) is at
+ * (x + y*width)*lanes + m. A kernel visiting a point therefore finds every
+ * member in one contiguous run and processes them a vector at a time.
+ *
+ * Like FluidQuantity it has a src and a dst buffer; advect() writes dst and
+ * flip() makes the result current.
+ */
+template<typename T>
+class EnsembleQuantity {
+    T *src;
+    T *dst;
+
+    int width;
+    int height;
+    /* Values stored per grid point, the member count padded to a vector */
+    int lanes;
+    /* Offset from the top left grid cell and grid cell size, as in
+     * FluidQuantity
+     */
+    double x_offset;
+    double y_offset;
+    double cell_size;
+    T x_limit;
+    T y_limit;
+
+    static T sampleLimit(int size) {
+        T limit = T(size - 1.001);
+        if (limit >= T(size - 1))
+            limit = nextafter(T(size - 1), T(0));
+        return limit;
+    }
+
+    static T lerp(T a, T b, T x) {
+        return a*(1 - x) + b*x;
+    }
+
+    /* The grid point lerp() interpolates from at position (x, y), and the
+     * fractional position past it. Clamps like FluidQuantity::lerp().
+     */
+    void locate(T x, T y, int &point, T &fx, T &fy) const {
+        x = min(max(x - T(x_offset), T(0)), x_limit);
+        y = min(max(y - T(y_offset), T(0)), y_limit);
+        int ix = (int)x;
+        int iy = (int)y;
+        fx = x - ix;
+        fy = y - iy;
+        point = ix + iy*width;
+    }
+
+    /* Samples every member at the same position (x, y) into out */
+    void sampleAll(T x, T y, T *out) const {
+        int point;
+        T fx, fy;
+        locate(x, y, point, fx, fy);
+        const T *x00 = src + point*lanes, *x10 = x00 + lanes;
+        const T *x01 = x00 + width*lanes, *x11 = x01 + lanes;
+        for (int m = 0; m < lanes; m++)
+            out[m] = lerp(lerp(x00[m], x10[m], fx), lerp(x01[m], x11[m], fx), fy);
+    }
+
+    /* Samples member m at (x, y) */
+    T sample(T x, T y, int m) const {
+        int point;
+        T fx, fy;
+        locate(x, y, point, fx, fy);
+        const T *c = src + point*lanes + m;
+        return lerp(lerp(c[0], c[lanes], fx), lerp(c[width*lanes], c[(width + 1)*lanes], fx), fy);
+    }
+
+    /* Advects cells x0 ... x1-1 of row y into dst, one member at a time.
+     * The grid point is the same for all members, so the velocity there
+     * is sampled once for all of them into uVel and vVel.
+     */
+    void advectRowScalar(int y, int x0, int x1, double timestep, const EnsembleQuantity &u,
+            const EnsembleQuantity &v, T *uVel, T *vVel) {
+        T scale = T(timestep/cell_size);
+        for (int x = x0; x < x1; x++) {
+            T px = x + x_offset;
+            T py = y + y_offset;
+            u.sampleAll(px, py, uVel);
+            v.sampleAll(px, py, vVel);
+
+            T *out = dst + (x + y*width)*lanes;
+            for (int m = 0; m < lanes; m++)
+                out[m] = sample(px - uVel[m]*scale, py - vVel[m]*scale, m);
+        }
+    }
+
+#ifdef FLUID_X86_KERNELS
+    typedef AVX2<T> V;
+    typedef typename V::Vec Vec;
+    static const int LANES = V::LANES;
+
+    __attribute__((target("avx2")))
+    static Vec lerpAVX2(Vec a, Vec b, Vec x) {
+        return V::add(V::mul(a, V::sub(V::set1(1), x)), V::mul(b, x));
+    }
+
+    /* Vector version of advectRowScalar, LANES members at a time. The
+     * velocity at the grid point takes contiguous loads; each member's
+     * backtraced sample lies in a different cell and is gathered. Performs
+     * the same operations in the same order as the scalar path.
+     */
+    __attribute__((target("avx2")))
+    void advectRowAVX2(int y, int x0, int x1, double timestep, const EnsembleQuantity &u,
+            const EnsembleQuantity &v) {
+        const Vec scale = V::set1(T(timestep/cell_size));
+        const Vec zero = V::zero();
+        const Vec xLimit = V::set1(x_limit), yLimit = V::set1(y_limit);
+
+        for (int x = x0; x < x1; x++) {
+            T px = x + x_offset;
+            T py = y + y_offset;
+            int uPoint, vPoint;
+            T ufx, ufy, vfx, vfy;
+            u.locate(px, py, uPoint, ufx, ufy);
+            v.locate(px, py, vPoint, vfx, vfy);
+            const T *u00 = u.src + uPoint*lanes, *u01 = u00 + u.width*lanes;
+            const T *v00 = v.src + vPoint*lanes, *v01 = v00 + v.width*lanes;
+
+            T *out = dst + (x + y*width)*lanes;
+            for (int m = 0; m < lanes; m += LANES) {
+                /* Trace back through the velocity field */
+                Vec uVel = lerpAVX2(lerpAVX2(V::load(u00 + m), V::load(u00 + lanes + m), V::set1(ufx)),
+                                    lerpAVX2(V::load(u01 + m), V::load(u01 + lanes + m), V::set1(ufx)), V::set1(ufy));
+                Vec vVel = lerpAVX2(lerpAVX2(V::load(v00 + m), V::load(v00 + lanes + m), V::set1(vfx)),
+                                    lerpAVX2(V::load(v01 + m), V::load(v01 + lanes + m), V::set1(vfx)), V::set1(vfy));
+                Vec bx = V::sub(V::set1(px), V::mul(uVel, scale));
+                Vec by = V::sub(V::set1(py), V::mul(vVel, scale));
+
+                bx = V::min(V::max(V::sub(bx, V::set1(x_offset)), zero), xLimit);
+                by = V::min(V::max(V::sub(by, V::set1(y_offset)), zero), yLimit);
+                typename V::Index ix = V::truncate(bx);
+                typename V::Index iy = V::truncate(by);
+                bx = V::sub(bx, V::convert(ix));
+                by = V::sub(by, V::convert(iy));
+
+                typename V::Index point = V::linearIndex(ix, iy, width);
+                Vec x00 = V::gatherStrided(src, point, lanes, m);
+                Vec x10 = V::gatherStrided(src + lanes, point, lanes, m);
+                Vec x01 = V::gatherStrided(src + width*lanes, point, lanes, m);
+                Vec x11 = V::gatherStrided(src + (width + 1)*lanes, point, lanes, m);
+
+                V::store(out + m, lerpAVX2(lerpAVX2(x00, x10, bx), lerpAVX2(x01, x11, bx), by));
+            }
+        }
+    }
+#endif
+
+public:
+    /* Quantity of a w x h grid on buffers owned by the caller, each of
+     * w*h*lanes values, aligned to a vector and zero
+     */
+    EnsembleQuantity(int w, int h, int valueLanes, double xo, double yo, double hx, T *source, T *destination)
+            : src(source), dst(destination), width(w), height(h), lanes(valueLanes),
+              x_offset(xo), y_offset(yo), cell_size(hx), x_limit(sampleLimit(w)), y_limit(sampleLimit(h)) {}
+
+    void flip() {
+        swap(src, dst);
+    }
+
+    /* The values of all members at grid point (x, y) */
+    T *at(int x, int y) {
+        return src + (x + y*width)*lanes;
+    }
+    const T *at(int x, int y) const {
+        return src + (x + y*width)*lanes;
+    }
+
+    /* Advects the cells of one tile into dst, see FluidQuantity::advect() */
+    void advectTile(const Tile &tile, double timestep, const EnsembleQuantity &u, const EnsembleQuantity &v) {
+#ifdef FLUID_X86_KERNELS
+        if (cpuHasAVX2()) {
+            for (int y = tile.y0; y < tile.y1; y++)
+                advectRowAVX2(y, tile.x0, tile.x1, timestep, u, v);
+            return;
+        }
+#endif
+        vector<T> uVel(lanes), vVel(lanes);
+        for (int y = tile.y0; y < tile.y1; y++)
+            advectRowScalar(y, tile.x0, tile.x1, timestep, u, v, uVel.data(), vVel.data());
+    }
+
+    /* Advects every member, with tiles spread over `pool' */
+    void advect(double timestep, const EnsembleQuantity &u, const EnsembleQuantity &v, ThreadPool &pool) {
+        /* Reads of u, v and src plus the write to dst */
+        pool.forEachTile(width, height, 4*lanes*sizeof(T), [&](const Tile &tile, int) {
+            advectTile(tile, timestep, u, v);
+        });
+    }
+
+    /* Largest magnitude of any member's value in one tile */
+    T maxAbsTile(const Tile &tile) const {
+        T m = 0;
+        for (int y = tile.y0; y < tile.y1; y++) {
+            const T *row = src + (tile.x0 + y*width)*lanes;
+            for (int i = 0; i < (tile.x1 - tile.x0)*lanes; i++)
+                m = max(m, fabs(row[i]));
+        }
+        return m;
+    }
+
+    /* Sets member m inside the given rect to `v', see
+     * FluidQuantity::addInflow()
+     */
+    void addInflow(int m, double x0, double y0, double x1, double y1, double v) {
+        int ix0 = (int)(x0/cell_size - x_offset);
+        int iy0 = (int)(y0/cell_size - y_offset);
+        int ix1 = (int)(x1/cell_size - x_offset);
+        int iy1 = (int)(y1/cell_size - y_offset);
+
+        for (int y = max(iy0, 0); y < min(iy1, height); y++) {
+            for (int x = max(ix0, 0); x < min(ix1, width); x++) {
+                T &value = at(x, y)[m];
+                if (fabs(value) < fabs(v))
+                    value = T(v);
+            }
+        }
+    }
+};
+
+/* Runs many independent simulations of the same grid in lockstep, e.g. a
+ * sweep over inflow rates and densities. Each member is what a FluidSolver
+ * with the red-black SOR solver would compute, but all members are stored
+ * interleaved (see EnsembleQuantity) and every kernel advances all of them
+ * at once: a cell's stencil and interpolation weights are worked out once
+ * and applied to a vector of members. On small grids, where one simulation
+ * leaves most of a core's vector lanes and most cores idle, this keeps both
+ * busy.
+ *
+ * Members share the grid size, the solid cells and the thread pool. Each
+ * has its own fluid density and inflows. They also share the timestep:
+ * advance() picks substeps from the fastest member, and a pressure solve
+ * runs until the slowest member converges.
+ *
+ * Frames of all members go to one FrameWriter through submitFrames(), so a
+ * sweep produces a single output file instead of one per run.
+ *
+ * Like FluidSolver, the ensemble is instantiated for T = float and double
+ * at the end of this file.
+ */
+template<typename T>
+class FluidEnsemble {
+    /* Fluid quantities of all members */
+    EnsembleQuantity<T> *d;
+    EnsembleQuantity<T> *ux;
+    EnsembleQuantity<T> *uy;
+
+    int width;
+    int height;
+    int members;
+    /* Values per grid point, members padded to a vector. Padding members
+     * have no inflow and stay at rest.
+     */
+    int lanes;
+
+    double cell_size;
+    /* Fluid density of each member, 1 for the padding */
+    vector<double> densities;
+    /* Per-member factors of the current step: the pressure scale of the
+     * solve and the one applied to the velocities
+     */
+    vector<T> solveScale;
+    vector<T> velocityScale;
+
+    /* Right hand side and pressure of all members, interleaved like the
+     * quantities. p has a ghost margin of width + 1 points on either side,
+     * as in GhostedArray.
+     */
+    T *r;
+    T *p;
+
+    Arena *arena;
+    PressureStencil *cells;
+    ThreadPool *pool;
+
+    /* Over-relaxation factor, 0 to pick the optimum for the grid size */
+    double sorOmega;
+    vector<double> sorPartials;
+    vector<double> velocityPartials;
+    SolveStats lastSolve;
+
+    /* Staging buffer for one member's frame, see submitFrames() */
+    vector<float> frame;
+
+    double simTime;
+
+
+    static T weight(unsigned mask, unsigned bit) {
+        return T(PressureStencil::weight(mask, bit));
+    }
+
+    /* Rebuilds the pressure stencil if cell types changed and clears the
+     * pressure outside of fluid cells, see FluidSolver::updateCells()
+     */
+    void updateCells() {
+        if (!cells->needsRebuild())
+            return;
+
+        cells->rebuild();
+        for (int i = 0; i < width*height; i++)
+            if (!cells->fluid(i))
+                fill(p + i*lanes, p + (i + 1)*lanes, T(0));
+    }
+
+    /* Builds the right hand side of every member as the negative
+     * divergence, see FluidSolver::rhsRow()
+     */
+    void buildRHS() {
+        TELEMETRY_SCOPE(STAGE_BUILD_RHS);
+
+        T scale = T(1.0/cell_size);
+        pool->forEachTile(width, height, 3*lanes*sizeof(T), [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int x = t.x0; x < t.x1; x++) {
+                    int index = x + y*width;
+                    unsigned f = cells->faces(index);
+                    T fluid = T(cells->fluid(index));
+                    T wLeft = weight(f, NEIGHBOUR_LEFT), wRight = weight(f, NEIGHBOUR_RIGHT);
+                    T wDown = weight(f, NEIGHBOUR_DOWN), wUp = weight(f, NEIGHBOUR_UP);
+                    const T *left = ux->at(x, y), *right = ux->at(x + 1, y);
+                    const T *down = uy->at(x, y), *up = uy->at(x, y + 1);
+
+                    T *rhs = r + index*lanes;
+                    for (int m = 0; m < lanes; m++)
+                        rhs[m] = -scale*fluid*(wRight*right[m] - wLeft*left[m] + wUp*up[m] - wDown*down[m]);
+                }
+            }
+        });
+    }
+
+    /* Red-black SOR update of the cells of row y in x0 ... x1-1 of the given
+     * colour, for every member. Returns the largest change a Gauss-Seidel
+     * update would have made, see FluidSolver::sorRowScalar().
+     */
+    T sorRowScalar(int y, int x0, int x1, int color, T omega) {
+        const T *s = solveScale.data();
+        T maxDelta = 0;
+        for (int x = x0 + ((x0 + y + color) & 1); x < x1; x += 2) {
+            int index = x + y*width;
+            T count = T(cells->diagonal(index));
+            if (count == 0)
+                continue;
+
+            unsigned nb = cells->neighbours(index);
+            T wLeft = weight(nb, NEIGHBOUR_LEFT), wDown = weight(nb, NEIGHBOUR_DOWN);
+            T wRight = weight(nb, NEIGHBOUR_RIGHT), wUp = weight(nb, NEIGHBOUR_UP);
+            T *c = p + index*lanes;
+            const T *left = c - lanes, *down = c - width*lanes;
+            const T *right = c + lanes, *up = c + width*lanes;
+            const T *rhs = r + index*lanes;
+
+            for (int m = 0; m < lanes; m++) {
+                T diag = s[m]*count;
+                T offDiag = 0;
+                offDiag -= (s[m]*wLeft )*left[m];
+                offDiag -= (s[m]*wDown )*down[m];
+                offDiag -= (s[m]*wRight)*right[m];
+                offDiag -= (s[m]*wUp   )*up[m];
+
+                T newP = (rhs[m] - offDiag)/diag;
+                maxDelta = max(maxDelta, fabs(c[m] - newP));
+                c[m] += omega*(newP - c[m]);
+            }
+        }
+        return maxDelta;
+    }
+
+#ifdef FLUID_X86_KERNELS
+    typedef AVX2<T> V;
+    typedef typename V::Vec Vec;
+    static const int LANES = V::LANES;
+
+    /* Vector version of sorRowScalar, LANES members at a time. Unlike
+     * FluidSolver's, which vectorizes along the row and has to mask out
+     * the other colour, every lane here is a member updating the same cell.
+     */
+    __attribute__((target("avx2")))
+    T sorRowAVX2(int y, int x0, int x1, int color, T omega) {
+        const T *s = solveScale.data();
+        const Vec w = V::set1(omega);
+        const Vec absMask = V::absMask();
+        Vec maxDelta = V::zero();
+        for (int x = x0 + ((x0 + y + color) & 1); x < x1; x += 2) {
+            int index = x + y*width;
+            T count = T(cells->diagonal(index));
+            if (count == 0)
+                continue;
+
+            unsigned nb = cells->neighbours(index);
+            Vec wLeft = V::set1(weight(nb, NEIGHBOUR_LEFT)), wDown = V::set1(weight(nb, NEIGHBOUR_DOWN));
+            Vec wRight = V::set1(weight(nb, NEIGHBOUR_RIGHT)), wUp = V::set1(weight(nb, NEIGHBOUR_UP));
+            T *c = p + index*lanes;
+            const T *rhs = r + index*lanes;
+
+            for (int m = 0; m < lanes; m += LANES) {
+                Vec sm = V::loadu(s + m);
+                Vec diag = V::mul(sm, V::set1(count));
+                Vec offDiag = V::sub(V::zero(), V::mul(V::mul(sm, wLeft), V::load(c - lanes + m)));
+                offDiag = V::sub(offDiag, V::mul(V::mul(sm, wDown ), V::load(c - width*lanes + m)));
+                offDiag = V::sub(offDiag, V::mul(V::mul(sm, wRight), V::load(c + lanes + m)));
+                offDiag = V::sub(offDiag, V::mul(V::mul(sm, wUp   ), V::load(c + width*lanes + m)));
+
+                Vec center = V::load(c + m);
+                Vec newP = V::div(V::sub(V::load(rhs + m), offDiag), diag);
+                Vec change = V::sub(newP, center);
+                maxDelta = V::max(maxDelta, V::bitAnd(change, absMask));
+                V::store(c + m, V::add(center, V::mul(w, change)));
+            }
+        }
+        return V::maxLane(maxDelta);
+    }
+#endif
+
+    /* Solves for the pressure of every member with red-black SOR, starting
+     * from the last step's. Cells of one colour only depend on the other
+     * colour, so each colour sweep runs its tiles in parallel.
+     */
+    SolveStats project(int limit) {
+        TELEMETRY_SCOPE(STAGE_PROJECT);
+
+        double omega = sorOmega;
+        if (omega <= 0.0)
+            omega = 2.0/(1.0 + sin(M_PI/max(width, height)));
+        T w = T(omega);
+
+        int tw, th;
+        ThreadPool::tileSize(width, height, 2*lanes*sizeof(T), tw, th);
+        sorPartials.assign(ThreadPool::tileCount(width, height, tw, th), 0.0);
+
+        double maxDelta = 0.0;
+        for (int iter = 0; iter < limit; iter++) {
+            for (int color = 0; color < 2; color++) {
+                pool->forEachTile(width, height, tw, th, [&](const Tile &t, int) {
+                    double m = 0.0;
+                    for (int y = t.y0; y < t.y1; y++) {
+#ifdef FLUID_X86_KERNELS
+                        if (cpuHasAVX2())
+                            m = max(m, (double)sorRowAVX2(y, t.x0, t.x1, color, w));
+                        else
+#endif
+                        m = max(m, (double)sorRowScalar(y, t.x0, t.x1, color, w));
+                    }
+                    sorPartials[t.index] = max(color ? sorPartials[t.index] : 0.0, m);
+                });
+            }
+
+            maxDelta = *max_element(sorPartials.begin(), sorPartials.end());
+            TELEMETRY_COUNT(COUNTER_SWEEP_ERROR, maxDelta);
+            if (maxDelta < ENSEMBLE_TOLERANCE)
+                return SolveStats{iter + 1, maxDelta, true};
+        }
+        return SolveStats{limit, maxDelta, false};
+    }
+
+    /* Applies every member's pressure to its velocities, see
+     * FluidSolver::applyPressure(). Tiles own the left and bottom faces of
+     * their cells; faces on the domain border are solid and set to zero.
+     */
+    void applyPressure() {
+        TELEMETRY_SCOPE(STAGE_APPLY_PRESSURE);
+        const T *s = velocityScale.data();
+
+        /* Updates the face between cell `index' and the one `offset' cells
+         * before it, whose velocities are at u
+         */
+        auto face = [&](T *u, int index, int offset, unsigned bit) {
+            T open = weight(cells->faces(index), bit);
+            const T *before = p + (index - offset)*lanes, *after = p + index*lanes;
+            for (int m = 0; m < lanes; m++)
+                u[m] = open*((u[m] + s[m]*before[m]) - s[m]*after[m]);
+        };
+
+        pool->forEachTile(width, height, 5*lanes*sizeof(T), [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int x = t.x0; x < t.x1; x++) {
+                    int index = x + y*width;
+                    if (x == 0)
+                        fill(ux->at(0, y), ux->at(0, y) + lanes, T(0));
+                    else
+                        face(ux->at(x, y), index, 1, NEIGHBOUR_LEFT);
+                    if (y == 0)
+                        fill(uy->at(x, 0), uy->at(x, 0) + lanes, T(0));
+                    else
+                        face(uy->at(x, y), index, width, NEIGHBOUR_DOWN);
+                }
+                if (t.x1 == width)
+                    fill(ux->at(width, y), ux->at(width, y) + lanes, T(0));
+            }
+            if (t.y1 == height)
+                for (int x = t.x0; x < t.x1; x++)
+                    fill(uy->at(x, height), uy->at(x, height) + lanes, T(0));
+        });
+    }
+
+    /* Largest magnitude of q, a w x h quantity, over all members */
+    double maxAbs(const EnsembleQuantity<T> &q, int w, int h) {
+        int tw, th;
+        ThreadPool::tileSize(w, h, lanes*sizeof(T), tw, th);
+        velocityPartials.assign(ThreadPool::tileCount(w, h, tw, th), 0.0);
+        pool->forEachTile(w, h, tw, th, [&](const Tile &t, int) {
+            velocityPartials[t.index] = q.maxAbsTile(t);
+        });
+        return *max_element(velocityPartials.begin(), velocityPartials.end());
+    }
+
+public:
+    /* An ensemble of `count' members on a w x h grid, all at rest with
+     * density 1 until set otherwise
+     */
+    FluidEnsemble(int w, int h, int count) : width(w), height(h), members(count) {
+        cell_size = 1.0/min(w, h);
+        int perVector = ENSEMBLE_VECTOR_BYTES/sizeof(T);
+        lanes = (members + perVector - 1)/perVector*perVector;
+        densities.assign(lanes, 1.0);
+        solveScale.assign(lanes, T(0));
+        velocityScale.assign(lanes, T(0));
+
+        /* Every buffer is zero and, from the arena, vector aligned; points
+         * are a multiple of a vector long so all of them stay aligned
+         */
+        arena = new Arena();
+        size_t points = (size_t)w*h;
+        size_t d0 = arena->reserve<T>(points*lanes), d1 = arena->reserve<T>(points*lanes);
+        size_t ux0 = arena->reserve<T>((points + h)*lanes), ux1 = arena->reserve<T>((points + h)*lanes);
+        size_t uy0 = arena->reserve<T>((points + w)*lanes), uy1 = arena->reserve<T>((points + w)*lanes);
+        size_t rOffset = arena->reserve<T>(points*lanes);
+        size_t pOffset = arena->reserve<T>((points + 2*(w + 1))*lanes);
+        arena->allocate(HUGE_PAGES_NONE);
+
+        d  = new EnsembleQuantity<T>(w,     h,     lanes, 0.5, 0.5, cell_size, arena->at<T>(d0),  arena->at<T>(d1));
+        ux = new EnsembleQuantity<T>(w + 1, h,     lanes, 0.0, 0.5, cell_size, arena->at<T>(ux0), arena->at<T>(ux1));
+        uy = new EnsembleQuantity<T>(w,     h + 1, lanes, 0.5, 0.0, cell_size, arena->at<T>(uy0), arena->at<T>(uy1));
+        r = arena->at<T>(rOffset);
+        p = arena->at<T>(pOffset) + (w + 1)*lanes;
+
+        cells = new PressureStencil(width, height);
+        pool = new ThreadPool();
+        sorOmega = 0.0;
+        lastSolve = SolveStats{0, 0.0, true};
+        simTime = 0.0;
+    }
+
+    ~FluidEnsemble() {
+        delete d;
+        delete ux;
+        delete uy;
+        delete arena;
+        delete cells;
+        delete pool;
+    }
+
+    FluidEnsemble(const FluidEnsemble &) = delete;
+    FluidEnsemble &operator=(const FluidEnsemble &) = delete;
+
+    /* Sets the number of threads all members are advanced with, including
+     * the calling thread. 0 uses one thread per hardware thread.
+     */
+    void setThreadCount(int threads) {
+        if (ThreadPool::resolveCount(threads) == pool->threadCount())
+            return;
+        delete pool;
+        pool = new ThreadPool(threads);
+    }
+
+    int threadCount() const {
+        return pool->threadCount();
+    }
+
+    int memberCount() const {
+        return members;
+    }
+
+    /* Sets the fluid density of one member */
+    void setDensity(int member, double density) {
+        densities[member] = density;
+    }
+
+    double density(int member) const {
+        return densities[member];
+    }
+
+    /* Sets the over-relaxation factor of the pressure solve, 0 to pick the
+     * optimum for the grid size
+     */
+    void setSOROmega(double omega) {
+        sorOmega = omega;
+    }
+
+    /* Bytes of field storage, for all members together */
+    size_t memoryFootprint() const {
+        return arena->footprint();
+    }
+
+    /* Sets the type of cell (x, y) for all members */
+    void setCellType(int x, int y, CellType type) {
+        cells->setType(x, y, type);
+    }
+
+    /* Makes the cells whose centers lie in the given rectangle solid for
+     * all members, see FluidSolver::addSolid()
+     */
+    void addSolid(double x, double y, double w, double h) {
+        int ix0 = (int)(x/cell_size - 0.5);
+        int iy0 = (int)(y/cell_size - 0.5);
+        int ix1 = (int)((x + w)/cell_size - 0.5);
+        int iy1 = (int)((y + h)/cell_size - 0.5);
+
+        for (int iy = max(iy0, 0); iy < min(iy1, height); iy++)
+            for (int ix = max(ix0, 0); ix < min(ix1, width); ix++)
+                cells->setType(ix, iy, CELL_SOLID);
+    }
+
+    /* Sets density and x/y velocity of one member in the given rectangle,
+     * see FluidSolver::addInflow()
+     */
+    void addInflow(int member, double x, double y, double w, double h, double density, double u, double v) {
+        d->addInflow(member, x, y, x + w, y + h, density);
+        ux->addInflow(member, x, y, x + w, y + h, u);
+        uy->addInflow(member, x, y, x + w, y + h, v);
+    }
+
+    /* Values of one member at a grid point of the density or either
+     * velocity component
+     */
+    T densityAt(int member, int x, int y) const {
+        return d->at(x, y)[member];
+    }
+    T uxAt(int member, int x, int y) const {
+        return ux->at(x, y)[member];
+    }
+    T uyAt(int member, int x, int y) const {
+        return uy->at(x, y)[member];
+    }
+
+    /* Largest magnitude of any velocity sample of any member */
+    double maxVelocity() {
+        return max(maxAbs(*ux, width + 1, height), maxAbs(*uy, width, height + 1));
+    }
+
+    /* Longest timestep in which nothing in any member moves further than
+     * `cfl' cells
+     */
+    double cflTimestep(double cfl) {
+        double u = maxVelocity();
+        return u > 0.0 ? cfl*cell_size/u : INFINITY;
+    }
+
+    /* Advances all members by `timestep' in substeps that keep the CFL
+     * number at or below `cfl', see FluidSolver::advance(). Returns the
+     * number of substeps taken.
+     */
+    int advance(double timestep, double cfl) {
+        int substeps = 0;
+        double remaining = timestep;
+        while (remaining > 0.0) {
+            double steps = ceil(remaining/cflTimestep(cfl)*(1.0 - 1e-9));
+            if (steps > 1.0) {
+                double step = remaining/steps;
+                update(step);
+                remaining -= step;
+            } else {
+                update(remaining);
+                remaining = 0.0;
+            }
+            substeps++;
+        }
+        TELEMETRY_COUNT(COUNTER_SUBSTEPS, substeps);
+        return substeps;
+    }
+
+    /* Advances all members by one timestep, see FluidSolver::update() */
+    void update(double timestep) {
+        TELEMETRY_STEP();
+        for (int m = 0; m < lanes; m++) {
+            solveScale[m] = T(timestep/(densities[m]*cell_size*cell_size));
+            velocityScale[m] = T(timestep/(densities[m]*cell_size));
+        }
+
+        updateCells();
+        buildRHS();
+        lastSolve = project(600);
+        TELEMETRY_COUNT(COUNTER_SOLVE_ITERATIONS, lastSolve.iterations);
+        TELEMETRY_COUNT(COUNTER_SOLVE_ERROR, lastSolve.maxError);
+        applyPressure();
+
+        TELEMETRY_SCOPE(STAGE_ADVECT);
+        d->advect(timestep, *ux, *uy, *pool);
+        ux->advect(timestep, *ux, *uy, *pool);
+        uy->advect(timestep, *ux, *uy, *pool);
+        d->flip();
+        ux->flip();
+        uy->flip();
+
+        simTime += timestep;
+    }
+
+    /* Outcome of the last pressure solve, over all members */
+    const SolveStats &lastSolveStats() const {
+        return lastSolve;
+    }
+
+    double time() const {
+        return simTime;
+    }
+
+    /* Values per cell of the frames submitFrames() writes: density and the
+     * center velocity
+     */
+    static const int FRAME_COMPONENTS = 3;
+
+    /* Queues one frame per member, in member order, to `sink', whose
+     * FrameWriter must be made with rows = width, cols = height and
+     * FRAME_COMPONENTS components. Frame k of the file is member
+     * k % memberCount() after k / memberCount() calls. Returns the number
+     * of frames the sink dropped.
+     */
+    int submitFrames(AsyncFrameWriter &sink) {
+        TELEMETRY_SCOPE(STAGE_OUTPUT);
+        frame.resize((size_t)width*height*FRAME_COMPONENTS);
+        int dropped = 0;
+        for (int m = 0; m < members; m++) {
+            for (int x = 0; x < width; x++) {
+                for (int y = 0; y < height; y++) {
+                    float *out = frame.data() + ((size_t)x*height + y)*FRAME_COMPONENTS;
+                    out[0] = float(d->at(x, y)[m]);
+                    out[1] = float(0.5*(ux->at(x, y)[m] + ux->at(x + 1, y)[m]));
+                    out[2] = float(0.5*(uy->at(x, y)[m] + uy->at(x, y + 1)[m]));
+                }
+            }
+            if (!sink.submitFrame(frame.data()))
+                dropped++;
+        }
+        return dropped;
+    }
+};
+
+template class EnsembleQuantity<float>;
+template class EnsembleQuantity<double>;
+template class FluidEnsemble<float>;
+template class FluidEnsemble<double>;
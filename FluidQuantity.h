@@ -2,15 +2,21 @@
 
 #include <algorithm>
 #include <math.h>
+#include <new>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "Simd.h"
+#include "ThreadPool.h"
+
 
 using namespace std;
 
 /* This is the class representing fluid quantities such as density and velocity
  * on the MAC grid. It saves attributes such as offset from the top left grid
- * cell, grid width and height as well as cell size.
+ * cell, grid width and height as well as cell size. Values, and the
+ * arithmetic on them, have type T: float or double.
  * 
  * It also contains two memory buffers: A source (src) buffer and a
  * destination (dst) buffer.
@@ -21,68 +27,395 @@ using namespace std;
  * completed, flip() can be called to swap the source and destination buffers,
  * such that the result of the operation is visible to subsequent operations.
  */
+template<typename T>
 class FluidQuantity {
-    /* Memory buffers for fluid quantity */
-    double *src;
-    double *dst;
+    /* Memory buffers for fluid quantity, freed with the quantity if owned */
+    T *src;
+    T *dst;
+    bool owned;
 
     /* Width and height */
     int width;
     int height;
+    /* Values between the starts of consecutive rows, at least width */
+    int stride;
     /* X and Y offset from top left grid cell.
      * This is (0.5,0.5) for centered quantities such as density,
      * and (0.0, 0.5) or (0.5, 0.0) for quantities like the velocity.
      */
     double x_offset;
     double y_offset;
+    /* Row of the whole domain that row 0 of this grid is, nonzero for the
+     * slabs of a decomposed domain (see SlabDomain.h)
+     */
+    int y_origin;
     /* Grid cell size */
     double cell_size;
+    /* Largest x and y that lerp() samples at, in grid cells. Just short of
+     * the last cell so that interpolation never reads past it.
+     */
+    T x_limit;
+    T y_limit;
+    
+    /* The largest value of T below `size' - 1 by about 0.001. At very large
+     * sizes float can't represent the gap, so it takes the next value down.
+     */
+    static T sampleLimit(int size) {
+        T limit = T(size - 1.001);
+        if (limit >= T(size - 1))
+            limit = nextafter(T(size - 1), T(0));
+        return limit;
+    }
+    
+    /* Advects cells x0 ... x1-1 of row y into dst, one cell at a time */
+    void advectRowScalar(int y, int x0, int x1, double timestep, const FluidQuantity &u, const FluidQuantity &v) {
+        T scale = T(timestep/cell_size);
+        
+        for (int x = x0, index = x0 + y*stride; x < x1; x++, index++) {
+            T px = x + x_offset;
+            T py = y + y_offset;
+            
+            /* Trace back through the velocity field */
+            T uVel = u.lerp(px, py);
+            T vVel = v.lerp(px, py);
+            px -= uVel*scale;
+            py -= vVel*scale;
+            
+            dst[index] = lerp(px, py);
+        }
+    }
+    
+    /* Largest magnitude among cells x0 ... x1-1 of row y. NaNs are skipped. */
+    T maxAbsRowScalar(int y, int x0, int x1) const {
+        /* Two running maxima so consecutive compares don't wait on each other */
+        T m0 = 0, m1 = 0;
+        const T *row = src + y*stride;
+        int x = x0;
+        for (; x + 2 <= x1; x += 2) {
+            m0 = max(m0, fabs(row[x]));
+            m1 = max(m1, fabs(row[x + 1]));
+        }
+        for (; x < x1; x++)
+            m0 = max(m0, fabs(row[x]));
+        return max(m0, m1);
+    }
+    
+#ifdef FLUID_X86_KERNELS
+    typedef AVX2<T> V;
+    typedef typename V::Vec Vec;
+    static const int LANES = V::LANES;
+    
+    /* Describes where the grid points of one row of this quantity fall in the
+     * grid of another quantity `f'. Offsets are multiples of one half, so
+     * every point of the row has the same fractional position in f and,
+     * away from the borders, sampling f there only needs contiguous loads
+     * from two of its rows.
+     */
+    struct RowSampler {
+        const T *row0; /* Row of f above the points, shifted so that */
+        const T *row1; /* row0[x] is the left neighbour of point x   */
+        T fx, fy;      /* Fractional position inside the f cell      */
+        int x0, x1;    /* Range of x for which f.lerp does no clamping */
+    };
+    
+    RowSampler rowSampler(const FluidQuantity &f, int y) const {
+        RowSampler s;
+        
+        double sx = x_offset - f.x_offset;
+        int shift = (int)floor(sx);
+        s.fx = sx - shift;
+        s.x0 = max((int)ceil(-sx), 0);
+        s.x1 = (int)floor(f.x_limit - sx) + 1;
+        
+        /* The row is a single y position, so clamp it exactly like lerp does */
+        T sy = min(max(T(y + y_offset) - T(f.y_offset), T(0)), f.y_limit);
+        int iy = (int)sy;
+        s.fy = sy - iy;
+        s.row0 = f.src + iy*f.stride + shift;
+        s.row1 = s.row0 + f.stride;
+        
+        return s;
+    }
+    
+    /* Vector version of lerp(a, b, x) */
+    __attribute__((target("avx2")))
+    static Vec lerpAVX2(Vec a, Vec b, Vec x) {
+        return V::add(V::mul(a, V::sub(V::set1(1), x)), V::mul(b, x));
+    }
+    
+    /* Samples f at the grid points starting at x described by s using plain
+     * loads
+     */
+    __attribute__((target("avx2")))
+    static Vec sampleAVX2(const RowSampler &s, int x) {
+        Vec fx = V::set1(s.fx);
+        Vec top    = lerpAVX2(V::loadu(s.row0 + x), V::loadu(s.row0 + x + 1), fx);
+        Vec bottom = lerpAVX2(V::loadu(s.row1 + x), V::loadu(s.row1 + x + 1), fx);
+        return lerpAVX2(top, bottom, V::set1(s.fy));
+    }
+    
+    /* Vector version of lerp(x, y) at arbitrary positions: clamps them,
+     * fetches the four surrounding values of every lane and interpolates.
+     * Performs the same operations in the same order as the scalar path, so
+     * results match it exactly.
+     */
+    __attribute__((target("avx2")))
+    Vec lerpAVX2(Vec x, Vec y) const {
+        const Vec zero = V::zero();
+        
+        x = V::min(V::max(V::sub(x, V::set1(x_offset)), zero), V::set1(x_limit));
+        y = V::min(V::max(V::sub(y, V::set1(y_offset)), zero), V::set1(y_limit));
+        
+        /* Positions are non-negative after clamping, so truncation is floor */
+        typename V::Index ix = V::truncate(x);
+        typename V::Index iy = V::truncate(y);
+        x = V::sub(x, V::convert(ix));
+        y = V::sub(y, V::convert(iy));
+        
+        Vec x00, x10, x01, x11;
+        V::corners(src, V::linearIndex(ix, iy, stride), stride, x00, x10, x01, x11);
+        
+        return lerpAVX2(lerpAVX2(x00, x10, x), lerpAVX2(x01, x11, x), y);
+    }
+    
+    /* Advects cells xBegin ... xEnd-1 of row y a vector at a time.
+     * Velocities at the grid points are read with contiguous loads; only
+     * the backtraced sample needs per-lane loads.
+     * The few cells near the left and right borders, where sampling the
+     * velocity would clamp, go through the scalar path.
+     */
+    __attribute__((target("avx2")))
+    void advectRowAVX2(int y, int xBegin, int xEnd, double timestep, const FluidQuantity &u, const FluidQuantity &v) {
+        RowSampler su = rowSampler(u, y);
+        RowSampler sv = rowSampler(v, y);
+        int x0 = min(max(max(su.x0, sv.x0), xBegin), xEnd);
+        int x1 = max(min(min(su.x1, sv.x1), xEnd), x0);
+        
+        advectRowScalar(y, xBegin, x0, timestep, u, v);
+        
+        const Vec scale = V::set1(T(timestep/cell_size));
+        const Vec py0 = V::set1(T(y + y_offset));
+        const Vec lane = V::ramp();
+        T *out = dst + y*stride;
+        
+        int x = x0;
+        for (; x + LANES <= x1; x += LANES) {
+            Vec px = V::add(V::add(V::set1(x), lane), V::set1(x_offset));
+            
+            /* Trace back through the velocity field */
+            Vec uVel = sampleAVX2(su, x);
+            Vec vVel = sampleAVX2(sv, x);
+            px = V::sub(px, V::mul(uVel, scale));
+            Vec py = V::sub(py0, V::mul(vVel, scale));
+            
+            V::storeu(out + x, lerpAVX2(px, py));
+        }
+        
+        advectRowScalar(y, x, xEnd, timestep, u, v);
+    }
+    
+    /* Vector version of maxAbsRowScalar with the same result. The tail is
+     * handled here rather than by the scalar version, whose SSE code would
+     * pay for a transition out of AVX on every row.
+     */
+    __attribute__((target("avx2")))
+    T maxAbsRowAVX2(int y, int x0, int x1) const {
+        const Vec magnitude = V::absMask();
+        const T *row = src + y*stride;
+        Vec m0 = V::zero();
+        Vec m1 = V::zero();
+        
+        /* max returns its second operand if either is NaN */
+        int x = x0;
+        for (; x + 2*LANES <= x1; x += 2*LANES) {
+            m0 = V::max(V::bitAnd(V::loadu(row + x), magnitude), m0);
+            m1 = V::max(V::bitAnd(V::loadu(row + x + LANES), magnitude), m1);
+        }
+        T m = V::maxLane(V::max(m0, m1));
+        for (; x < x1; x++)
+            m = max(m, fabs(row[x]));
+        return m;
+    }
+#endif
     
 public:
     FluidQuantity(int w, int h, double xo, double yo, double hx)
-            : width(w), height(h), x_offset(xo), y_offset(yo), cell_size(hx) {
-        src = new double[width*height];
-        dst = new double[width*height];
-                
-        memset(src, 0, width*height*sizeof(double));
+            : owned(true), width(w), height(h), stride(w), x_offset(xo), y_offset(yo), y_origin(0), cell_size(hx),
+              x_limit(sampleLimit(w)), y_limit(sampleLimit(h)) {
+        /* Both buffers start out zero */
+        src = (T *)calloc(width*height, sizeof(T));
+        dst = (T *)calloc(width*height, sizeof(T));
+        if (!src || !dst)
+            throw bad_alloc();
     }
     
+    /* Quantity on buffers owned by the caller, e.g. carved out of an
+     * Arena, with rows `rowStride' values apart. Both must be zero.
+     */
+    FluidQuantity(int w, int h, double xo, double yo, double hx, T *source, T *destination, int rowStride)
+            : src(source), dst(destination), owned(false), width(w), height(h), stride(rowStride),
+              x_offset(xo), y_offset(yo), y_origin(0), cell_size(hx), x_limit(sampleLimit(w)), y_limit(sampleLimit(h)) {}
+    
     ~FluidQuantity() {
-        delete[] src;
-        delete[] dst;
+        if (owned) {
+            free(src);
+            free(dst);
+        }
     }
     
     void flip() {
         swap(src, dst);
     }
     
+    /* Copies both buffers of `q', a quantity of the same size */
+    void copyFrom(const FluidQuantity &q) {
+        for (int y = 0; y < height; y++) {
+            memcpy(src + y*stride, q.src + y*q.stride, width*sizeof(T));
+            memcpy(dst + y*stride, q.dst + y*q.stride, width*sizeof(T));
+        }
+    }
+    
     
     /* Read-only and read-write access to grid cells */
-    double at(int x, int y) const {
-        return src[x + y*width];
+    T at(int x, int y) const {
+        return src[x + y*stride];
     }
     
-    double &at(int x, int y) {
-        return src[x + y*width];
+    T &at(int x, int y) {
+        return src[x + y*stride];
+    }
+    
+    /* The whole grid, cell (x, y) at index x + y*rowStride() */
+    T *data() {
+        return src;
+    }
+    const T *data() const {
+        return src;
+    }
+    
+    int rowStride() const {
+        return stride;
+    }
+    
+    /* Makes row 0 stand for row `row' of the whole domain in addInflow() */
+    void setRowOrigin(int row) {
+        y_origin = row;
     }
     
    
     
-    /* Advect grid in velocity field u, v with given timestep */
-    void advect(double timestep, const FluidQuantity &u, const FluidQuantity &v) {
-       
+    /* Linear interpolate between a and b for x ranging from 0 to 1 */
+    static T lerp(T a, T b, T x) {
+        return a*(1 - x) + b*x;
     }
     
-    /* Sets fluid quantity inside the given rect to value `v' */
+    /* Bilinear interpolation at position (x,y) given in grid cells.
+     * The position is clamped to the grid, so samples outside of it take the
+     * value of the nearest border cell.
+     */
+    T lerp(T x, T y) const {
+        x = min(max(x - T(x_offset), T(0)), x_limit);
+        y = min(max(y - T(y_offset), T(0)), y_limit);
+        int ix = (int)x;
+        int iy = (int)y;
+        x -= ix;
+        y -= iy;
+        
+        T x00 = at(ix + 0, iy + 0), x10 = at(ix + 1, iy + 0);
+        T x01 = at(ix + 0, iy + 1), x11 = at(ix + 1, iy + 1);
+        
+        return lerp(lerp(x00, x10, x), lerp(x01, x11, x), y);
+    }
+    
+    /* Advect grid in velocity field u, v with given timestep.
+     * This is a semi-Lagrangian step: every grid point is traced back through
+     * the velocity field with forward Euler and takes the bilinearly
+     * interpolated value found there. The result goes into dst; call flip()
+     * to make it visible.
+     * Rows are processed by the widest kernel the CPU supports and, if a
+     * thread pool is given, tiles of the grid are spread over its threads.
+     */
+    void advect(double timestep, const FluidQuantity &u, const FluidQuantity &v, ThreadPool *pool = 0) {
+        if (!pool) {
+            advectTile(Tile{0, 0, width, height, 0}, timestep, u, v);
+            return;
+        }
+        
+        /* Reads of u, v and src plus the write to dst */
+        pool->forEachTile(width, height, 4*sizeof(T), [&](const Tile &tile, int) {
+            advectTile(tile, timestep, u, v);
+        });
+    }
+    
+    /* Advects the cells of one tile into dst */
+    void advectTile(const Tile &tile, double timestep, const FluidQuantity &u, const FluidQuantity &v) {
+#ifdef FLUID_X86_KERNELS
+        if (cpuHasAVX2()) {
+            for (int y = tile.y0; y < tile.y1; y++)
+                advectRowAVX2(y, tile.x0, tile.x1, timestep, u, v);
+            return;
+        }
+#endif
+        for (int y = tile.y0; y < tile.y1; y++)
+            advectRowScalar(y, tile.x0, tile.x1, timestep, u, v);
+    }
+    
+    /* Portable version of advect(), also used to check the vector kernels */
+    void advectScalar(double timestep, const FluidQuantity &u, const FluidQuantity &v) {
+        for (int y = 0; y < height; y++)
+            advectRowScalar(y, 0, width, timestep, u, v);
+    }
+    
+    /* Largest magnitude of any value in one tile of the grid */
+    T maxAbsTile(const Tile &tile) const {
+        T m = 0;
+#ifdef FLUID_X86_KERNELS
+        if (cpuHasAVX2()) {
+            for (int y = tile.y0; y < tile.y1; y++)
+                m = max(m, maxAbsRowAVX2(y, tile.x0, tile.x1));
+            return m;
+        }
+#endif
+        for (int y = tile.y0; y < tile.y1; y++)
+            m = max(m, maxAbsRowScalar(y, tile.x0, tile.x1));
+        return m;
+    }
+    
+    /* Smallest and largest value in one tile of the grid */
+    void rangeTile(const Tile &tile, T &lo, T &hi) const {
+        lo = hi = src[tile.x0 + tile.y0*stride];
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                lo = min(lo, src[x + y*stride]);
+                hi = max(hi, src[x + y*stride]);
+            }
+        }
+    }
+    
+    /* Sets one tile of the grid to `v' in both buffers, so that it keeps
+     * that value through flip() without being advected
+     */
+    void fillTile(const Tile &tile, T v) {
+        for (int y = tile.y0; y < tile.y1; y++) {
+            for (int x = tile.x0; x < tile.x1; x++) {
+                src[x + y*stride] = v;
+                dst[x + y*stride] = v;
+            }
+        }
+    }
+    
+    /* Sets fluid quantity inside the given rect to value `v'. The rect is
+     * in coordinates of the whole domain.
+     */
     void addInflow(double x0, double y0, double x1, double y1, double v) {
         int ix0 = (int)(x0/cell_size - x_offset);
-        int iy0 = (int)(y0/cell_size - y_offset);
+        int iy0 = (int)(y0/cell_size - y_offset) - y_origin;
         int ix1 = (int)(x1/cell_size - x_offset);
-        int iy1 = (int)(y1/cell_size - y_offset);
+        int iy1 = (int)(y1/cell_size - y_offset) - y_origin;
         
         for (int y = max(iy0, 0); y < min(iy1, height); y++)
-            for (int x = max(ix0, 0); x < min(ix1, height); x++)
-                if (fabs(src[x + y*width]) < fabs(v))
-                    src[x + y*width] = v;
+            for (int x = max(ix0, 0); x < min(ix1, width); x++)
+                if (fabs(src[x + y*stride]) < fabs(v))
+                    src[x + y*stride] = T(v);
     }
 };
\ No newline at end of file
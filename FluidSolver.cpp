@@ -1,15 +1,67 @@
 
 
 #include"FluidQuantity.h"
+#include "ActiveTiles.h"
+#include "Arena.h"
+#include "DCTSolver.h"
+#include "Multigrid.h"
+#include "PCGSolver.h"
+#include "PressureStencil.h"
+#include "SlabDomain.h"
+#include "SolveStats.h"
+#include "Telemetry.h"
+#include "checkpoint.h"
+
+/* Pressure solves stop once no cell would change by more than this */
+const double PRESSURE_TOLERANCE = 1e-5;
+
+/* Methods available for the pressure solve in project() */
+enum PressureSolver {
+    SOLVER_GAUSS_SEIDEL,       /* Lexicographic Gauss-Seidel */
+    SOLVER_MULTIGRID,          /* Geometric multigrid V-cycles, see Multigrid.h */
+    SOLVER_CONJUGATE_GRADIENT, /* MIC(0) preconditioned CG, see PCGSolver.h */
+    SOLVER_RED_BLACK_SOR       /* Parallel red-black ordered SOR */
+};
+
+/* What the pressure solve starts from each timestep */
+enum WarmStart {
+    WARM_START_NONE,        /* Zero pressure */
+    WARM_START_PREVIOUS,    /* The previous step's pressure */
+    WARM_START_EXTRAPOLATE  /* Linear extrapolation from the last two steps */
+};
+
+/* Default thresholds below which a tile counts as quiescent, see
+ * setSparse(): the spread of density across the tile and the largest
+ * velocity component, in domain lengths per second. Smoke decides what is
+ * active; the velocity threshold only keeps strong motion without smoke
+ * alive. Lower ones keep the weak flow the pressure solve spreads through
+ * the whole box, which leaves no tile quiet for long.
+ */
+const double ACTIVE_DENSITY_THRESHOLD = 1e-3;
+const double ACTIVE_VELOCITY_THRESHOLD = 0.5;
+
+/* Iterative refinement asks each correction solve to reduce the error by
+ * this factor
+ */
+const double REFINEMENT_REDUCTION = 1e-2;
 
 /* Fluid solver class. Sets up the fluid quantities, forces incompressibility
  * performs advection and adds inflows.
+ *
+ * All fields and kernels work in the scalar type T, float or double; both
+ * are instantiated at the end of this file. Float halves the memory traffic
+ * and doubles the cells per vector instruction. The multigrid and CG
+ * solvers always work in double, on double copies of p and r if T is float.
  */
+template<typename T>
 class FluidSolver {
+    /* Times the stages of update() one at a time, see benchmark.cpp */
+    friend struct FluidSolverBenchmark;
+    
     /* Fluid quantities */
-    FluidQuantity *d;
-    FluidQuantity *ux;
-    FluidQuantity *uy;
+    FluidQuantity<T> *d;
+    FluidQuantity<T> *ux;
+    FluidQuantity<T> *uy;
     
     /* Width and height */
     int width;
@@ -20,124 +72,1558 @@ class FluidSolver {
     double fluid_density;
     
     /* Arrays for: */
-    double *r; /* Right hand side of pressure solve */
-    double *p; /* Pressure solution */
+    T *r; /* Right hand side of pressure solve */
+    T *p; /* Pressure solution, with a ghost margin as in GhostedArray */
     
+    /* Storage for d, ux, uy, r and p, see allocateFields() */
+    Arena *arena;
+    HugePages hugePages;
     
-    /* Builds the pressure right hand side as the negative divergence */
-    void buildRHS() {
-        double scale = 1.0/cell_size;
+    /* Cell types and the pressure stencil built from them */
+    PressureStencil *cells;
+    
+    /* Threads that the per-cell kernels are spread over */
+    ThreadPool *pool;
+    
+    /* This process's part of a domain split into slabs, 0 if it solves
+     * the whole domain, see the constructor
+     */
+    SlabDomain *slab;
+    
+    /* Method used by project(), and the state of the methods that need any */
+    PressureSolver pressureSolver;
+    Multigrid *multigrid;
+    PCGSolver *pcg;
+    bool parallelPreconditioner;
+    
+    /* Direct solver taking over on grids without obstacles, if enabled */
+    DCTSolver *dct;
+    bool directSolve;
+    
+    /* Over-relaxation factor of the red-black solver, 0 to pick the optimum
+     * for the grid size
+     */
+    double sorOmega;
+    /* Per-tile maxima of the red-black sweeps */
+    vector<double> sorPartials;
+    /* Per-iteration maxima of each band and band boundary, see blockedSOR() */
+    vector<double> blockPartials;
+    /* Per-tile maxima of the velocity reduction */
+    vector<double> velocityPartials;
+    
+    /* Initial guess of the pressure solve. `lastP' holds the solution of
+     * the step before the one in p, valid if `pressureHistory' is 2.
+     */
+    WarmStart warmStart;
+    vector<T> lastP;
+    int pressureHistory;
+    
+    /* When measuring, every solve is repeated from zero pressure into
+     * `coldP' to count the iterations warm starting saved
+     */
+    bool measureWarmStart;
+    GhostedArrayOf<T> coldP;
+    WarmStartStats warmStats;
+    
+    /* Double copies of p and r for the solvers that need them, see
+     * widen(). `wideP' also holds the solution during iterative refinement.
+     */
+    GhostedArray wideP;
+    vector<double> wideR;
+    
+    /* Whether Gauss-Seidel and SOR solves with float T are refined in
+     * double, see refine(). Correction solves run on `correction' and
+     * `residual' in place of p and r.
+     */
+    bool mixedPrecision;
+    GhostedArrayOf<T> correction;
+    vector<T> residual;
+    vector<double> residualPartials;
+    
+    /* Simulated time, advanced by update() */
+    double simTime;
+    
+    /* Tiles the kernels run on when sparse, 0 to run on the whole grid */
+    ActiveTiles *active;
+    double densityThreshold;
+    double velocityThreshold;
+    
+    /* Whether the first Gauss-Seidel or SOR sweep builds the right hand
+     * side as it goes instead of buildRHS(), and whether the current solve
+     * still has to
+     */
+    bool fusedKernels;
+    bool rhsPending;
+    /* Red-black iterations run per pass over memory, see setTemporalBlocking() */
+    int blockSweeps;
+    /* Estimated memory traffic of the last step */
+    TrafficStats traffic;
+    /* Outcome of the last pressure solve */
+    SolveStats lastSolve;
+    
+    
+    /* Bytes per cell each kernel streams, for `traffic': the T arrays it
+     * reads or writes plus the stencil bytes it reads. A sweep reads and
+     * writes p and reads r; a fused sweep writes r instead and also reads
+     * ux and uy. Advection reads the quantity and both velocities and
+     * writes the quantity, for each of the three quantities.
+     */
+    static const int RHS_BYTES = 3*sizeof(T) + 2;
+    static const int SWEEP_BYTES = 3*sizeof(T) + 2;
+    static const int FUSED_SWEEP_BYTES = 5*sizeof(T) + 4;
+    static const int PRESSURE_BYTES = 5*sizeof(T) + 1;
+    static const int ADVECT_BYTES = 3*4*sizeof(T);
+    
+    /* PressureStencil's weight() and diagonal() in the solver's precision */
+    static T weight(unsigned mask, unsigned bit) {
+        return T(PressureStencil::weight(mask, bit));
+    }
+    T diagonal(int index) const {
+        return T(cells->diagonal(index));
+    }
+    
+    /* Returns `v' as an array of doubles with a ghost margin: v itself if it
+     * already is one, else a copy in `wide'
+     */
+    double *widen(double *v, GhostedArray &) {
+        return v;
+    }
+    double *widen(float *v, GhostedArray &wide) {
+        if (wide.empty())
+            wide.resize(width, height);
+        double *w = wide.data();
+        for (int i = 0; i < width*height; i++)
+            w[i] = v[i];
+        return w;
+    }
+    /* Same for a right hand side, which needs no margin */
+    const double *widen(const double *v, vector<double> &) {
+        return v;
+    }
+    const double *widen(const float *v, vector<double> &wide) {
+        wide.assign(v, v + width*height);
+        return wide.data();
+    }
+    /* Copies a widened array back into `v' */
+    void narrow(const double *, double *) {}
+    void narrow(const double *w, float *v) {
+        for (int i = 0; i < width*height; i++)
+            v[i] = float(w[i]);
+    }
+    
+    /* Runs kernel(tile, thread) over the tiles the per-cell kernels cover:
+     * the active ones if sparse, else all tiles sized for `bytesPerCell'.
+     * Returns the number of tile indices, for sizing per-tile partials.
+     */
+    template<typename Kernel>
+    int forEachActiveTile(int bytesPerCell, const Kernel &kernel) {
+        if (active) {
+            pool->forEachTile(active->tiles(), kernel);
+            return active->tileCount();
+        }
+        int tw, th;
+        ThreadPool::tileSize(width, height, bytesPerCell, tw, th);
+        pool->forEachTile(width, height, tw, th, kernel);
+        return ThreadPool::tileCount(width, height, tw, th);
+    }
+    
+    /* Runs kernel(tile, thread) over the tiles a pressure sweep covers:
+     * those of forEachActiveTile(), or only the owned rows of a slab, whose
+     * halo rows hold the neighbours' pressure. Tiles are numbered within
+     * activeTileSlots().
+     */
+    template<typename Kernel>
+    void forEachSweepTile(int bytesPerCell, const Kernel &kernel) {
+        if (!slab) {
+            forEachActiveTile(bytesPerCell, kernel);
+            return;
+        }
+        int tw, th;
+        ThreadPool::tileSize(width, height, bytesPerCell, tw, th);
+        int below = slab->haloBelow();
+        pool->forEachTile(width, slab->ownedRows(), tw, th, [&](const Tile &t, int thread) {
+            kernel(Tile{t.x0, t.y0 + below, t.x1, t.y1 + below, t.index}, thread);
+        });
+    }
+    
+    /* Number of tile indices forEachActiveTile() hands out */
+    int activeTileSlots(int bytesPerCell) const {
+        if (active)
+            return active->tileCount();
+        int tw, th;
+        ThreadPool::tileSize(width, height, bytesPerCell, tw, th);
+        return ThreadPool::tileCount(width, height, tw, th);
+    }
+    
+    /* Number of cells forEachActiveTile() covers */
+    long coveredCells() const {
+        return active ? active->cellCount() : (long)width*height;
+    }
+    
+    /* Whether the pressure solve is restricted to the active tiles, which
+     * Gauss-Seidel and SOR are when sparse
+     */
+    bool solvesOnActiveTiles() const {
+        return !solvesDirectly() && (pressureSolver == SOLVER_GAUSS_SEIDEL || pressureSolver == SOLVER_RED_BLACK_SOR);
+    }
+    
+    /* Whether this step's pressure solve goes to the direct solver */
+    bool solvesDirectly() const {
+        return directSolve && !slab && DCTSolver::applies(width, height, *cells);
+    }
+    
+    /* Whether the cells right of or above tile t are outside the region the
+     * kernels cover, in which case t looks after the faces on that side
+     */
+    bool ownsRight(const Tile &t) const {
+        return t.x1 == width || (active && !active->activeAt(t.x1, t.y0));
+    }
+    bool ownsTop(const Tile &t) const {
+        return t.y1 == height || (active && !active->activeAt(t.x0, t.y1));
+    }
+    
+    /* The samples of ux (dx = 1) or uy (dy = 1) that tile t updates: those
+     * on its cells' left or bottom faces, plus the far side if t owns it
+     */
+    Tile faceTile(const Tile &t, int dx, int dy) const {
+        return Tile{t.x0, t.y0, t.x1 + (dx && ownsRight(t)), t.y1 + (dy && ownsTop(t)), t.index};
+    }
+    
+    /* Marks the active tiles that still hold motion or density detail as
+     * hot and updates the active set. Tiles that drop out are set to a
+     * constant: velocity and pressure zero and density the middle of its
+     * range, which differ from before by less than the thresholds.
+     */
+    void refreshActiveTiles() {
+        /* Reads d, ux and uy */
+        pool->forEachTile(active->tiles(), [&](const Tile &t, int) {
+            T lo, hi;
+            d->rangeTile(t, lo, hi);
+            T speed = max(ux->maxAbsTile(faceTile(t, 1, 0)), uy->maxAbsTile(faceTile(t, 0, 1)));
+            if (hi - lo > densityThreshold || speed > velocityThreshold)
+                active->markHot(t.index);
+        });
         
-        for (int y = 0, index = 0; y < height; y++) {
-            for (int x = 0; x < width; x++, index++) {
-                r[index] = -scale*(ux->at(x + 1, y) - ux->at(x, y) +
-                                  uy->at(x, y + 1) - uy->at(x, y));
+        active->refresh([&](const Tile &t) {
+            T lo, hi;
+            d->rangeTile(t, lo, hi);
+            d->fillTile(t, lo + (hi - lo)/2);
+            ux->fillTile(t, 0);
+            uy->fillTile(t, 0);
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int x = t.x0, index = t.x0 + y*width; x < t.x1; x++, index++) {
+                    p[index] = 0;
+                    r[index] = 0;
+                    if (!lastP.empty())
+                        lastP[index] = 0;
+                }
+            }
+        });
+    }
+    
+    
+    /* Where allocateFields() puts each field in the arena */
+    struct FieldLayout {
+        size_t d[2], ux[2], uy[2];
+        size_t r, p;
+        /* Zeroed values in front of p, at least a row and a value */
+        int pMargin;
+    };
+    
+    /* Lays out the fields of a w x h solver in `arena'. Quantities get
+     * padded rows, see paddedRow(); r and p are indexed by the stencils as
+     * x + y*width and so are left unpadded.
+     */
+    static FieldLayout layOut(Arena &arena, int w, int h) {
+        FieldLayout l;
+        for (int i = 0; i < 2; i++) {
+            l.d[i]  = arena.reserve<T>((size_t)paddedRow(w,     sizeof(T))*h);
+            l.ux[i] = arena.reserve<T>((size_t)paddedRow(w + 1, sizeof(T))*h);
+            l.uy[i] = arena.reserve<T>((size_t)paddedRow(w,     sizeof(T))*(h + 1));
+        }
+        l.r = arena.reserve<T>((size_t)w*h);
+        l.pMargin = paddedRow(w + 1, sizeof(T));
+        l.p = arena.reserve<T>((size_t)w*h + 2*l.pMargin);
+        return l;
+    }
+    
+    /* Moves the fields into a new arena backed by `hugePages', keeping
+     * their contents. Every tile of every field is written first by the
+     * thread the kernels hand that tile to, so on NUMA machines pages end
+     * up next to the threads that use them. With huge pages a page spans
+     * many tiles, and lands with whichever touches it first. This makes
+     * the whole arena resident up front, also when sparse; inactive tiles
+     * keep their storage anyway, see setSparse().
+     */
+    void allocateFields() {
+        Arena *next = new Arena();
+        FieldLayout l = layOut(*next, width, height);
+        try {
+            next->allocate(hugePages);
+        } catch (...) {
+            delete next;
+            throw;
+        }
+        
+        FluidQuantity<T> *nd = new FluidQuantity<T>(width, height, 0.5, 0.5, cell_size,
+                next->at<T>(l.d[0]), next->at<T>(l.d[1]), paddedRow(width, sizeof(T)));
+        FluidQuantity<T> *nux = new FluidQuantity<T>(width + 1, height, 0.0, 0.5, cell_size,
+                next->at<T>(l.ux[0]), next->at<T>(l.ux[1]), paddedRow(width + 1, sizeof(T)));
+        FluidQuantity<T> *nuy = new FluidQuantity<T>(width, height + 1, 0.5, 0.0, cell_size,
+                next->at<T>(l.uy[0]), next->at<T>(l.uy[1]), paddedRow(width, sizeof(T)));
+        T *nr = next->at<T>(l.r);
+        T *np = next->at<T>(l.p) + l.pMargin;
+        if (slab) {
+            nd->setRowOrigin(slab->localOrigin());
+            nux->setRowOrigin(slab->localOrigin());
+            nuy->setRowOrigin(slab->localOrigin());
+        }
+        
+        /* Zeroes columns x0 ... x1-1 of rows y0 ... y1-1 of a buffer */
+        auto touch = [](T *buffer, int stride, int x0, int y0, int x1, int y1) {
+            for (int y = y0; y < y1; y++)
+                memset(buffer + x0 + y*stride, 0, (x1 - x0)*sizeof(T));
+        };
+        
+        /* Same tiles as advect(), the kernel touching the most fields. The
+         * last column and row of faces go with the border tiles.
+         */
+        pool->forEachTile(width, height, 4*sizeof(T), [&](const Tile &t, int) {
+            for (int i = 0; i < 2; i++) {
+                touch(next->at<T>(l.d[i]), nd->rowStride(), t.x0, t.y0, t.x1, t.y1);
+                touch(next->at<T>(l.ux[i]), nux->rowStride(), t.x0, t.y0, t.x1 + (t.x1 == width), t.y1);
+                touch(next->at<T>(l.uy[i]), nuy->rowStride(), t.x0, t.y0, t.x1, t.y1 + (t.y1 == height));
             }
+            touch(nr, width, t.x0, t.y0, t.x1, t.y1);
+            touch(np, width, t.x0, t.y0, t.x1, t.y1);
+        });
+        
+        if (arena) {
+            nd->copyFrom(*d);
+            nux->copyFrom(*ux);
+            nuy->copyFrom(*uy);
+            memcpy(nr, r, width*height*sizeof(T));
+            memcpy(np, p, width*height*sizeof(T));
+            delete d;
+            delete ux;
+            delete uy;
+            delete arena;
+        }
+        d = nd;
+        ux = nux;
+        uy = nuy;
+        r = nr;
+        p = np;
+        arena = next;
+    }
+    
+    /* Rebuilds the pressure stencil if cell types changed since the last
+     * step. Pressure is only kept for fluid cells, so it is cleared
+     * everywhere else.
+     */
+    void updateCells() {
+        if (!cells->needsRebuild())
+            return;
+        
+        cells->rebuild();
+        for (int i = 0; i < width*height; i++)
+            if (!cells->fluid(i))
+                p[i] = 0;
+        
+        /* Pressure from before the change is a poor trend to extrapolate */
+        pressureHistory = min(pressureHistory, 1);
+    }
+    
+    /* Builds the pressure right hand side of cells x0 ... x1-1 of row y as
+     * the negative divergence. Faces next to solid cells don't let anything
+     * through, and the right hand side is zero wherever pressure isn't
+     * solved for.
+     */
+    void rhsRow(int y, int x0, int x1) {
+        T scale = T(1.0/cell_size);
+        for (int x = x0, index = x0 + y*width; x < x1; x++, index++) {
+            unsigned f = cells->faces(index);
+            r[index] = -scale*T(cells->fluid(index))*(
+                    weight(f, NEIGHBOUR_RIGHT)*ux->at(x + 1, y) -
+                    weight(f, NEIGHBOUR_LEFT )*ux->at(x, y) +
+                    weight(f, NEIGHBOUR_UP   )*uy->at(x, y + 1) -
+                    weight(f, NEIGHBOUR_DOWN )*uy->at(x, y));
+        }
+    }
+    
+    /* Builds the pressure right hand side in a pass of its own */
+    void buildRHS() {
+        TELEMETRY_SCOPE(STAGE_BUILD_RHS);
+        
+        /* Reads ux, uy and writes r */
+        auto kernel = [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++)
+                rhsRow(y, t.x0, t.x1);
+        };
+        
+        /* Solvers that work on the whole grid need a consistent right hand
+         * side everywhere
+         */
+        if (active && !solvesOnActiveTiles()) {
+            pool->forEachTile(width, height, 3*sizeof(T), kernel);
+            traffic.rhs += (long)width*height*RHS_BYTES;
+        } else {
+            forEachActiveTile(3*sizeof(T), kernel);
+            traffic.rhs += coveredCells()*RHS_BYTES;
         }
     }
     
+    /* Whether this step's right hand side is left to the first sweep of the
+     * pressure solve. Only the plain Gauss-Seidel and SOR solves can, and
+     * only when they run once per step.
+     */
+    bool fusesRHS() const {
+        bool refined = mixedPrecision && sizeof(T) < sizeof(double);
+        return fusedKernels && solvesOnActiveTiles() && !refined && !measureWarmStart && !slab;
+    }
+    
+    /* Gauss-Seidel update of cell `index'. Returns the change it made */
+    T relax(int index, T s) {
+        /* Here we apply the matrix implicitly as the five-point stencil
+         * precomputed from the cell types, see PressureStencil.h. The
+         * neighbour weights are folded into scale, which keeps them off the
+         * dependency chain through p.
+         */
+        T diag = s*diagonal(index);
+        if (diag == 0)
+            return 0;
+        
+        unsigned m = cells->neighbours(index);
+        T offDiag = 0;
+        offDiag -= (s*weight(m, NEIGHBOUR_LEFT ))*p[index - 1];
+        offDiag -= (s*weight(m, NEIGHBOUR_DOWN ))*p[index - width];
+        offDiag -= (s*weight(m, NEIGHBOUR_RIGHT))*p[index + 1];
+        offDiag -= (s*weight(m, NEIGHBOUR_UP   ))*p[index + width];
+        
+        T newP = (r[index] - offDiag)/diag;
+        T delta = fabs(p[index] - newP);
+        
+        p[index] = newP;
+        return delta;
+    }
+    
     /* Performs the pressure solve using Gauss-Seidel.
      * The solver will run as long as it takes to get the relative error below
-     * a threshold, but will never exceed `limit' iterations
+     * `tolerance', but will never exceed `limit' iterations. When sparse,
+     * sweeps visit the active tiles one after another.
      */
-    void project(int limit, double timestep) {
-        double scale = timestep/(fluid_density*cell_size*cell_size);
+    SolveStats gaussSeidel(int limit, double scale, double tolerance) {
+        T s = T(scale);
+        T maxDelta = 0;
+        for (int iter = 0; iter < limit; iter++) {
+            maxDelta = 0;
+            /* A row's right hand side is only read by the row itself */
+            auto sweepRow = [&](int y, int x0, int x1) {
+                if (rhsPending)
+                    rhsRow(y, x0, x1);
+                for (int index = x0 + y*width; index < x1 + y*width; index++)
+                    maxDelta = max(maxDelta, relax(index, s));
+            };
+            if (active) {
+                const vector<Tile> &tiles = active->tiles();
+                for (size_t k = 0; k < tiles.size(); k++)
+                    for (int y = tiles[k].y0; y < tiles[k].y1; y++)
+                        sweepRow(y, tiles[k].x0, tiles[k].x1);
+            } else {
+                for (int y = 0; y < height; y++)
+                    sweepRow(y, 0, width);
+            }
+            traffic.solve += coveredCells()*(rhsPending ? FUSED_SWEEP_BYTES : SWEEP_BYTES);
+            rhsPending = false;
+            TELEMETRY_COUNT(COUNTER_SWEEP_ERROR, maxDelta);
+
+            if (maxDelta < tolerance)
+                return SolveStats{iter + 1, maxDelta, true};
+        }
         
-        double maxDelta;
+        return SolveStats{limit, maxDelta, false};
+    }
+    
+    /* Red-black SOR update of cells x0 ... x1-1 of row y that have the given
+     * colour, i.e. (x + y) % 2 == color. Returns the largest change a plain
+     * Gauss-Seidel update would have made, as in gaussSeidel().
+     */
+    T sorRowScalar(int y, int x0, int x1, int color, T scale, T omega) {
+        T maxDelta = 0;
+        for (int x = x0 + ((x0 + y + color) & 1); x < x1; x += 2) {
+            int index = x + y*width;
+            
+            T diag = scale*diagonal(index);
+            if (diag == 0)
+                continue;
+            
+            unsigned m = cells->neighbours(index);
+            T offDiag = 0;
+            offDiag -= (scale*weight(m, NEIGHBOUR_LEFT ))*p[index - 1];
+            offDiag -= (scale*weight(m, NEIGHBOUR_DOWN ))*p[index - width];
+            offDiag -= (scale*weight(m, NEIGHBOUR_RIGHT))*p[index + 1];
+            offDiag -= (scale*weight(m, NEIGHBOUR_UP   ))*p[index + width];
+            
+            T newP = (r[index] - offDiag)/diag;
+            maxDelta = max(maxDelta, fabs(p[index] - newP));
+            p[index] += omega*(newP - p[index]);
+        }
+        return maxDelta;
+    }
+    
+#ifdef FLUID_X86_KERNELS
+    typedef AVX2<T> V;
+    typedef typename V::Vec Vec;
+    static const int LANES = V::LANES;
+    
+    /* Vector version of sorRowScalar, LANES cells wide. Updates every lane of
+     * a block of consecutive cells and only stores the lanes of the given
+     * colour that are fluid. That doubles the arithmetic but needs only
+     * contiguous loads, and is safe because cells of one colour only read
+     * the other one. Neighbours are masked with the stencil bits instead of
+     * tested, so the same code handles the domain border and obstacles;
+     * blocks that are entirely interior fluid skip building the masks.
+     *
+     * Results are computed for a run of cells before any of them is stored.
+     * Storing each block right away would make the next block's load of its
+     * left neighbours straddle that store, which can't be forwarded and
+     * stalls every iteration.
+     */
+    __attribute__((target("avx2")))
+    T sorRowAVX2(int y, int x0, int x1, int color, T scale, T omega) {
+        const int RUN = 32;
+        const Vec s = V::set1(scale);
+        const Vec w = V::set1(omega);
+        const Vec absMask = V::absMask();
+        const Vec allLanes = V::allOnes();
+        const Vec interiorDiag = V::mul(s, V::set1(4));
+        const uint8_t *diagonals  = cells->diagonalData() + y*width;
+        const uint8_t *neighbours = cells->neighbourData() + y*width;
+        T *row = p + y*width;
+        
+        alignas(32) T relaxed[RUN];
+        alignas(32) T update[RUN];
+        Vec maxDelta = V::zero();
+        int x = x0;
+        while (x + LANES <= x1) {
+            int n = min(RUN, (x1 - x) & ~(LANES - 1));
+            /* Lanes of the given colour in a block starting at this x */
+            Vec colorLanes = V::alternateLanes((x + y + color) & 1);
+            
+            for (int k = 0; k < n; k += LANES) {
+                T *c = row + x + k;
+                Vec left, down, right, up, diag, lanes;
+                if (V::allBytes(neighbours + x + k, 0x0f)) {
+                    /* Common case: fluid with four fluid neighbours, no
+                     * masking needed
+                     */
+                    left = down = right = up = allLanes;
+                    diag = interiorDiag;
+                    lanes = colorLanes;
+                } else {
+                    typename V::Lanes nb = V::loadBytes(neighbours + x + k);
+                    left  = V::bitLanes(nb, NEIGHBOUR_LEFT);
+                    down  = V::bitLanes(nb, NEIGHBOUR_DOWN);
+                    right = V::bitLanes(nb, NEIGHBOUR_RIGHT);
+                    up    = V::bitLanes(nb, NEIGHBOUR_UP);
+                    diag = V::mul(s, V::loadCounts(diagonals + x + k));
+                    lanes = V::andNot(V::isZero(diag), colorLanes);
+                }
+                
+                Vec center = V::loadu(c);
+                Vec offDiag = V::sub(V::zero(), V::mul(s, V::bitAnd(left, V::loadu(c - 1))));
+                offDiag = V::sub(offDiag, V::mul(s, V::bitAnd(down, V::loadu(c - width))));
+                offDiag = V::sub(offDiag, V::mul(s, V::bitAnd(right, V::loadu(c + 1))));
+                offDiag = V::sub(offDiag, V::mul(s, V::bitAnd(up, V::loadu(c + width))));
+                
+                Vec newP = V::div(V::sub(V::loadu(r + y*width + x + k), offDiag), diag);
+                Vec change = V::sub(newP, center);
+                
+                maxDelta = V::max(maxDelta, V::bitAnd(V::bitAnd(change, absMask), lanes));
+                V::store(relaxed + k, V::add(center, V::mul(w, change)));
+                V::store(update + k, lanes);
+            }
+            for (int k = 0; k < n; k += LANES)
+                V::maskStore(row + x + k, V::load(update + k), V::load(relaxed + k));
+            x += n;
+        }
+        
+        return max(V::maxLane(maxDelta), sorRowScalar(y, x, x1, color, scale, omega));
+    }
+#endif
+    
+    /* One colour sweep of red-black SOR over cells x0 ... x1-1 of row y,
+     * vectorized where the CPU allows
+     */
+    double sorRow(int y, int x0, int x1, int color, T s, T w) {
+#ifdef FLUID_X86_KERNELS
+        if (cpuHasAVX2())
+            return sorRowAVX2(y, x0, x1, color, s, w);
+#endif
+        return sorRowScalar(y, x0, x1, color, s, w);
+    }
+    
+    /* One colour sweep of red-black SOR over the rows of tile t. With `rhs'
+     * set, builds each row's right hand side right before sweeping it.
+     */
+    double sorTile(const Tile &t, int color, T s, T w, bool rhs) {
+        double m = 0.0;
+        for (int y = t.y0; y < t.y1; y++) {
+            if (rhs)
+                rhsRow(y, t.x0, t.x1);
+            m = max(m, sorRow(y, t.x0, t.x1, color, s, w));
+        }
+        return m;
+    }
+    
+    /* Calls kernel(x0, x1) for the stretches of row y the pressure solve
+     * covers: the whole row, or its runs of active tiles when sparse
+     */
+    template<typename Kernel>
+    void forEachRowSpan(int y, const Kernel &kernel) {
+        if (!active) {
+            kernel(0, width);
+            return;
+        }
+        const int size = ActiveTiles::TILE_SIZE;
+        for (int x = 0; x < width; x += size) {
+            if (!active->activeAt(x, y))
+                continue;
+            int x0 = x;
+            while (x + size < width && active->activeAt(x + size, y))
+                x += size;
+            kernel(x0, min(x + size, width));
+        }
+    }
+    
+    /* Performs the pressure solve using red-black ordered successive
+     * over-relaxation. Cells of one colour only depend on cells of the other,
+     * so each colour sweep is split into tiles that run in parallel, with
+     * rows vectorized. Stops on the same criterion and budget as
+     * gaussSeidel().
+     */
+    SolveStats redBlackSOR(int limit, double scale, double tolerance) {
+        double omega = sorOmega;
+        if (omega <= 0.0) {
+            /* Optimal factor for the model problem on the longer side */
+            omega = 2.0/(1.0 + sin(M_PI/max(width, slab ? slab->domainRows() : height)));
+        }
+        T s = T(scale);
+        T w = T(omega);
+        
+        sorPartials.assign(activeTileSlots(2*sizeof(T)), 0.0);
+        if (blockSweeps > 1 && !slab)
+            return blockedSOR(limit, s, w, tolerance);
+        
+        /* Slabs colour cells by their row in the whole domain, and pass the
+         * pressure of their edge rows on after every colour, so that the
+         * sweeps are exactly those of a single process
+         */
+        int parity = slab ? slab->localOrigin() & 1 : 0;
+        double maxDelta = 0.0;
         for (int iter = 0; iter < limit; iter++) {
             maxDelta = 0.0;
-            for (int y = 0, index = 0; y < height; y++) {
-                for (int x = 0; x < width; x++, index++) {
-                    int index = x + y*width;
-                    
-                    double diag = 0.0, offDiag = 0.0;
-                    
-                    /* Here we build the matrix implicitly as the five-point
-                     * stencil. Grid borders are assumed to be solid, i.e.
-                     * there is no fluid outside the simulation domain.
+            for (int color = 0; color < 2; color++) {
+                forEachSweepTile(2*sizeof(T), [&](const Tile &t, int) {
+                    double m = sorTile(t, color ^ parity, s, w, rhsPending);
+                    sorPartials[t.index] = max(color ? sorPartials[t.index] : 0.0, m);
+                });
+                traffic.solve += coveredCells()*(rhsPending ? FUSED_SWEEP_BYTES : SWEEP_BYTES);
+                rhsPending = false;
+                if (slab)
+                    slab->exchange(p, width, width, 1);
+            }
+            
+            for (size_t i = 0; i < sorPartials.size(); i++)
+                maxDelta = max(maxDelta, sorPartials[i]);
+            if (slab)
+                maxDelta = slab->allreduceMax(maxDelta);
+            TELEMETRY_COUNT(COUNTER_SWEEP_ERROR, maxDelta);
+            
+            if (maxDelta < tolerance)
+                return SolveStats{iter + 1, maxDelta, true};
+        }
+        
+        return SolveStats{limit, maxDelta, false};
+    }
+    
+    /* Runs the half sweeps (y, h) of rows y0 ... y1-1 for which
+     * needed(y, h) holds as a wavefront. Half sweep h updates colour
+     * (h - 1) & 1 of a row from the other colour of its own and the
+     * neighbouring rows as of half sweep h - 1, so it may run once the row
+     * above has had half sweep h - 1 and before either neighbour has had
+     * h + 1. Going by y + 2h satisfies both, and keeps every row of the
+     * block in a window of about 2*levels rows. Half sweep h is part of
+     * iteration (h - 1)/2, whose largest change goes to partials. With
+     * `rhs', each row's right hand side is built as it enters the window.
+     */
+    template<typename Needed>
+    void sweepWavefront(int y0, int y1, int levels, T s, T w, bool rhs, double *partials, const Needed &needed) {
+        for (int step = y0 + 2; step < y1 + 2*levels; step++) {
+            if (rhs && step - 2 < y1)
+                forEachRowSpan(step - 2, [&](int x0, int x1) { rhsRow(step - 2, x0, x1); });
+            for (int h = 1; h <= levels; h++) {
+                int y = step - 2*h;
+                if (y < y0)
+                    break;
+                if (y >= y1 || !needed(y, h))
+                    continue;
+                double m = 0.0;
+                forEachRowSpan(y, [&](int x0, int x1) { m = max(m, sorRow(y, x0, x1, (h - 1) & 1, s, w)); });
+                partials[(h - 1)/2] = max(partials[(h - 1)/2], m);
+            }
+        }
+    }
+    
+    /* Red-black SOR with temporal blocking: runs `blockSweeps' iterations
+     * per pass over memory instead of one, and computes exactly the same
+     * iterations as redBlackSOR().
+     *
+     * The grid is cut into a band of rows per thread. Each band first runs
+     * as many half sweeps as it can without its neighbours, the fewer the
+     * closer a row is to the band's edge: a trapezoid in rows and half
+     * sweeps, run as a wavefront (see sweepWavefront()). Then the rows
+     * around each boundary between bands catch up from the trapezoids on
+     * either side. Only those rows are read twice per pass, while rows
+     * are kept in cache for all the iterations of a pass; about 4 times
+     * `blockSweeps' rows of p, r and the stencil should fit in L2.
+     *
+     * Convergence is still checked after every iteration, but a pass runs
+     * all of its iterations, so a solve may go on for up to `blockSweeps'
+     * minus one iterations after converging. Those count against `limit'.
+     */
+    SolveStats blockedSOR(int limit, T s, T w, double tolerance) {
+        /* Boundary rows catch up on up to 2*blockSweeps half sweeps on
+         * either side, which must not reach into the next boundary
+         */
+        int bands = max(1, min(pool->threadCount(), height/(4*blockSweeps + 2)));
+        auto bandStart = [&](int band) { return (int)((long)height*band/bands); };
+        
+        double maxDelta = 0.0;
+        int iterations = 0;
+        while (iterations < limit) {
+            int sweeps = min(blockSweeps, limit - iterations);
+            int levels = 2*sweeps;
+            blockPartials.assign((size_t)(2*bands - 1)*sweeps, 0.0);
+            bool rhs = rhsPending;
+            
+            pool->forEachTile(bands, 1, 1, 1, [&](const Tile &t, int) {
+                int a = bandStart(t.x0), c = bandStart(t.x0 + 1);
+                /* Rows next to another band wait for it */
+                int lo = a > 0, hi = c < height;
+                sweepWavefront(a, c, levels, s, w, rhs, &blockPartials[(size_t)t.x0*sweeps],
+                        [&](int y, int h) { return y >= a + lo*h && y < c - hi*h; });
+            });
+            if (bands > 1) {
+                pool->forEachTile(bands - 1, 1, 1, 1, [&](const Tile &t, int) {
+                    /* The trapezoids left row y at its distance to the
+                     * boundary in half sweeps
                      */
-                    if (x > 0) {
-                        diag    += scale;
-                        offDiag -= scale*p[index - 1];
-                    }
-                    if (y > 0) {
-                        diag    += scale;
-                        offDiag -= scale*p[index - width];
-                    }
-                    if (x < width - 1) {
-                        diag    += scale;
-                        offDiag -= scale*p[index + 1];
-                    }
-                    if (y < height - 1) {
-                        diag    += scale;
-                        offDiag -= scale*p[index + width];
-                    }
-
-                    double newP = (r[index] - offDiag)/diag;
-                    
-                    maxDelta = max(maxDelta, fabs(p[index] - newP));
-                    
-                    p[index] = newP;
-                }
+                    int b = bandStart(t.x0 + 1);
+                    sweepWavefront(max(b - levels, 0), min(b + levels, height), levels, s, w, false,
+                            &blockPartials[(size_t)(bands + t.x0)*sweeps],
+                            [&](int y, int h) { return h > (y < b ? b - 1 - y : y - b); });
+                });
             }
-
-            if (maxDelta < 1e-5) {
-                printf("Exiting solver after %d iterations, maximum error is %f\n", iter, maxDelta);
-                return;
+            traffic.solve += coveredCells()*(rhs ? FUSED_SWEEP_BYTES : SWEEP_BYTES);
+            traffic.solve += coveredCells()*(bands - 1)*2*levels/height*SWEEP_BYTES;
+            rhsPending = false;
+            
+            for (int i = 0; i < sweeps; i++) {
+                maxDelta = 0.0;
+                for (int k = 0; k < 2*bands - 1; k++)
+                    maxDelta = max(maxDelta, blockPartials[(size_t)k*sweeps + i]);
+                TELEMETRY_COUNT(COUNTER_SWEEP_ERROR, maxDelta);
             }
+            iterations += sweeps;
+            
+            if (maxDelta < tolerance)
+                return SolveStats{iterations, maxDelta, true};
         }
         
-        printf("Exceeded budget of %d iterations, maximum error was %f\n", limit, maxDelta);
+        return SolveStats{limit, maxDelta, false};
     }
     
-    /* Applies the computed pressure to the velocity field */
-    void applyPressure(double timestep) {
-        double scale = timestep/(fluid_density*cell_size);
+    /* Computes the residual r - A*x in double and stores it into
+     * `residual'. x needs a ghost margin. Returns the largest residual
+     * divided by its diagonal, the error measure of gaussSeidel().
+     */
+    double computeResidual(const double *x, double scale) {
+        residualPartials.assign(activeTileSlots(3*sizeof(double)), 0.0);
         
-        for (int y = 0, index = 0; y < height; y++) {
-            for (int x = 0; x < width; x++, index++) {
-                ux->at(x,     y    ) -= scale*p[index];
-                ux->at(x + 1, y    ) += scale*p[index];
-                uy->at(x,     y    ) -= scale*p[index];
-                uy->at(x,     y + 1) += scale*p[index];
+        forEachActiveTile(3*sizeof(double), [&](const Tile &t, int) {
+            double m = 0.0;
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int index = t.x0 + y*width; index < t.x1 + y*width; index++) {
+                    double diag = scale*cells->diagonal(index);
+                    if (diag == 0.0) {
+                        residual[index] = 0;
+                        continue;
+                    }
+                    double res = r[index] - scale*cells->apply(x, index);
+                    residual[index] = T(res);
+                    m = max(m, fabs(res)/diag);
+                }
             }
+            residualPartials[t.index] = m;
+        });
+        return *max_element(residualPartials.begin(), residualPartials.end());
+    }
+    
+    /* Mixed precision pressure solve by iterative refinement. The solution
+     * is kept in double, and each round computes the residual in double and
+     * solves for a correction with the Gauss-Seidel or SOR kernels in T,
+     * starting from zero. A float solve alone stalls once rounding in p
+     * is as large as the changes it makes; the correction starts small, so
+     * its rounding is too. Stops on the same criterion and budget as the
+     * plain solvers, with sweeps of all rounds counted.
+     */
+    SolveStats refine(int limit, double scale) {
+        double *x = widen(p, wideP);
+        if (correction.empty())
+            correction.resize(width, height);
+        residual.resize(width*height);
+        
+        T *solution = p;
+        T *rhs = r;
+        T *e = correction.data();
+        int iterations = 0;
+        double error = computeResidual(x, scale);
+        while (error >= PRESSURE_TOLERANCE && iterations < limit) {
+            double tolerance = max(REFINEMENT_REDUCTION*error, PRESSURE_TOLERANCE);
+            for (int i = 0; i < width*height; i++)
+                e[i] = 0;
+            
+            /* Solve A*e = residual with the kernels, which work on p and r */
+            p = e;
+            r = residual.data();
+            if (pressureSolver == SOLVER_RED_BLACK_SOR)
+                iterations += redBlackSOR(limit - iterations, scale, tolerance).iterations;
+            else
+                iterations += gaussSeidel(limit - iterations, scale, tolerance).iterations;
+            p = solution;
+            r = rhs;
+            
+            for (int i = 0; i < width*height; i++)
+                x[i] += e[i];
+            error = computeResidual(x, scale);
+        }
+        
+        narrow(x, p);
+        return SolveStats{iterations, error, error < PRESSURE_TOLERANCE};
+    }
+    
+    /* Performs the pressure solve with the selected method. Iterative
+     * methods stop once the error is below PRESSURE_TOLERANCE, but never run
+     * more than `limit' iterations (sweeps or cycles). The outcome is kept
+     * for lastSolveStats() and recorded as telemetry, see Telemetry.h.
+     */
+    SolveStats project(int limit, double timestep) {
+        TELEMETRY_SCOPE(STAGE_PROJECT);
+        lastSolve = solve(limit, timestep/(fluid_density*cell_size*cell_size));
+        TELEMETRY_COUNT(COUNTER_SOLVE_ITERATIONS, lastSolve.iterations);
+        TELEMETRY_COUNT(COUNTER_SOLVE_ERROR, lastSolve.maxError);
+        return lastSolve;
+    }
+    
+    /* Dispatches the solve of project() to the direct solver if it applies,
+     * else to the selected method
+     */
+    SolveStats solve(int limit, double scale) {
+        /* Red-black SOR is the only method that runs on slabs */
+        if (slab)
+            return redBlackSOR(limit, scale, PRESSURE_TOLERANCE);
+        if (!solvesDirectly())
+            return solveIteratively(limit, scale);
+        
+        if (!dct)
+            dct = new DCTSolver(width, height);
+        double *wide = widen(p, wideP);
+        SolveStats stats = dct->solve(wide, widen(r, wideR), *cells, scale, PRESSURE_TOLERANCE, *pool);
+        narrow(wide, p);
+        if (stats.converged)
+            return stats;
+        
+        /* Rounding left the direct solution short of the tolerance; the
+         * selected method finishes from it
+         */
+        SolveStats rest = solveIteratively(limit, scale);
+        rest.iterations += stats.iterations;
+        return rest;
+    }
+    
+    /* Solves with the selected iterative method, starting from p */
+    SolveStats solveIteratively(int limit, double scale) {
+        if (pressureSolver == SOLVER_MULTIGRID || pressureSolver == SOLVER_CONJUGATE_GRADIENT) {
+            double *wide = widen(p, wideP);
+            SolveStats stats = pressureSolver == SOLVER_MULTIGRID ?
+                    multigrid->solve(wide, widen(r, wideR), *cells, scale, limit, PRESSURE_TOLERANCE, *pool) :
+                    pcg->solve(wide, widen(r, wideR), *cells, scale, limit, PRESSURE_TOLERANCE, *pool);
+            narrow(wide, p);
+            return stats;
         }
         
-        for (int y = 0; y < height; y++)
-            ux->at(0, y) = ux->at(width, y) = 0.0;
-        for (int x = 0; x < width; x++)
-            uy->at(x, 0) = uy->at(x, height) = 0.0;
+        /* Refinement only pays off when the kernels work in float */
+        bool refined = mixedPrecision && sizeof(T) < sizeof(double);
+        if (refined)
+            return refine(limit, scale);
+        if (pressureSolver == SOLVER_RED_BLACK_SOR)
+            return redBlackSOR(limit, scale, PRESSURE_TOLERANCE);
+        return gaussSeidel(limit, scale, PRESSURE_TOLERANCE);
+    }
+    
+    /* Sets p to the initial guess for this step's solve and remembers the
+     * last solution for extrapolating the next one
+     */
+    void seedPressure() {
+        int n = width*height;
+        if (warmStart == WARM_START_NONE) {
+            for (int i = 0; i < n; i++)
+                p[i] = 0;
+            return;
+        }
+        if (warmStart == WARM_START_PREVIOUS || pressureHistory == 0)
+            return;
+        
+        if (pressureHistory == 1) {
+            lastP.assign(p, p + n);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            T current = p[i];
+            p[i] = 2*current - lastP[i];
+            lastP[i] = current;
+        }
+    }
+    
+    /* Runs project() from the warm start and, if measuring, also solves
+     * from zero pressure for comparison. The comparison goes into
+     * warmStartStats() and telemetry only; lastSolveStats() always describes
+     * the warm solve.
+     */
+    SolveStats solvePressure(int limit, double timestep) {
+        int coldIterations = -1;
+        if (measureWarmStart) {
+            T *warmP = p;
+            coldP.resize(width, height);
+            p = coldP.data();
+            coldIterations = solve(limit, timestep/(fluid_density*cell_size*cell_size)).iterations;
+            p = warmP;
+            TELEMETRY_COUNT(COUNTER_COLD_ITERATIONS, coldIterations);
+        }
+        
+        seedPressure();
+        SolveStats stats = project(limit, timestep);
+        pressureHistory = min(pressureHistory + 1, 2);
+        
+        if (coldIterations >= 0) {
+            warmStats.solves++;
+            warmStats.iterations += stats.iterations;
+            warmStats.coldIterations += coldIterations;
+            warmStats.lastColdIterations = coldIterations;
+        }
+        return stats;
+    }
+    
+    /* Largest magnitude of any value of q, a w x h quantity. When sparse,
+     * only the samples of active tiles are looked at, which are all that
+     * can be nonzero; dx and dy say which faces q lives on, see faceTile().
+     */
+    double maxAbs(const FluidQuantity<T> &q, int w, int h, int dx, int dy) {
+        if (active) {
+            velocityPartials.assign(active->tileCount(), 0.0);
+            pool->forEachTile(active->tiles(), [&](const Tile &t, int) {
+                velocityPartials[t.index] = q.maxAbsTile(faceTile(t, dx, dy));
+            });
+            return velocityPartials.empty() ? 0.0 : *max_element(velocityPartials.begin(), velocityPartials.end());
+        }
+        
+        /* Slabs look at their owned rows and agree on the largest with
+         * the other ranks
+         */
+        int y0 = slab ? slab->haloBelow() : 0;
+        int rows = slab ? slab->ownedRows() : h;
+        int tw, th;
+        ThreadPool::tileSize(w, rows, sizeof(T), tw, th);
+        velocityPartials.assign(ThreadPool::tileCount(w, rows, tw, th), 0.0);
+        pool->forEachTile(w, rows, tw, th, [&](const Tile &t, int) {
+            velocityPartials[t.index] = q.maxAbsTile(Tile{t.x0, t.y0 + y0, t.x1, t.y1 + y0, t.index});
+        });
+        double m = *max_element(velocityPartials.begin(), velocityPartials.end());
+        return slab ? slab->allreduceMax(m) : m;
+    }
+    
+    /* Applies the computed pressure to the velocity field.
+     * Every velocity sample is updated from the two cells on either side of
+     * it, in the same order as a cell-by-cell sweep would, so that tiles
+     * never write to the same sample. The tile owning a cell owns the
+     * samples on its left and bottom faces, plus the right and top ones at
+     * the domain border or, when sparse, next to an inactive tile. Samples
+     * on faces next to a solid cell are set to zero, the velocity of the
+     * (stationary) solid.
+     */
+    void applyPressure(double timestep) {
+        TELEMETRY_SCOPE(STAGE_APPLY_PRESSURE);
+        T scale = T(timestep/(fluid_density*cell_size));
+        
+        /* Updates the left face of cell (x, y) */
+        auto leftFace = [&](int x, int y) {
+            int index = x + y*width;
+            ux->at(x, y) = weight(cells->faces(index), NEIGHBOUR_LEFT)*
+                    ((ux->at(x, y) + scale*p[index - 1]) - scale*p[index]);
+        };
+        /* Updates the bottom face of cell (x, y) */
+        auto bottomFace = [&](int x, int y) {
+            int index = x + y*width;
+            uy->at(x, y) = weight(cells->faces(index), NEIGHBOUR_DOWN)*
+                    ((uy->at(x, y) + scale*p[index - width]) - scale*p[index]);
+        };
+        
+        /* Reads p and updates ux, uy. Grid borders are solid, so faces on
+         * them are set to zero in the same pass instead of computed; p has
+         * a ghost margin for all other faces. Faces shared with an inactive
+         * tile see its cells hold p = 0.
+         */
+        forEachActiveTile(5*sizeof(T), [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++) {
+                int x0 = t.x0;
+                if (x0 == 0)
+                    ux->at(x0++, y) = 0;
+                for (int x = x0; x < t.x1; x++)
+                    leftFace(x, y);
+                if (t.x1 == width)
+                    ux->at(width, y) = 0;
+                else if (ownsRight(t))
+                    leftFace(t.x1, y);
+                
+                if (y == 0)
+                    for (int x = t.x0; x < t.x1; x++)
+                        uy->at(x, 0) = 0;
+                else
+                    for (int x = t.x0; x < t.x1; x++)
+                        bottomFace(x, y);
+            }
+            
+            if (t.y1 == height)
+                for (int x = t.x0; x < t.x1; x++)
+                    uy->at(x, height) = 0;
+            else if (ownsTop(t))
+                for (int x = t.x0; x < t.x1; x++)
+                    bottomFace(x, t.y1);
+        });
+        traffic.pressure += coveredCells()*PRESSURE_BYTES;
+    }
+    
+    /* Refreshes the halo rows of a slab's velocities and, if `density',
+     * of the density as well
+     */
+    void exchangeHalos(bool density) {
+        int depth = slab->halo();
+        if (density)
+            slab->exchange(d->data(), d->rowStride(), width, depth);
+        slab->exchange(ux->data(), ux->rowStride(), width + 1, depth);
+        slab->exchange(uy->data(), uy->rowStride(), width, depth);
     }
     
 public:
-    FluidSolver(int w, int h, double density) : width(w), height(h), fluid_density(density) {
+    /* Solver for a w x h domain of fluid of the given density.
+     *
+     * Given a SlabDomain, the solver only holds one rank's slab of the
+     * domain and its halo rows, and works with the other ranks on the rest:
+     * halos are refreshed within update() and all ranks agree on the
+     * timesteps and when the pressure solve has converged. Every rank has to
+     * make the same calls in the same order, with coordinates of the whole
+     * domain. The result matches a single process up to rounding. Slabs
+     * always solve with red-black SOR and ignore setPressureSolver(),
+     * setSparse() and the other solver options; checkpoints are not
+     * supported.
+     */
+    FluidSolver(int w, int h, double density, SlabDomain *domain = 0)
+            : width(w), height(domain ? domain->localRows() : h), fluid_density(density) {
         cell_size = 1.0/min(w, h);
+        slab = domain;
+        
+        pool = new ThreadPool();
+        
+        arena = 0;
+        hugePages = HUGE_PAGES_NONE;
+        allocateFields();
+        
+        cells = new PressureStencil(width, height);
         
-        d = new FluidQuantity(width,     height,     0.5, 0.5, cell_size);
-        ux = new FluidQuantity(width + 1, height,     0.0, 0.5, cell_size);
-        uy = new FluidQuantity(width,     height + 1, 0.5, 0.0, cell_size);
+        pressureSolver = slab ? SOLVER_RED_BLACK_SOR : SOLVER_GAUSS_SEIDEL;
+        multigrid = 0;
+        pcg = 0;
+        parallelPreconditioner = false;
+        sorOmega = 0.0;
+        dct = 0;
+        directSolve = true;
         
-        r = new double[width*height];
-        p = new double[width*height];
+        warmStart = WARM_START_PREVIOUS;
+        pressureHistory = 0;
+        measureWarmStart = false;
+        warmStats = WarmStartStats{0, 0, 0, 0};
+        mixedPrecision = false;
         
-        memset(p, 0, width*height*sizeof(double));
+        simTime = 0.0;
+        
+        active = 0;
+        densityThreshold = ACTIVE_DENSITY_THRESHOLD;
+        velocityThreshold = ACTIVE_VELOCITY_THRESHOLD;
+        
+        fusedKernels = false;
+        rhsPending = false;
+        blockSweeps = 1;
+        traffic = TrafficStats{0, 0, 0, 0};
+        lastSolve = SolveStats{0, 0.0, true};
     }
     
     ~FluidSolver() {
         delete d;
         delete ux;
         delete uy;
+        delete arena;
+        
+        delete cells;
+        
+        delete pool;
+        delete multigrid;
+        delete pcg;
+        delete dct;
+        delete active;
+    }
+    
+    /* Sets the number of threads used by the per-cell kernels, including
+     * the calling thread. 0 uses one thread per hardware thread.
+     */
+    void setThreadCount(int threads) {
+        if (ThreadPool::resolveCount(threads) == pool->threadCount())
+            return;
+        delete pool;
+        pool = new ThreadPool(threads);
+        /* Tiles now go to different threads, so place the fields anew */
+        allocateFields();
+    }
+    
+    int threadCount() const {
+        return pool->threadCount();
+    }
+    
+    /* Selects the method used for the pressure solve */
+    void setPressureSolver(PressureSolver solver) {
+        if (slab)
+            return;
+        pressureSolver = solver;
+        if (solver == SOLVER_MULTIGRID && !multigrid)
+            multigrid = new Multigrid(width, height);
+        if (solver == SOLVER_CONJUGATE_GRADIENT && !pcg) {
+            pcg = new PCGSolver(width, height);
+            pcg->setParallelPreconditioner(parallelPreconditioner);
+        }
+    }
+    
+    /* Sets the over-relaxation factor of the red-black SOR solver, in (0, 2).
+     * 1 gives red-black Gauss-Seidel; 0 (the default) picks the optimal
+     * factor for the grid size.
+     */
+    void setSOROmega(double omega) {
+        sorOmega = omega;
+    }
+    
+    /* Makes the CG solver use the slab-parallel variant of its
+     * preconditioner, which scales with the thread count at the cost of a
+     * few more iterations
+     */
+    void setParallelPreconditioner(bool enable) {
+        parallelPreconditioner = enable;
+        if (pcg)
+            pcg->setParallelPreconditioner(enable);
+    }
+
+    /* Sets the Gauss-Seidel sweeps the multigrid solver runs on each level
+     * before and after the coarse correction, 2 and 2 by default
+     */
+    void setMultigridSmoothing(int pre, int post) {
+        if (!multigrid)
+            multigrid = new Multigrid(width, height);
+        multigrid->setSmoothing(pre, post);
+    }
+
+    /* Makes every multigrid solve start with a full multigrid pass instead
+     * of a V-cycle. The pass ignores the starting pressure, so it only
+     * pays off without a warm start (see setWarmStart()).
+     */
+    void setMultigridFMG(bool enable) {
+        if (!multigrid)
+            multigrid = new Multigrid(width, height);
+        multigrid->setFullMultigrid(enable);
+    }
+
+    PressureSolver pressureSolverType() const {
+        return pressureSolver;
+    }
+    
+    /* Lets pressure solves on grids without obstacles or empty cells go to
+     * the direct solver in DCTSolver.h, whichever solver is selected, as
+     * long as the grid's sides have no prime factor above
+     * DCTSolver::MAX_FACTOR. It is exact up to rounding and needs no
+     * iteration budget; should rounding exceed the tolerance, the selected
+     * solver finishes the solve. On by default; turning it off makes the
+     * selected solver handle every grid.
+     */
+    void setDirectSolve(bool enable) {
+        directSolve = enable;
+    }
+    
+    /* Selects what each pressure solve starts from. The default continues
+     * from the previous step's pressure.
+     */
+    void setWarmStart(WarmStart mode) {
+        warmStart = mode;
+        /* p still holds the last solution, anything older may be stale */
+        pressureHistory = min(pressureHistory, 1);
+    }
+    
+    WarmStart warmStartMode() const {
+        return warmStart;
+    }
+    
+    /* Repeats every pressure solve from zero to measure the iterations the
+     * warm start saves, see warmStartStats(). Doubles the cost of the solve,
+     * so only meant for tuning.
+     */
+    void setWarmStartMeasurement(bool enable) {
+        measureWarmStart = enable;
+    }
+    
+    const WarmStartStats &warmStartStats() const {
+        return warmStats;
+    }
+    
+    /* Outcome of the last pressure solve, e.g. to check it converged */
+    const SolveStats &lastSolveStats() const {
+        return lastSolve;
+    }
+    
+    /* Refines Gauss-Seidel and SOR solves in double, see refine(). Only
+     * affects float solvers; the other methods always solve in double.
+     */
+    void setMixedPrecision(bool enable) {
+        mixedPrecision = enable;
+    }
+    
+    bool mixedPrecisionEnabled() const {
+        return mixedPrecision;
+    }
+    
+    /* Restricts the work of every step to the tiles of the grid where
+     * something happens, see ActiveTiles.h. A tile drops out once its
+     * velocity and the spread of its density are below the thresholds of
+     * setActivityThresholds(), and is held constant from then on; it comes
+     * back when anything moves within a tile of it or an inflow covers it.
+     * Gauss-Seidel and SOR only solve on the active tiles, with pressure
+     * taken to be zero outside of them. Multigrid, CG and the direct solver
+     * still solve on the whole grid, but only the active tiles' velocities
+     * are updated. The halo is one tile, so steps must not move anything
+     * further than ActiveTiles::TILE_SIZE cells, which advance() guarantees
+     * for CFL numbers up to that.
+     *
+     * This saves time, not memory: every tile keeps its storage. All tiles
+     * start out active. With the default thresholds the active set follows
+     * the smoke plus a tile around it, and the inactive tiles act as open
+     * space: fluid leaves the active region freely instead of turning back
+     * at walls far away. Results therefore differ from the dense solve
+     * where that return flow matters. Thresholds low enough to track the
+     * return flow keep nearly every tile active in a closed box, and tiles
+     * flickering in and out near them slow the pressure solve down.
+     */
+    void setSparse(bool enable) {
+        if (enable == (active != 0) || slab)
+            return;
+        delete active;
+        active = enable ? new ActiveTiles(width, height) : 0;
+    }
+    
+    /* Sets the thresholds below which a tile counts as quiescent */
+    void setActivityThresholds(double density, double velocity) {
+        densityThreshold = density;
+        velocityThreshold = velocity;
+    }
+    
+    /* Selects how the memory of the fields is backed, see Arena.h. The
+     * default is regular pages. Moves the fields, so it is best done before
+     * the run starts.
+     */
+    void setHugePages(HugePages mode) {
+        if (mode == hugePages)
+            return;
+        hugePages = mode;
+        allocateFields();
+    }
+    
+    /* Whether the fields ended up on huge pages */
+    bool fieldsOnHugePages() const {
+        return arena->hugePages();
+    }
+    
+    /* Bytes taken up by the fields, without the cell types and stencil (4
+     * bytes per cell) and the state of solvers other than Gauss-Seidel
+     */
+    size_t memoryFootprint() const {
+        return arena->footprint();
+    }
+    
+    /* What memoryFootprint() would be for a w x h solver, for sizing runs
+     * before starting them
+     */
+    static size_t memoryFootprint(int w, int h) {
+        Arena arena;
+        layOut(arena, w, h);
+        return arena.footprint();
+    }
+    
+    /* Share of the grid the last step worked on */
+    double activeFraction() const {
+        return active ? active->fraction() : 1.0;
+    }
+    
+    /* Lets the first Gauss-Seidel or SOR sweep of each step compute the
+     * divergence as it goes, instead of a separate buildRHS() pass over the
+     * grid. Has no effect on the other solvers, on mixed precision solves or
+     * while measuring warm starts, which all need the right hand side
+     * before they start.
+     */
+    void setFusedKernels(bool enable) {
+        fusedKernels = enable;
+    }
+    
+    /* Sets the number of red-black SOR iterations run per pass over the
+     * grid, see blockedSOR(). 1 (the default) sweeps the whole grid for
+     * every iteration. The result is the same either way; blocking only
+     * pays off once p, r and the stencil no longer fit in the last level
+     * cache.
+     */
+    void setTemporalBlocking(int sweeps) {
+        blockSweeps = max(sweeps, 1);
+    }
+    
+    /* Estimated bytes the last step moved, by stage */
+    const TrafficStats &lastStepTraffic() const {
+        return traffic;
+    }
+    
+    
+    
+    /* Sets the type of cell (x, y). Changes take effect with the next
+     * update().
+     */
+    void setCellType(int x, int y, CellType type) {
+        cells->setType(x, y, type);
+    }
+    
+    CellType cellType(int x, int y) const {
+        return cells->type(x, y);
+    }
+    
+    /* Makes the cells whose centers lie in the given rectangle solid. Takes
+     * the same coordinates as addInflow.
+     */
+    void addSolid(double x, double y, double w, double h) {
+        int origin = slab ? slab->localOrigin() : 0;
+        int ix0 = (int)(x/cell_size - 0.5);
+        int iy0 = (int)(y/cell_size - 0.5) - origin;
+        int ix1 = (int)((x + w)/cell_size - 0.5);
+        int iy1 = (int)((y + h)/cell_size - 0.5) - origin;
         
-        delete[] r;
-        delete[] p;
+        for (int iy = max(iy0, 0); iy < min(iy1, height); iy++)
+            for (int ix = max(ix0, 0); ix < min(ix1, width); ix++)
+                cells->setType(ix, iy, CELL_SOLID);
     }
     
+    /* Largest magnitude of any velocity sample in either direction */
+    double maxVelocity() {
+        return max(maxAbs(*ux, width + 1, height, 1, 0), maxAbs(*uy, width, height + 1, 0, 1));
+    }
+    
+    /* Longest timestep in which nothing moves further than `cfl' cells at
+     * the current velocities, infinite while the fluid is at rest
+     */
+    double cflTimestep(double cfl) {
+        double u = maxVelocity();
+        return u > 0.0 ? cfl*cell_size/u : INFINITY;
+    }
+    
+    /* Advances the simulation by `timestep' in as few update() substeps as
+     * keep the CFL number at or below `cfl'. The velocity is measured again
+     * before every substep, so substeps shrink as soon as the flow speeds
+     * up. Returns the number of substeps taken.
+     */
+    int advance(double timestep, double cfl) {
+        /* Backtraces must stay within a slab's halo, see SLAB_HALO */
+        if (slab)
+            cfl = min(cfl, slab->halo() - 2.0);
+        int substeps = 0;
+        double remaining = timestep;
+        while (remaining > 0.0) {
+            /* Slightly lenient so that rounding in the time left over from
+             * earlier substeps doesn't add one
+             */
+            double steps = ceil(remaining/cflTimestep(cfl)*(1.0 - 1e-9));
+            if (steps > 1.0) {
+                double step = remaining/steps;
+                update(step);
+                remaining -= step;
+            } else {
+                update(remaining);
+                remaining = 0.0;
+            }
+            substeps++;
+        }
+        TELEMETRY_COUNT(COUNTER_SUBSTEPS, substeps);
+        return substeps;
+    }
+    
+    /* Density of cell (x, y) of the local grid */
+    T densityAt(int x, int y) const {
+        return d->at(x, y);
+    }
+    
+    /* Collects the density of every slab into the domain's result buffer,
+     * see SlabDomain::gather(). Every rank has to call it.
+     */
+    void gatherDensity() {
+        if (slab)
+            slab->gather(d->data(), d->rowStride(), width);
+    }
+    
+    /* Simulated time advanced by update() so far */
+    double time() const {
+        return simTime;
+    }
+    
+    /* Stages the simulation state in `writer', which writes it out in the
+     * background. `frame' is the caller's frame counter and is handed back
+     * by loadCheckpoint(). The pressure and its history for warm starting
+     * are saved too, so a restarted run continues exactly as this one would.
+     */
+    void saveCheckpoint(CheckpointWriter &writer, long frame) {
+        Checkpoint &checkpoint = writer.begin(frame, simTime);
+        checkpoint.add("d",  d->data(),  height,     width,     d->rowStride());
+        checkpoint.add("ux", ux->data(), height,     width + 1, ux->rowStride());
+        checkpoint.add("uy", uy->data(), height + 1, width,     uy->rowStride());
+        checkpoint.add("cells", cells->typeData(), height, width);
+        /* Only saved once they hold a solution */
+        if (pressureHistory >= 1)
+            checkpoint.add("p", p, height, width);
+        if (pressureHistory == 2)
+            checkpoint.add("lastP", lastP.data(), height, width);
+        writer.commit();
+    }
     
+    /* Restores the state saved by saveCheckpoint() in a solver of the same
+     * size and precision and returns the frame it was saved at. Solver settings aren't
+     * part of the checkpoint.
+     */
+    long loadCheckpoint(const string &fileName) {
+        CheckpointReader reader(fileName);
+        reader.restore("d",  d->data(),  height,     width,     d->rowStride());
+        reader.restore("ux", ux->data(), height,     width + 1, ux->rowStride());
+        reader.restore("uy", uy->data(), height + 1, width,     uy->rowStride());
+        
+        vector<uint8_t> types(width*height);
+        reader.restore("cells", types.data(), height, width);
+        for (int y = 0, index = 0; y < height; y++) {
+            for (int x = 0; x < width; x++, index++) {
+                if (types[index] > CELL_EMPTY)
+                    throw runtime_error("checkpoint: " + fileName + " has an invalid cell type");
+                cells->setType(x, y, (CellType)types[index]);
+            }
+        }
+        /* Rebuilt here rather than by updateCells(), which would discard
+         * the pressure history restored below
+         */
+        if (cells->needsRebuild())
+            cells->rebuild();
+        
+        pressureHistory = 0;
+        for (int i = 0; i < width*height; i++)
+            p[i] = 0;
+        if (reader.has("p")) {
+            reader.restore("p", p, height, width);
+            pressureHistory = 1;
+        }
+        if (reader.has("lastP")) {
+            lastP.resize(width*height);
+            reader.restore("lastP", lastP.data(), height, width);
+            pressureHistory = 2;
+        }
+        
+        simTime = reader.time();
+        if (active)
+            active->activateAll();
+        return reader.frame();
+    }
     
     /* Set density and x/y velocity in given rectangle to d/ux/uy, respectively */
     void addInflow(double x, double y, double w, double h, double density, double u, double v) {
         d->addInflow(x, y, x + w, y + h, density);
         ux->addInflow(x, y, x + w, y + h, u);
         uy->addInflow(x, y, x + w, y + h, v);
+        
+        /* Covers every sample the quantities may have set, with a cell to
+         * spare
+         */
+        if (active)
+            active->activate((int)(x/cell_size) - 1, (int)(y/cell_size) - 1,
+                    (int)((x + w)/cell_size) + 2, (int)((y + h)/cell_size) + 2);
+    }
+    
+    /* Advances the simulation by one timestep: makes the velocity field
+     * divergence free, then advects density and velocity through it.
+     */
+    void update(double timestep) {
+        TELEMETRY_STEP();
+        traffic = TrafficStats{0, 0, 0, 0};
+        if (active)
+            refreshActiveTiles();
+        /* The right hand side of a slab's top row reads the face above it,
+         * which the neighbour advected
+         */
+        if (slab)
+            exchangeHalos(false);
+        updateCells();
+        rhsPending = fusesRHS();
+        if (!rhsPending)
+            buildRHS();
+        solvePressure(600, timestep);
+        applyPressure(timestep);
+        
+        TELEMETRY_SCOPE(STAGE_ADVECT);
+        if (slab)
+            exchangeHalos(true);
+        if (active) {
+            pool->forEachTile(active->tiles(), [&](const Tile &t, int) {
+                d->advectTile(t, timestep, *ux, *uy);
+                ux->advectTile(faceTile(t, 1, 0), timestep, *ux, *uy);
+                uy->advectTile(faceTile(t, 0, 1), timestep, *ux, *uy);
+            });
+        } else {
+            d->advect(timestep, *ux, *uy, pool);
+            ux->advect(timestep, *ux, *uy, pool);
+            uy->advect(timestep, *ux, *uy, pool);
+        }
+        traffic.advect += coveredCells()*ADVECT_BYTES;
+        
+        /* Advection writes to dst, so make the results visible */
+        d->flip();
+        ux->flip();
+        uy->flip();
+        
+        simTime += timestep;
     }
-};
\ No newline at end of file
+};
+
+template class FluidQuantity<float>;
+template class FluidQuantity<double>;
+template class FluidSolver<float>;
+template class FluidSolver<double>;
@@ -0,0 +1,351 @@
+#ifndef __MULTIGRID__
+#define __MULTIGRID__
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#include "PressureStencil.h"
+#include "SolveStats.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+/* Geometric multigrid solver for the pressure equation of FluidSolver.
+ *
+ * The system is the same five-point stencil project() uses, given by a
+ * PressureStencil:
+ *
+ *     scale*(n*p[i] - sum of fluid neighbour p) = r[i]
+ *
+ * for every fluid cell, where n counts the neighbours that aren't solid.
+ * Dividing by scale, every level works on the unscaled operator with integer
+ * coefficients.
+ *
+ * The hierarchy is cell-centered: each coarse cell covers a 2x2 block of fine
+ * cells (a partial block at an odd border). Residuals are restricted by
+ * summing the children, corrections are prolonged with bilinear weights and
+ * the coarse operators are rediscretized from coarsened cell types (see
+ * PressureStencil::coarsened) rather than formed by products. Smoothing is
+ * red-black Gauss-Seidel, so both colour sweeps and all transfer operators
+ * run in parallel on the thread pool.
+ */
+class Multigrid {
+    struct Level {
+        int width;
+        int height;
+        /* Solution (unused on the finest level, which works on p directly),
+         * right hand side and residual
+         */
+        GhostedArray x;
+        vector<double> b;
+        vector<double> res;
+        /* Operator of this level */
+        PressureStencil stencil;
+
+        Level(int w, int h) : width(w), height(h), b(w*h), res(w*h), stencil(w, h) {}
+    };
+
+    vector<Level> levels;
+    ThreadPool *pool;
+    /* Revision of the fine stencil the levels were built from */
+    unsigned stencilRevision;
+    
+    /* Scratch for the coarsest level solve and the per-thread error maxima */
+    GhostedArray coarseDir;
+    vector<double> coarseQ;
+    vector<double> partialError;
+
+    /* Smoothing sweeps before and after the coarse correction */
+    int preSmooth;
+    int postSmooth;
+    /* Start every solve with a full multigrid pass instead of V-cycles */
+    bool fullMultigrid;
+
+    /* Levels are coarsened while both dimensions are above this */
+    static const int COARSEST_SIZE = 4;
+
+    /* One red-black Gauss-Seidel iteration, both colours. Cells that
+     * aren't fluid are left alone.
+     */
+    void smooth(double *x, const double *b, const PressureStencil &stencil) {
+        int w = stencil.gridWidth(), h = stencil.gridHeight();
+        for (int color = 0; color < 2; color++) {
+            pool->forEachTile(w, h, 2*sizeof(double), [&](const Tile &t, int) {
+                for (int y = t.y0; y < t.y1; y++) {
+                    int x0 = t.x0 + ((t.x0 + y + color) & 1);
+                    for (int i = x0; i < t.x1; i += 2) {
+                        int index = i + y*w;
+                        double n = stencil.diagonal(index);
+                        if (n > 0.0)
+                            x[index] = (b[index] + stencil.neighbourSum(x, index))/n;
+                    }
+                }
+            });
+        }
+    }
+
+    /* res = b - A x, and zero outside the fluid */
+    void residual(const double *x, const double *b, double *res, const PressureStencil &stencil) {
+        int w = stencil.gridWidth(), h = stencil.gridHeight();
+        pool->forEachTile(w, h, 3*sizeof(double), [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++)
+                for (int index = t.x0 + y*w; index < t.x1 + y*w; index++)
+                    res[index] = stencil.fluid(index)*(b[index] - stencil.apply(x, index));
+        });
+    }
+
+    /* Largest residual divided by its diagonal, i.e. the change one
+     * Gauss-Seidel update would still make
+     */
+    double maxError(const double *x, const double *b, const PressureStencil &stencil) {
+        int w = stencil.gridWidth(), h = stencil.gridHeight();
+        vector<double> &partial = partialError;
+        partial.assign(pool->threadCount(), 0.0);
+        pool->forEachTile(w, h, 2*sizeof(double), [&](const Tile &t, int thread) {
+            double m = partial[thread];
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int index = t.x0 + y*w; index < t.x1 + y*w; index++) {
+                    double n = stencil.diagonal(index);
+                    if (n > 0.0)
+                        m = max(m, fabs(b[index] - stencil.apply(x, index))/n);
+                }
+            }
+            partial[thread] = m;
+        });
+        return *max_element(partial.begin(), partial.end());
+    }
+
+    /* Coarse right hand side as the sum of the fine values of each block */
+    void restrictTo(const Level &fine, Level &coarse, const double *v) {
+        int fw = fine.width, fh = fine.height, cw = coarse.width;
+        pool->forEachTile(coarse.width, coarse.height, 5*sizeof(double), [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int i = t.x0; i < t.x1; i++) {
+                    double sum = 0.0;
+                    for (int dy = 0; dy < 2; dy++)
+                        for (int dx = 0; dx < 2; dx++)
+                            if (2*i + dx < fw && 2*y + dy < fh)
+                                sum += v[(2*i + dx) + (2*y + dy)*fw];
+                    coarse.b[i + y*cw] = sum;
+                }
+            }
+        });
+    }
+
+    /* Bilinearly interpolates the coarse solution onto the fine grid and
+     * adds it to (or, if `add' is false, stores it in) x. Coarse samples
+     * beyond the border are mirrored, matching the solid walls. Only fluid
+     * cells of the fine level are touched.
+     */
+    void prolong(const Level &coarse, double *x, const PressureStencil &fine, bool add) {
+        int fw = fine.gridWidth(), fh = fine.gridHeight();
+        int cw = coarse.width, ch = coarse.height;
+        const double *e = coarse.x.data();
+        pool->forEachTile(fw, fh, 2*sizeof(double), [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++) {
+                int cy = y/2;
+                int ny = min(max(cy + ((y & 1) ? 1 : -1), 0), ch - 1);
+                for (int i = t.x0; i < t.x1; i++) {
+                    int cx = i/2;
+                    int nx = min(max(cx + ((i & 1) ? 1 : -1), 0), cw - 1);
+                    double v = (9.0*e[cx + cy*cw] + 3.0*e[nx + cy*cw] +
+                                3.0*e[cx + ny*cw] + 1.0*e[nx + ny*cw])/16.0;
+                    int index = i + y*fw;
+                    if (add)
+                        x[index] += fine.fluid(index)*v;
+                    else
+                        x[index] = fine.fluid(index)*v;
+                }
+            }
+        });
+    }
+
+    /* Without empty cells, the problem is pure Neumann and only has a
+     * solution if the right hand side sums to zero over the fluid. Round-off
+     * breaks that slightly, so remove the mean on the coarsest level before
+     * solving there.
+     */
+    static void removeMean(Level &level) {
+        if (level.stencil.hasEmptyCells())
+            return;
+
+        vector<double> &b = level.b;
+        double mean = 0.0;
+        int count = 0;
+        for (size_t i = 0; i < b.size(); i++) {
+            if (level.stencil.fluid(i)) {
+                mean += b[i];
+                count++;
+            }
+        }
+        if (count == 0)
+            return;
+        mean /= count;
+        for (size_t i = 0; i < b.size(); i++)
+            b[i] -= level.stencil.fluid(i)*mean;
+    }
+
+    /* The coarsest level is small but not necessarily square (long, thin
+     * domains stop coarsening early), so smoothing alone would converge
+     * slowly there. Solve it with plain conjugate gradients instead.
+     */
+    void solveCoarsest(Level &level) {
+        const PressureStencil &stencil = level.stencil;
+        int w = level.width, h = level.height, n = w*h;
+        double *x = level.x.data();
+        removeMean(level);
+
+        vector<double> &res = level.res;
+        GhostedArray &dir = coarseDir;
+        vector<double> &q = coarseQ;
+        dir.resize(w, h);
+        q.resize(n);
+        residual(x, level.b.data(), res.data(), stencil);
+
+        double rr = 0.0, bb = 0.0;
+        for (int i = 0; i < n; i++) {
+            dir[i] = res[i];
+            rr += res[i]*res[i];
+            bb += level.b[i]*level.b[i];
+        }
+
+        for (int iter = 0; iter < 2*n && rr > 1e-24*bb && rr > 0.0; iter++) {
+            double dq = 0.0;
+            for (int index = 0; index < n; index++) {
+                q[index] = stencil.apply(dir.data(), index);
+                dq += dir[index]*q[index];
+            }
+            if (dq <= 0.0)
+                break;
+            
+            double alpha = rr/dq, rrNew = 0.0;
+            for (int i = 0; i < n; i++) {
+                x[i] += alpha*dir[i];
+                res[i] -= alpha*q[i];
+                rrNew += res[i]*res[i];
+            }
+            for (int i = 0; i < n; i++)
+                dir[i] = res[i] + rrNew/rr*dir[i];
+            rr = rrNew;
+        }
+    }
+
+    /* Solution vector of level l; the finest level works on the caller's */
+    double *solution(int l, double *p) {
+        return l == 0 ? p : levels[l].x.data();
+    }
+
+    void vCycle(int l, double *p) {
+        Level &level = levels[l];
+        double *x = solution(l, p);
+
+        if (l == (int)levels.size() - 1) {
+            solveCoarsest(level);
+            return;
+        }
+
+        for (int i = 0; i < preSmooth; i++)
+            smooth(x, level.b.data(), level.stencil);
+
+        residual(x, level.b.data(), level.res.data(), level.stencil);
+        Level &coarse = levels[l + 1];
+        restrictTo(level, coarse, level.res.data());
+        coarse.x.resize(coarse.width, coarse.height);
+        vCycle(l + 1, p);
+        prolong(coarse, x, level.stencil, true);
+
+        for (int i = 0; i < postSmooth; i++)
+            smooth(x, level.b.data(), level.stencil);
+    }
+
+    /* Full multigrid: solve on the coarsest level, then interpolate up,
+     * running one V-cycle per level. Ignores the initial guess.
+     */
+    void fmgCycle(double *p) {
+        int coarsest = (int)levels.size() - 1;
+        for (int l = 0; l < coarsest; l++)
+            restrictTo(levels[l], levels[l + 1], levels[l].b.data());
+
+        levels[coarsest].x.resize(levels[coarsest].width, levels[coarsest].height);
+        solveCoarsest(levels[coarsest]);
+        for (int l = coarsest - 1; l >= 0; l--) {
+            prolong(levels[l + 1], solution(l, p), levels[l].stencil, false);
+            vCycle(l, p);
+        }
+    }
+
+    /* Rebuilds the operators of all levels from the fine stencil */
+    void coarsenStencils(const PressureStencil &fine) {
+        levels[0].stencil = fine;
+        for (size_t l = 1; l < levels.size(); l++)
+            levels[l].stencil = levels[l - 1].stencil.coarsened();
+        stencilRevision = fine.revision();
+    }
+
+public:
+    Multigrid(int w, int h) : pool(0), stencilRevision(0), preSmooth(2), postSmooth(2), fullMultigrid(false) {
+        for (;;) {
+            levels.push_back(Level(w, h));
+            /* The finest level works on the caller's p */
+            if (levels.size() > 1)
+                levels.back().x.resize(w, h);
+
+            if (min(w, h) <= COARSEST_SIZE)
+                break;
+            w = (w + 1)/2;
+            h = (h + 1)/2;
+        }
+    }
+
+    int levelCount() const {
+        return (int)levels.size();
+    }
+
+    void setSmoothing(int pre, int post) {
+        preSmooth = pre;
+        postSmooth = post;
+    }
+
+    void setFullMultigrid(bool enable) {
+        fullMultigrid = enable;
+    }
+
+    /* Solves for p given the right hand side r, cell stencil and scale of
+     * FluidSolver::project, starting from the current contents of p. p needs
+     * a ghost margin (see GhostedArray). Runs cycles until the maximum error
+     * drops below `tolerance' or `limit' cycles have been run.
+     */
+    SolveStats solve(double *p, const double *r, const PressureStencil &stencil, double scale, int limit,
+            double tolerance, ThreadPool &threads) {
+        pool = &threads;
+        if (stencil.revision() != stencilRevision)
+            coarsenStencils(stencil);
+
+        Level &finest = levels[0];
+        int w = finest.width, h = finest.height;
+
+        for (int i = 0; i < w*h; i++)
+            finest.b[i] = r[i]/scale;
+
+        SolveStats stats;
+        stats.iterations = 0;
+        stats.maxError = maxError(p, finest.b.data(), finest.stencil);
+        stats.converged = stats.maxError < tolerance;
+
+        while (!stats.converged && stats.iterations < limit) {
+            if (fullMultigrid && stats.iterations == 0)
+                fmgCycle(p);
+            else
+                vCycle(0, p);
+
+            stats.iterations++;
+            stats.maxError = maxError(p, finest.b.data(), finest.stencil);
+            stats.converged = stats.maxError < tolerance;
+        }
+
+        return stats;
+    }
+};
+
+#endif
@@ -0,0 +1,312 @@
+#ifndef __PCGSOLVER__
+#define __PCGSOLVER__
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#include "PressureStencil.h"
+#include "SolveStats.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+/* Preconditioned conjugate gradient solver for the pressure equation of
+ * FluidSolver, preconditioned with Modified Incomplete Cholesky, MIC(0).
+ *
+ * The matrix is never stored. As in project() it is the five-point stencil
+ * given by a PressureStencil; dividing by the stencil scale leaves integer
+ * coefficients: the number of non-solid neighbours n of a fluid cell on the
+ * diagonal and -1 for every fluid neighbour.
+ *
+ * The classic MIC(0) factor is built and applied in lexicographic order, so
+ * its triangular solves are inherently serial. The parallel variant cuts the
+ * domain into horizontal slabs, one per thread, and drops the couplings
+ * between slabs from the factor (a block-Jacobi MIC). Each slab is then
+ * factored and solved independently. It costs a few extra iterations but
+ * scales with the thread count.
+ *
+ * Every pass over the grid fuses the work CG needs from it: the matrix
+ * product computes its dot product on the fly, and the solution/residual
+ * update also measures the error used for the convergence test. Partial
+ * sums are kept per tile and added in tile order, so results don't depend
+ * on how tiles were scheduled.
+ */
+class PCGSolver {
+    int width;
+    int height;
+
+    /* Inverse square roots of the MIC(0) diagonal, i.e. the factor L is
+     * given by the strict lower part of A and diag(1/precon)
+     */
+    vector<double> precon;
+    /* Couplings of each cell to its right (+x) and top (+y) neighbour that
+     * the factor keeps: -1 between fluid cells and 0 otherwise, which
+     * includes the borders between slabs
+     */
+    vector<double> plusX, plusY;
+    /* Number of slabs and stencil revision the current factor was built
+     * for, 0 if none yet
+     */
+    int factoredSlabs;
+    unsigned factoredRevision;
+    bool parallelPreconditioner;
+
+    /* CG vectors: residual, preconditioned residual, search direction and
+     * the matrix applied to the search direction
+     */
+    vector<double> res, z, q;
+    GhostedArray dir;
+    /* Per-tile partial sums and maxima */
+    vector<double> partial, partialMax;
+
+    /* Tuning constant and safety threshold of Modified Incomplete Cholesky */
+    static constexpr double MIC_TAU   = 0.97;
+    static constexpr double MIC_SIGMA = 0.25;
+
+    int slabRows(int slabs) const {
+        return (height + slabs - 1)/slabs;
+    }
+
+    void buildPreconditioner(const PressureStencil &stencil, int slabs) {
+        int rows = slabRows(slabs);
+        precon.assign(width*height, 0.0);
+        plusX.assign(width*height, 0.0);
+        plusY.assign(width*height, 0.0);
+
+        for (int y0 = 0; y0 < height; y0 += rows) {
+            int y1 = min(y0 + rows, height);
+            for (int y = y0; y < y1; y++) {
+                for (int x = 0; x < width; x++) {
+                    int index = x + y*width;
+                    unsigned m = stencil.neighbours(index);
+                    plusX[index] = -PressureStencil::weight(m, NEIGHBOUR_RIGHT);
+                    plusY[index] = y < y1 - 1 ? -PressureStencil::weight(m, NEIGHBOUR_UP) : 0.0;
+
+                    double diag = stencil.diagonal(index);
+                    double e = diag;
+
+                    if (x > 0) {
+                        double px = plusX[index - 1]*precon[index - 1];
+                        double py = plusY[index - 1]*precon[index - 1];
+                        e -= px*px + MIC_TAU*px*py;
+                    }
+                    if (y > y0) {
+                        double py = plusY[index - width]*precon[index - width];
+                        double px = plusX[index - width]*precon[index - width];
+                        e -= py*py + MIC_TAU*py*px;
+                    }
+
+                    if (e < MIC_SIGMA*diag)
+                        e = diag;
+                    precon[index] = e > 0.0 ? 1.0/sqrt(e) : 0.0;
+                }
+            }
+        }
+
+        factoredSlabs = slabs;
+        factoredRevision = stencil.revision();
+    }
+
+    /* z = M^-1 res, solving L q = res and then L^T z = q slab by slab. The
+     * only tests left are for the domain and slab borders, where the
+     * neighbour may belong to a slab another thread is working on.
+     */
+    void applyPreconditioner(ThreadPool &pool) {
+        int rows = slabRows(factoredSlabs);
+        pool.forEachTile(width, height, width, rows, [&](const Tile &t, int) {
+            int y0 = t.y0, y1 = t.y1;
+            for (int y = y0; y < y1; y++) {
+                for (int x = 0; x < width; x++) {
+                    int index = x + y*width;
+                    double s = res[index];
+                    if (x > 0)
+                        s -= plusX[index - 1]*precon[index - 1]*z[index - 1];
+                    if (y > y0)
+                        s -= plusY[index - width]*precon[index - width]*z[index - width];
+                    z[index] = s*precon[index];
+                }
+            }
+            for (int y = y1 - 1; y >= y0; y--) {
+                for (int x = width - 1; x >= 0; x--) {
+                    int index = x + y*width;
+                    double s = z[index];
+                    if (x < width - 1)
+                        s -= plusX[index]*precon[index]*z[index + 1];
+                    if (y < y1 - 1)
+                        s -= plusY[index]*precon[index]*z[index + width];
+                    z[index] = s*precon[index];
+                }
+            }
+        });
+    }
+
+    /* Splits the grid for the element-wise passes below */
+    void vectorTiles(int &tw, int &th) {
+        ThreadPool::tileSize(width, height, 4*sizeof(double), tw, th);
+        int tiles = ThreadPool::tileCount(width, height, tw, th);
+        partial.assign(tiles, 0.0);
+        partialMax.assign(tiles, 0.0);
+    }
+
+    double sumPartials() const {
+        double sum = 0.0;
+        for (size_t i = 0; i < partial.size(); i++)
+            sum += partial[i];
+        return sum;
+    }
+
+    double maxPartials() const {
+        return *max_element(partialMax.begin(), partialMax.end());
+    }
+
+    /* q = A dir, returning dir . q */
+    double applyMatrixDot(const PressureStencil &stencil, ThreadPool &pool) {
+        int tw, th;
+        vectorTiles(tw, th);
+        const double *d = dir.data();
+        pool.forEachTile(width, height, tw, th, [&](const Tile &t, int) {
+            double dot = 0.0;
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int index = t.x0 + y*width; index < t.x1 + y*width; index++) {
+                    q[index] = stencil.apply(d, index);
+                    dot += d[index]*q[index];
+                }
+            }
+            partial[t.index] = dot;
+        });
+        return sumPartials();
+    }
+
+    /* p += alpha dir and res -= alpha q, returning the largest remaining
+     * error |res|/n, the same measure the Gauss-Seidel loop stops on
+     */
+    double updateSolution(double *p, double alpha, const PressureStencil &stencil, ThreadPool &pool) {
+        int tw, th;
+        vectorTiles(tw, th);
+        pool.forEachTile(width, height, tw, th, [&](const Tile &t, int) {
+            double m = 0.0;
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int index = t.x0 + y*width; index < t.x1 + y*width; index++) {
+                    p[index] += alpha*dir[index];
+                    res[index] -= alpha*q[index];
+                    double n = stencil.diagonal(index);
+                    if (n > 0.0)
+                        m = max(m, fabs(res[index])/n);
+                }
+            }
+            partialMax[t.index] = m;
+        });
+        return maxPartials();
+    }
+
+    /* Returns z . res */
+    double dotZRes(ThreadPool &pool) {
+        int tw, th;
+        vectorTiles(tw, th);
+        pool.forEachTile(width, height, tw, th, [&](const Tile &t, int) {
+            double dot = 0.0;
+            for (int y = t.y0; y < t.y1; y++)
+                for (int index = t.x0 + y*width; index < t.x1 + y*width; index++)
+                    dot += z[index]*res[index];
+            partial[t.index] = dot;
+        });
+        return sumPartials();
+    }
+
+    /* dir = z + beta dir */
+    void updateDirection(double beta, ThreadPool &pool) {
+        int tw, th;
+        vectorTiles(tw, th);
+        pool.forEachTile(width, height, tw, th, [&](const Tile &t, int) {
+            for (int y = t.y0; y < t.y1; y++)
+                for (int index = t.x0 + y*width; index < t.x1 + y*width; index++)
+                    dir[index] = z[index] + beta*dir[index];
+        });
+    }
+
+    /* res = r/scale - A p over the fluid, with the mean removed (see
+     * solve), returning the largest error |res|/n
+     */
+    double initialResidual(const double *p, const double *r, const PressureStencil &stencil, double scale) {
+        double mean = 0.0;
+        int count = 0;
+        for (int index = 0; index < width*height; index++) {
+            res[index] = stencil.fluid(index)*(r[index]/scale - stencil.apply(p, index));
+            mean += res[index];
+            count += stencil.fluid(index);
+        }
+        if (stencil.hasEmptyCells() || count == 0)
+            mean = 0.0;
+        else
+            mean /= count;
+
+        double m = 0.0;
+        for (int index = 0; index < width*height; index++) {
+            res[index] -= stencil.fluid(index)*mean;
+            double n = stencil.diagonal(index);
+            if (n > 0.0)
+                m = max(m, fabs(res[index])/n);
+        }
+        return m;
+    }
+
+public:
+    PCGSolver(int w, int h) : width(w), height(h), factoredSlabs(0), factoredRevision(0),
+            parallelPreconditioner(false), res(w*h), z(w*h), q(w*h), dir(w, h) {}
+
+    /* Selects the slab-parallel preconditioner instead of classic MIC(0) */
+    void setParallelPreconditioner(bool enable) {
+        parallelPreconditioner = enable;
+    }
+
+    /* Solves for p given the right hand side r, cell stencil and scale of
+     * FluidSolver::project, starting from the current contents of p. p needs
+     * a ghost margin (see GhostedArray). Stops once the maximum error is
+     * below `tolerance' or after `limit' iterations.
+     *
+     * Without empty cells, pressure is only defined up to a constant and a
+     * solution only exists if r sums to zero over the fluid. Round-off
+     * breaks that slightly, so the mean of the residual is removed first.
+     */
+    SolveStats solve(double *p, const double *r, const PressureStencil &stencil, double scale, int limit,
+            double tolerance, ThreadPool &pool) {
+        int slabs = parallelPreconditioner ? min(pool.threadCount(), height) : 1;
+        if (slabs != factoredSlabs || stencil.revision() != factoredRevision)
+            buildPreconditioner(stencil, slabs);
+
+        SolveStats stats;
+        stats.iterations = 0;
+        stats.maxError = initialResidual(p, r, stencil, scale);
+        stats.converged = stats.maxError < tolerance;
+        if (stats.converged)
+            return stats;
+
+        applyPreconditioner(pool);
+        copy(z.begin(), z.end(), dir.data());
+        double sigma = dotZRes(pool);
+
+        while (stats.iterations < limit) {
+            double dq = applyMatrixDot(stencil, pool);
+            if (dq <= 0.0)
+                break;
+
+            double alpha = sigma/dq;
+            stats.maxError = updateSolution(p, alpha, stencil, pool);
+            stats.iterations++;
+            if (stats.maxError < tolerance) {
+                stats.converged = true;
+                break;
+            }
+
+            applyPreconditioner(pool);
+            double sigmaNew = dotZRes(pool);
+            updateDirection(sigmaNew/sigma, pool);
+            sigma = sigmaNew;
+        }
+
+        return stats;
+    }
+};
+
+#endif
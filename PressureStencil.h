@@ -0,0 +1,290 @@
+#ifndef __PRESSURESTENCIL__
+#define __PRESSURESTENCIL__
+
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+/* What occupies a grid cell, as far as the pressure solve is concerned */
+enum CellType {
+    CELL_FLUID, /* Pressure is solved for */
+    CELL_SOLID, /* Obstacle, nothing flows through its faces */
+    CELL_EMPTY  /* Free space outside the fluid, pressure is held at zero */
+};
+
+/* Bits for the four neighbours of a cell, in the order stencils visit them */
+enum {
+    NEIGHBOUR_LEFT  = 1, /* -x */
+    NEIGHBOUR_DOWN  = 2, /* -y */
+    NEIGHBOUR_RIGHT = 4, /* +x */
+    NEIGHBOUR_UP    = 8  /* +y */
+};
+
+/* An array of width*height values of type T with a zeroed margin of at
+ * least width + 1 values on either side. A five-point stencil can then read
+ * all neighbours of any cell, including those past the domain border,
+ * without bounds checks. The margin itself must never be written.
+ *
+ * data() is aligned to a cache line, so rows line up the same way they would
+ * in an array without margin.
+ */
+template<typename T>
+class GhostedArrayOf {
+    static const int ALIGN_VALUES = 64/sizeof(T);
+
+    vector<T> storage;
+    int offset;
+
+public:
+    GhostedArrayOf() : offset(0) {}
+    GhostedArrayOf(int w, int h) {
+        resize(w, h);
+    }
+
+    /* Resizes to w x h and zeroes all values */
+    void resize(int w, int h) {
+        int margin = w + 1;
+        storage.assign(w*h + 2*margin + ALIGN_VALUES, T(0));
+        offset = margin;
+        while (((uintptr_t)(storage.data() + offset) & 63) != 0)
+            offset++;
+    }
+
+    /* Whether resize() was never called */
+    bool empty() const {
+        return storage.empty();
+    }
+
+    T *data() {
+        return storage.data() + offset;
+    }
+    const T *data() const {
+        return storage.data() + offset;
+    }
+
+    T &operator[](int index) {
+        return storage[index + offset];
+    }
+    T operator[](int index) const {
+        return storage[index + offset];
+    }
+};
+
+/* The solvers in Multigrid.h and PCGSolver.h work in double */
+typedef GhostedArrayOf<double> GhostedArray;
+
+/* Cell types of a grid and the pressure operator they give rise to.
+ *
+ * For every fluid cell the operator is the five-point stencil
+ *
+ *     diagonal*p[i] - sum of p over fluid neighbours
+ *
+ * (times the scale used by project()), where the diagonal counts all
+ * neighbours that aren't solid: empty neighbours hold p = 0 and so only
+ * contribute to the diagonal. The domain border is solid.
+ *
+ * Rather than testing neighbours on every visit, rebuild() condenses this
+ * into one byte per cell for the diagonal and a bit mask of the fluid
+ * neighbours. Kernels weight each neighbour by its bit, so applying the
+ * stencil needs no branches as long as the arrays it reads have a ghost
+ * margin (see GhostedArray). Cells that aren't fluid have a zero diagonal
+ * and no neighbours; solvers leave them alone.
+ *
+ * A third mask marks which faces of a cell are open, i.e. have no solid on
+ * either side, for computing divergence and applying pressure to velocities.
+ * Faces on the domain border count as open when the cell itself isn't
+ * solid; project() handles the border walls as before.
+ */
+class PressureStencil {
+    int width;
+    int height;
+
+    vector<uint8_t> types;
+    vector<uint8_t> diagonals;
+    vector<uint8_t> couplings;
+    vector<uint8_t> openFaces;
+
+    /* Whether any cell is empty; if not, pressure is only defined up to a
+     * constant
+     */
+    bool emptyCells;
+    /* Whether any cell is solid, i.e. the domain has interior obstacles */
+    bool solidCells;
+    /* Bumped by every rebuild, so solvers can tell when to refresh data
+     * they derived from the stencil
+     */
+    unsigned revisionCount;
+    bool dirty;
+
+    bool solidAt(int x, int y) const {
+        return types[x + y*width] == CELL_SOLID;
+    }
+
+public:
+    PressureStencil(int w, int h) : width(w), height(h), types(w*h, CELL_FLUID),
+            diagonals(w*h), couplings(w*h), openFaces(w*h), emptyCells(false),
+            solidCells(false), revisionCount(0), dirty(true) {
+        rebuild();
+    }
+
+    int gridWidth() const {
+        return width;
+    }
+    int gridHeight() const {
+        return height;
+    }
+
+    CellType type(int x, int y) const {
+        return (CellType)types[x + y*width];
+    }
+
+    /* Changes the type of a cell. Takes effect with the next rebuild() */
+    void setType(int x, int y, CellType type) {
+        if (types[x + y*width] != type) {
+            types[x + y*width] = type;
+            dirty = true;
+        }
+    }
+
+    /* Whether cell types changed since the last rebuild */
+    bool needsRebuild() const {
+        return dirty;
+    }
+
+    unsigned revision() const {
+        return revisionCount;
+    }
+
+    bool hasEmptyCells() const {
+        return emptyCells;
+    }
+
+    bool hasSolidCells() const {
+        return solidCells;
+    }
+
+    /* Recomputes the per-cell coefficients from the cell types */
+    void rebuild() {
+        emptyCells = false;
+        solidCells = false;
+        for (int y = 0, index = 0; y < height; y++) {
+            for (int x = 0; x < width; x++, index++) {
+                uint8_t type = types[index];
+                emptyCells |= type == CELL_EMPTY;
+                solidCells |= type == CELL_SOLID;
+
+                uint8_t open = 0;
+                if (type != CELL_SOLID) {
+                    if (x == 0          || !solidAt(x - 1, y)) open |= NEIGHBOUR_LEFT;
+                    if (y == 0          || !solidAt(x, y - 1)) open |= NEIGHBOUR_DOWN;
+                    if (x == width - 1  || !solidAt(x + 1, y)) open |= NEIGHBOUR_RIGHT;
+                    if (y == height - 1 || !solidAt(x, y + 1)) open |= NEIGHBOUR_UP;
+                }
+                openFaces[index] = open;
+
+                uint8_t diag = 0, coupled = 0;
+                if (type == CELL_FLUID) {
+                    if (x > 0 && !solidAt(x - 1, y)) {
+                        diag++;
+                        coupled |= types[index - 1] == CELL_FLUID ? NEIGHBOUR_LEFT : 0;
+                    }
+                    if (y > 0 && !solidAt(x, y - 1)) {
+                        diag++;
+                        coupled |= types[index - width] == CELL_FLUID ? NEIGHBOUR_DOWN : 0;
+                    }
+                    if (x < width - 1 && !solidAt(x + 1, y)) {
+                        diag++;
+                        coupled |= types[index + 1] == CELL_FLUID ? NEIGHBOUR_RIGHT : 0;
+                    }
+                    if (y < height - 1 && !solidAt(x, y + 1)) {
+                        diag++;
+                        coupled |= types[index + width] == CELL_FLUID ? NEIGHBOUR_UP : 0;
+                    }
+                }
+                diagonals[index] = diag;
+                couplings[index] = coupled;
+            }
+        }
+
+        dirty = false;
+        revisionCount++;
+    }
+
+    /* Stencil for a grid with half the resolution, each cell covering a 2x2
+     * block of this one (a partial block at an odd border). A coarse cell is
+     * empty if any of its children is, so it stays non-singular whenever
+     * this one is; otherwise it is fluid if any child is.
+     */
+    PressureStencil coarsened() const {
+        PressureStencil coarse((width + 1)/2, (height + 1)/2);
+        for (int y = 0; y < coarse.height; y++) {
+            for (int x = 0; x < coarse.width; x++) {
+                bool fluid = false, empty = false;
+                for (int dy = 0; dy < 2 && 2*y + dy < height; dy++) {
+                    for (int dx = 0; dx < 2 && 2*x + dx < width; dx++) {
+                        CellType child = type(2*x + dx, 2*y + dy);
+                        fluid |= child == CELL_FLUID;
+                        empty |= child == CELL_EMPTY;
+                    }
+                }
+                coarse.setType(x, y, empty ? CELL_EMPTY : fluid ? CELL_FLUID : CELL_SOLID);
+            }
+        }
+        coarse.rebuild();
+        return coarse;
+    }
+
+    /* Diagonal of cell `index' in units of the stencil scale, 0 unless the
+     * pressure is solved for there
+     */
+    double diagonal(int index) const {
+        return diagonals[index];
+    }
+
+    /* 1 if the pressure of cell `index' is solved for, 0 otherwise */
+    double fluid(int index) const {
+        return diagonals[index] != 0;
+    }
+
+    /* Bit masks of the fluid neighbours and of the open faces of a cell */
+    unsigned neighbours(int index) const {
+        return couplings[index];
+    }
+    unsigned faces(int index) const {
+        return openFaces[index];
+    }
+
+    /* Cell types as set, one CellType per byte */
+    const uint8_t *typeData() const {
+        return types.data();
+    }
+
+    const uint8_t *diagonalData() const {
+        return diagonals.data();
+    }
+    const uint8_t *neighbourData() const {
+        return couplings.data();
+    }
+
+    /* 1 if `bit' is set in `mask', 0 otherwise, without branching */
+    static double weight(unsigned mask, unsigned bit) {
+        return (double)((mask & bit) != 0);
+    }
+
+    /* Sum of v over the fluid neighbours of cell `index'. v needs a ghost
+     * margin.
+     */
+    double neighbourSum(const double *v, int index) const {
+        unsigned m = couplings[index];
+        return weight(m, NEIGHBOUR_LEFT)*v[index - 1] + weight(m, NEIGHBOUR_DOWN)*v[index - width] +
+               weight(m, NEIGHBOUR_RIGHT)*v[index + 1] + weight(m, NEIGHBOUR_UP)*v[index + width];
+    }
+
+    /* The stencil applied to v at cell `index', in units of the scale */
+    double apply(const double *v, int index) const {
+        return diagonal(index)*v[index] - neighbourSum(v, index);
+    }
+};
+
+#endif
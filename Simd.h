@@ -0,0 +1,239 @@
+#ifndef __SIMD__
+#define __SIMD__
+
+#include <stdint.h>
+#include <string.h>
+
+/* The vectorized kernels use GCC/Clang target attributes so they can be
+ * compiled into a baseline x86-64 build and selected at runtime.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FLUID_X86_KERNELS 1
+#include <immintrin.h>
+
+/* Whether the running CPU supports AVX2, checked once */
+inline bool cpuHasAVX2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+
+/* AVX2 operations on vectors of T, so that kernels are written once for
+ * both precisions. A vector holds LANES values: four doubles or eight
+ * floats, so float kernels process twice the cells per instruction.
+ *
+ * Index holds one 32-bit integer per lane and Lanes one integer of the
+ * lane's width, for testing stencil bits.
+ */
+template<typename T> struct AVX2;
+
+template<> struct AVX2<double> {
+    typedef __m256d Vec;
+    typedef __m128i Index;
+    typedef __m256i Lanes;
+    static const int LANES = 4;
+
+    __attribute__((target("avx2"))) static Vec set1(double v) { return _mm256_set1_pd(v); }
+    __attribute__((target("avx2"))) static Vec zero() { return _mm256_setzero_pd(); }
+    __attribute__((target("avx2"))) static Vec loadu(const double *p) { return _mm256_loadu_pd(p); }
+    __attribute__((target("avx2"))) static Vec load(const double *p) { return _mm256_load_pd(p); }
+    __attribute__((target("avx2"))) static void storeu(double *p, Vec v) { _mm256_storeu_pd(p, v); }
+    __attribute__((target("avx2"))) static void store(double *p, Vec v) { _mm256_store_pd(p, v); }
+    __attribute__((target("avx2"))) static Vec add(Vec a, Vec b) { return _mm256_add_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec sub(Vec a, Vec b) { return _mm256_sub_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec mul(Vec a, Vec b) { return _mm256_mul_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec div(Vec a, Vec b) { return _mm256_div_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec min(Vec a, Vec b) { return _mm256_min_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec max(Vec a, Vec b) { return _mm256_max_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec bitAnd(Vec a, Vec b) { return _mm256_and_pd(a, b); }
+    __attribute__((target("avx2"))) static Vec andNot(Vec a, Vec b) { return _mm256_andnot_pd(a, b); }
+
+    /* All ones in the lanes equal to zero */
+    __attribute__((target("avx2"))) static Vec isZero(Vec a) {
+        return _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_EQ_OQ);
+    }
+    /* Clears the sign bit when and-ed with a vector */
+    __attribute__((target("avx2"))) static Vec absMask() {
+        return _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffffLL));
+    }
+    __attribute__((target("avx2"))) static Vec allOnes() {
+        return _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    }
+    /* All ones in every other lane, starting with lane `first' (0 or 1) */
+    __attribute__((target("avx2"))) static Vec alternateLanes(int first) {
+        return first ? _mm256_castsi256_pd(_mm256_set_epi64x(-1, 0, -1, 0))
+                     : _mm256_castsi256_pd(_mm256_set_epi64x(0, -1, 0, -1));
+    }
+    /* 0, 1, 2, ... in consecutive lanes */
+    __attribute__((target("avx2"))) static Vec ramp() {
+        return _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+    }
+    /* Stores the lanes of v whose mask lane is all ones */
+    __attribute__((target("avx2"))) static void maskStore(double *p, Vec mask, Vec v) {
+        _mm256_maskstore_pd(p, _mm256_castpd_si256(mask), v);
+    }
+    /* Largest lane */
+    __attribute__((target("avx2"))) static double maxLane(Vec v) {
+        __m128d half = _mm_max_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+        return _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+    }
+
+    /* Lanes truncated to integers, and back */
+    __attribute__((target("avx2"))) static Index truncate(Vec v) { return _mm256_cvttpd_epi32(v); }
+    __attribute__((target("avx2"))) static Vec convert(Index i) { return _mm256_cvtepi32_pd(i); }
+    /* x + y*width */
+    __attribute__((target("avx2"))) static Index linearIndex(Index x, Index y, int width) {
+        return _mm_add_epi32(x, _mm_mullo_epi32(y, _mm_set1_epi32(width)));
+    }
+
+    /* Loads src[i], src[i + 1] into the low and src[j], src[j + 1] into the
+     * high half of the result
+     */
+    __attribute__((target("avx2"))) static Vec pairs(const double *src, int i, int j) {
+        return _mm256_insertf128_pd(_mm256_castpd128_pd256(_mm_loadu_pd(src + i)), _mm_loadu_pd(src + j), 1);
+    }
+
+    /* The four values around each lane's position in a grid of the given
+     * width: src[index], src[index + 1] and the same one row up. The two
+     * values of a row are adjacent in memory, so they are loaded as pairs
+     * and transposed, which is cheaper than four gathers.
+     */
+    __attribute__((target("avx2")))
+    static void corners(const double *src, Index index, int width, Vec &x00, Vec &x10, Vec &x01, Vec &x11) {
+        alignas(16) int at[4];
+        _mm_store_si128((__m128i *)at, index);
+
+        Vec a = pairs(src, at[0], at[2]);
+        Vec b = pairs(src, at[1], at[3]);
+        Vec c = pairs(src, at[0] + width, at[2] + width);
+        Vec d = pairs(src, at[1] + width, at[3] + width);
+
+        x00 = _mm256_unpacklo_pd(a, b), x10 = _mm256_unpackhi_pd(a, b);
+        x01 = _mm256_unpacklo_pd(c, d), x11 = _mm256_unpackhi_pd(c, d);
+    }
+
+    /* src[cell*stride + first + lane] for each lane's cell, for grids that
+     * store `stride' values per cell side by side
+     */
+    __attribute__((target("avx2")))
+    static Vec gatherStrided(const double *src, Index cell, int stride, int first) {
+        Index index = _mm_add_epi32(_mm_mullo_epi32(cell, _mm_set1_epi32(stride)),
+                _mm_add_epi32(_mm_set1_epi32(first), _mm_set_epi32(3, 2, 1, 0)));
+        return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), src, index, allOnes(), 8);
+    }
+
+    /* Stencil bytes of consecutive cells, one per lane */
+    __attribute__((target("avx2"))) static Lanes loadBytes(const uint8_t *bytes) {
+        int32_t packed;
+        memcpy(&packed, bytes, sizeof(packed));
+        return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(packed));
+    }
+    /* Stencil bytes of consecutive cells converted to values */
+    __attribute__((target("avx2"))) static Vec loadCounts(const uint8_t *bytes) {
+        int32_t packed;
+        memcpy(&packed, bytes, sizeof(packed));
+        return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+    }
+    /* All ones in the lanes that have `bit' set */
+    __attribute__((target("avx2"))) static Vec bitLanes(Lanes bytes, unsigned bit) {
+        __m256i b = _mm256_set1_epi64x(bit);
+        return _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(bytes, b), b));
+    }
+    /* Whether the bytes of all LANES cells starting at `bytes' equal `value' */
+    static bool allBytes(const uint8_t *bytes, uint8_t value) {
+        uint32_t packed;
+        memcpy(&packed, bytes, sizeof(packed));
+        return packed == value*0x01010101u;
+    }
+};
+
+template<> struct AVX2<float> {
+    typedef __m256 Vec;
+    typedef __m256i Index;
+    typedef __m256i Lanes;
+    static const int LANES = 8;
+
+    __attribute__((target("avx2"))) static Vec set1(float v) { return _mm256_set1_ps(v); }
+    __attribute__((target("avx2"))) static Vec zero() { return _mm256_setzero_ps(); }
+    __attribute__((target("avx2"))) static Vec loadu(const float *p) { return _mm256_loadu_ps(p); }
+    __attribute__((target("avx2"))) static Vec load(const float *p) { return _mm256_load_ps(p); }
+    __attribute__((target("avx2"))) static void storeu(float *p, Vec v) { _mm256_storeu_ps(p, v); }
+    __attribute__((target("avx2"))) static void store(float *p, Vec v) { _mm256_store_ps(p, v); }
+    __attribute__((target("avx2"))) static Vec add(Vec a, Vec b) { return _mm256_add_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec sub(Vec a, Vec b) { return _mm256_sub_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec mul(Vec a, Vec b) { return _mm256_mul_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec div(Vec a, Vec b) { return _mm256_div_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec min(Vec a, Vec b) { return _mm256_min_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec max(Vec a, Vec b) { return _mm256_max_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec bitAnd(Vec a, Vec b) { return _mm256_and_ps(a, b); }
+    __attribute__((target("avx2"))) static Vec andNot(Vec a, Vec b) { return _mm256_andnot_ps(a, b); }
+
+    __attribute__((target("avx2"))) static Vec isZero(Vec a) {
+        return _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_EQ_OQ);
+    }
+    __attribute__((target("avx2"))) static Vec absMask() {
+        return _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    }
+    __attribute__((target("avx2"))) static Vec allOnes() {
+        return _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    }
+    __attribute__((target("avx2"))) static Vec alternateLanes(int first) {
+        return first ? _mm256_castsi256_ps(_mm256_set_epi32(-1, 0, -1, 0, -1, 0, -1, 0))
+                     : _mm256_castsi256_ps(_mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1));
+    }
+    __attribute__((target("avx2"))) static Vec ramp() {
+        return _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+    }
+    __attribute__((target("avx2"))) static void maskStore(float *p, Vec mask, Vec v) {
+        _mm256_maskstore_ps(p, _mm256_castps_si256(mask), v);
+    }
+    __attribute__((target("avx2"))) static float maxLane(Vec v) {
+        __m128 half = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+        return _mm_cvtss_f32(_mm_max_ss(half, _mm_shuffle_ps(half, half, 1)));
+    }
+
+    __attribute__((target("avx2"))) static Index truncate(Vec v) { return _mm256_cvttps_epi32(v); }
+    __attribute__((target("avx2"))) static Vec convert(Index i) { return _mm256_cvtepi32_ps(i); }
+    __attribute__((target("avx2"))) static Index linearIndex(Index x, Index y, int width) {
+        return _mm256_add_epi32(x, _mm256_mullo_epi32(y, _mm256_set1_epi32(width)));
+    }
+
+    /* Eight lanes make pair loads and transposes costlier than gathers */
+    __attribute__((target("avx2")))
+    static void corners(const float *src, Index index, int width, Vec &x00, Vec &x10, Vec &x01, Vec &x11) {
+        Index up = _mm256_add_epi32(index, _mm256_set1_epi32(width));
+        Index one = _mm256_set1_epi32(1);
+        x00 = _mm256_i32gather_ps(src, index, 4);
+        x10 = _mm256_i32gather_ps(src, _mm256_add_epi32(index, one), 4);
+        x01 = _mm256_i32gather_ps(src, up, 4);
+        x11 = _mm256_i32gather_ps(src, _mm256_add_epi32(up, one), 4);
+    }
+
+    __attribute__((target("avx2")))
+    static Vec gatherStrided(const float *src, Index cell, int stride, int first) {
+        Index index = _mm256_add_epi32(_mm256_mullo_epi32(cell, _mm256_set1_epi32(stride)),
+                _mm256_add_epi32(_mm256_set1_epi32(first), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0)));
+        return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), src, index, allOnes(), 4);
+    }
+
+    __attribute__((target("avx2"))) static Lanes loadBytes(const uint8_t *bytes) {
+        int64_t packed;
+        memcpy(&packed, bytes, sizeof(packed));
+        return _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(packed));
+    }
+    __attribute__((target("avx2"))) static Vec loadCounts(const uint8_t *bytes) {
+        return _mm256_cvtepi32_ps(loadBytes(bytes));
+    }
+    __attribute__((target("avx2"))) static Vec bitLanes(Lanes bytes, unsigned bit) {
+        __m256i b = _mm256_set1_epi32(bit);
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bytes, b), b));
+    }
+    static bool allBytes(const uint8_t *bytes, uint8_t value) {
+        uint64_t packed;
+        memcpy(&packed, bytes, sizeof(packed));
+        return packed == value*0x0101010101010101ull;
+    }
+};
+#endif
+
+#endif
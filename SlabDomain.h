@@ -0,0 +1,432 @@
+#ifndef __SLABDOMAIN__
+#define __SLABDOMAIN__
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <sched.h>
+#include <signal.h>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/* Rows of halo every slab keeps of its neighbours by default. Semi-Lagrangian
+ * advection reads up to the CFL number plus two rows past a slab, so this
+ * allows advance() with a CFL number of up to 1.
+ */
+const int SLAB_HALO = 3;
+
+/* One rank's view of a grid split into horizontal slabs across processes
+ * that share memory, see launchSlabs().
+ *
+ * Rank r owns global rows ownedBegin() ... ownedEnd()-1 and keeps copies of
+ * up to halo() rows of either neighbour around them. Its local grid runs
+ * from global row localOrigin() for localRows() rows: the halo below, the
+ * owned rows, then the halo above. The bottom and top ranks have no halo
+ * on the domain border.
+ *
+ * Ranks talk through one POSIX shared memory segment:
+ *
+ * - Every rank has a mailbox towards each neighbour. A mailbox holds one
+ *   message and two sequence numbers: the writer publishes message n by
+ *   setting `sequence' to n once the payload is written, and the reader
+ *   hands the buffer back by setting `consumed' to n once it has copied
+ *   it. Each side only ever waits for the other's counter, so exchanges
+ *   take no locks and no system calls.
+ * - Reductions go through a slot per rank, in two banks used by alternate
+ *   rounds, so that a fast rank can publish the next round while a slow
+ *   one is still reading the current one.
+ * - A shared result buffer collects the owned rows of a field from every
+ *   rank, see gather().
+ *
+ * Waiting spins briefly and then yields. If any rank fails, launchSlabs()
+ * raises a flag that makes every waiting rank throw instead of hanging.
+ */
+class SlabDomain {
+    struct alignas(64) Header {
+        atomic<int> failed;
+    };
+
+    struct alignas(64) Mailbox {
+        atomic<uint64_t> sequence;
+        alignas(64) atomic<uint64_t> consumed;
+    };
+
+    struct alignas(64) ReduceSlot {
+        atomic<uint64_t> round;
+        double value;
+    };
+
+    char *segment;
+    Header *header;
+    ReduceSlot *slots;
+    char *mailboxes;
+    size_t mailboxBytes;
+    double *results;
+
+    int rankIndex;
+    int ranks;
+    int width;
+    int height;
+    int haloRows;
+    int y0, y1;
+
+    /* Messages sent and received per direction: 0 down, 1 up */
+    uint64_t sent[2];
+    uint64_t received[2];
+    uint64_t reductions;
+
+    /* Mailbox of `rank' towards its neighbour below (0) or above (1) */
+    Mailbox &mailbox(int rank, int direction) const {
+        return *(Mailbox *)(mailboxes + (2*rank + direction)*mailboxBytes);
+    }
+
+    static char *payload(Mailbox &box) {
+        return (char *)&box + sizeof(Mailbox);
+    }
+
+    /* Spins until `counter' reaches `value' */
+    void waitFor(const atomic<uint64_t> &counter, uint64_t value) const {
+        for (int spins = 0; counter.load(memory_order_acquire) < value; spins++) {
+            if (header->failed.load(memory_order_relaxed))
+                throw runtime_error("slab: another rank failed");
+            if (spins > 1000)
+                sched_yield();
+        }
+    }
+
+    void send(int direction, const void *data, size_t bytes) {
+        Mailbox &box = mailbox(rankIndex, direction);
+        waitFor(box.consumed, sent[direction]);
+        memcpy(payload(box), data, bytes);
+        box.sequence.store(++sent[direction], memory_order_release);
+    }
+
+    /* Receives from the neighbour in `direction' its message towards us */
+    void receive(int direction, void *data, size_t bytes) {
+        Mailbox &box = mailbox(rankIndex + (direction ? 1 : -1), 1 - direction);
+        uint64_t n = ++received[direction];
+        waitFor(box.sequence, n);
+        memcpy(data, payload(box), bytes);
+        box.consumed.store(n, memory_order_release);
+    }
+
+    template<typename Combine>
+    double allreduce(double value, const Combine &combine) {
+        uint64_t round = ++reductions;
+        ReduceSlot *bank = slots + (round & 1)*ranks;
+        bank[rankIndex].value = value;
+        bank[rankIndex].round.store(round, memory_order_release);
+
+        double result = value;
+        for (int r = 0; r < ranks; r++) {
+            if (r == rankIndex)
+                continue;
+            waitFor(bank[r].round, round);
+            result = combine(result, bank[r].value);
+        }
+        return result;
+    }
+
+public:
+    /* Bytes of shared memory launchSlabs() maps for the given decomposition */
+    static size_t segmentSize(int ranks, int width, int height, int halo, size_t *mailboxBytes = 0) {
+        size_t box = sizeof(Mailbox) + ((size_t)(width + 1)*halo*sizeof(double) + 63)/64*64;
+        if (mailboxBytes)
+            *mailboxBytes = box;
+        return sizeof(Header) + 2*ranks*sizeof(ReduceSlot) + 2*ranks*box +
+                (size_t)(width + 1)*(height + 1)*sizeof(double);
+    }
+
+    /* Rank `rank' of `count' on a segment of segmentSize() bytes that is
+     * zero or was only used by the same decomposition before
+     */
+    SlabDomain(char *sharedSegment, int rank, int count, int w, int h, int halo)
+            : segment(sharedSegment), rankIndex(rank), ranks(count), width(w), height(h), haloRows(halo),
+              reductions(0) {
+        segmentSize(ranks, width, height, halo, &mailboxBytes);
+        header = (Header *)segment;
+        slots = (ReduceSlot *)(segment + sizeof(Header));
+        mailboxes = (char *)(slots + 2*ranks);
+        results = (double *)result(segment, segmentSize(ranks, width, height, halo), width, height);
+
+        y0 = (int)((long)height*rank/ranks);
+        y1 = (int)((long)height*(rank + 1)/ranks);
+        if (y1 - y0 < halo)
+            throw runtime_error("slab: fewer rows per rank than halo rows");
+        sent[0] = sent[1] = received[0] = received[1] = 0;
+    }
+
+    int rank() const {
+        return rankIndex;
+    }
+
+    int rankCount() const {
+        return ranks;
+    }
+
+    int halo() const {
+        return haloRows;
+    }
+
+    /* Rows of the whole domain */
+    int domainRows() const {
+        return height;
+    }
+
+    /* Global rows this rank owns */
+    int ownedBegin() const {
+        return y0;
+    }
+    int ownedEnd() const {
+        return y1;
+    }
+    int ownedRows() const {
+        return y1 - y0;
+    }
+
+    /* Halo rows below and above the owned ones */
+    int haloBelow() const {
+        return rankIndex > 0 ? haloRows : 0;
+    }
+    int haloAbove() const {
+        return rankIndex < ranks - 1 ? haloRows : 0;
+    }
+
+    /* Rows of the local grid and the global row its first one is */
+    int localRows() const {
+        return haloBelow() + ownedRows() + haloAbove();
+    }
+    int localOrigin() const {
+        return y0 - haloBelow();
+    }
+
+    /* Refreshes the halo of a field from the neighbours: the `depth'
+     * rows on either side of the owned ones. Local row y of the field
+     * starts at rows + y*stride and holds `count' values. Every rank has to
+     * make the same calls in the same order.
+     */
+    template<typename T>
+    void exchange(T *rows, int stride, int count, int depth) {
+        int below = haloBelow(), owned = ownedRows();
+        vector<T> packed((size_t)count*depth);
+        size_t bytes = packed.size()*sizeof(T);
+
+        auto pack = [&](int first) {
+            for (int k = 0; k < depth; k++)
+                memcpy(packed.data() + (size_t)k*count, rows + (size_t)(first + k)*stride, count*sizeof(T));
+        };
+        auto unpack = [&](int first) {
+            for (int k = 0; k < depth; k++)
+                memcpy(rows + (size_t)(first + k)*stride, packed.data() + (size_t)k*count, count*sizeof(T));
+        };
+
+        if (haloBelow()) {
+            pack(below);
+            send(0, packed.data(), bytes);
+        }
+        if (haloAbove()) {
+            pack(below + owned - depth);
+            send(1, packed.data(), bytes);
+            receive(1, packed.data(), bytes);
+            unpack(below + owned);
+        }
+        if (haloBelow()) {
+            receive(0, packed.data(), bytes);
+            unpack(below - depth);
+        }
+    }
+
+    /* Largest and total value over all ranks, returned on every rank */
+    double allreduceMax(double value) {
+        return allreduce(value, [](double a, double b) { return max(a, b); });
+    }
+    double allreduceSum(double value) {
+        return allreduce(value, [](double a, double b) { return a + b; });
+    }
+
+    /* Waits for every rank to get here */
+    void barrier() {
+        allreduceMax(0.0);
+    }
+
+    /* Copies the owned rows of a field into the shared result buffer at
+     * their global position, `count' values per row; the top rank also
+     * copies `extraRows' rows past its last owned one, for fields of faces.
+     * Returns once every rank has, so rank 0 or the launcher can read the
+     * whole field with result().
+     */
+    template<typename T>
+    void gather(const T *rows, int stride, int count, int extraRows = 0) {
+        int n = ownedRows() + (rankIndex == ranks - 1 ? extraRows : 0);
+        for (int k = 0; k < n; k++) {
+            const T *row = rows + (size_t)(haloBelow() + k)*stride;
+            for (int x = 0; x < count; x++)
+                results[(size_t)(y0 + k)*count + x] = double(row[x]);
+        }
+        barrier();
+    }
+
+    /* The field put together by the last gather(), row y at y*count */
+    const double *result() const {
+        return results;
+    }
+
+    /* Raises the flag that makes every rank waiting on another give up,
+     * in the segment of any rank
+     */
+    static void abortAll(char *sharedSegment) {
+        ((Header *)sharedSegment)->failed.store(1, memory_order_relaxed);
+    }
+
+    /* Where result() lives in a segment of segmentSize() bytes */
+    static const double *result(const char *sharedSegment, size_t bytes, int width, int height) {
+        return (const double *)(sharedSegment + bytes) - (size_t)(width + 1)*(height + 1);
+    }
+};
+
+/* CPUs of NUMA node `node' from sysfs, empty if there is no such node */
+inline vector<int> numaNodeCPUs(int node) {
+    vector<int> cpus;
+    ifstream list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+    string range;
+    while (getline(list, range, ',')) {
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash == string::npos ? first : atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/* Pins the calling process to its share of the machine: ranks are spread
+ * evenly over the NUMA nodes, and the ranks on one node split its CPUs.
+ * Memory the rank allocates afterwards is then placed on its node when
+ * first touched. Returns the number of CPUs it got, 0 if pinning wasn't
+ * possible.
+ */
+inline int pinSlabRank(int rank, int ranks) {
+    vector<vector<int> > nodes;
+    for (int node = 0;; node++) {
+        vector<int> cpus = numaNodeCPUs(node);
+        if (cpus.empty())
+            break;
+        nodes.push_back(cpus);
+    }
+    if (nodes.empty()) {
+        /* No NUMA information, treat the machine as one node */
+        cpu_set_t all;
+        if (sched_getaffinity(0, sizeof(all), &all) != 0)
+            return 0;
+        nodes.resize(1);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &all))
+                nodes[0].push_back(cpu);
+    }
+
+    int nodeCount = (int)nodes.size();
+    int node = (int)((long)rank*nodeCount/ranks);
+    /* Ranks that land on the same node, and this one's place among them */
+    int first = (int)(((long)node*ranks + nodeCount - 1)/nodeCount);
+    int last = (int)(((long)(node + 1)*ranks + nodeCount - 1)/nodeCount);
+    int share = max(last - first, 1), place = rank - first;
+
+    const vector<int> &cpus = nodes[node];
+    size_t begin = cpus.size()*place/share, end = cpus.size()*(place + 1)/share;
+    if (end <= begin)
+        end = begin + 1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = begin; i < end && i < cpus.size(); i++)
+        CPU_SET(cpus[i], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+    return CPU_COUNT(&set);
+}
+
+/* Runs body(domain, cpus) in `ranks' forked processes, each owning one slab
+ * of a width x height grid with `halo' rows of halo and pinned as by
+ * pinSlabRank(); `cpus' is the number of CPUs it got. The segment is
+ * unlinked as soon as it is mapped, so nothing is left behind however the
+ * ranks end. If `gathered' is given, it receives the shared result buffer
+ * once all ranks are done, see SlabDomain::gather(). Returns whether every
+ * rank finished successfully.
+ */
+inline bool launchSlabs(int ranks, int width, int height, int halo,
+        const function<void(SlabDomain &, int)> &body, vector<double> *gathered = 0) {
+    size_t bytes = SlabDomain::segmentSize(ranks, width, height, halo);
+    string name = "/fluid_slabs_" + to_string(getpid());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        throw runtime_error("slab: cannot create shared memory " + name);
+    shm_unlink(name.c_str());
+    if (ftruncate(fd, bytes) != 0) {
+        close(fd);
+        throw runtime_error("slab: cannot size shared memory");
+    }
+    void *address = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        throw runtime_error("slab: cannot map shared memory");
+    char *segment = (char *)address;
+
+    /* Output of the parent would otherwise be flushed by every child too */
+    fflush(stdout);
+    fflush(stderr);
+
+    vector<pid_t> children;
+    for (int rank = 0; rank < ranks; rank++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = 0;
+            try {
+                int cpus = pinSlabRank(rank, ranks);
+                SlabDomain domain(segment, rank, ranks, width, height, halo);
+                body(domain, cpus);
+            } catch (const exception &e) {
+                fprintf(stderr, "Rank %d failed: %s\n", rank, e.what());
+                SlabDomain::abortAll(segment);
+                status = 1;
+            }
+            fflush(stdout);
+            fflush(stderr);
+            _exit(status);
+        }
+        if (pid < 0) {
+            SlabDomain::abortAll(segment);
+            break;
+        }
+        children.push_back(pid);
+    }
+
+    bool succeeded = (int)children.size() == ranks;
+    for (size_t i = 0; i < children.size(); i++) {
+        int status;
+        if (waitpid(children[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            /* Ranks waiting on this one would never get an answer */
+            SlabDomain::abortAll(segment);
+            succeeded = false;
+        }
+    }
+
+    if (gathered) {
+        const double *results = SlabDomain::result(segment, bytes, width, height);
+        gathered->assign(results, results + (size_t)(width + 1)*(height + 1));
+    }
+    munmap(segment, bytes);
+    return succeeded;
+}
+
+#endif
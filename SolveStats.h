@@ -0,0 +1,54 @@
+#ifndef __SOLVESTATS__
+#define __SOLVESTATS__
+
+/* Outcome of one pressure solve, whichever method performed it */
+struct SolveStats {
+    /* Gauss-Seidel sweeps, multigrid cycles or CG iterations that were run */
+    int iterations;
+    /* Largest remaining change in any cell, in pressure units. This is what
+     * the Gauss-Seidel loop has always compared against its tolerance: the
+     * residual of a cell divided by its diagonal.
+     */
+    double maxError;
+    /* Whether maxError got below the tolerance within the budget */
+    bool converged;
+};
+
+/* Running totals FluidSolver keeps when measuring how much warm starting
+ * the pressure solve saves
+ */
+struct WarmStartStats {
+    /* Number of solves measured */
+    int solves;
+    /* Iterations those solves took from their warm start */
+    long iterations;
+    /* Iterations the same solves took starting from zero pressure */
+    long coldIterations;
+    /* Iterations the last solve took from zero, to compare with
+     * FluidSolver::lastSolveStats()
+     */
+    int lastColdIterations;
+
+    long iterationsSaved() const {
+        return coldIterations - iterations;
+    }
+};
+
+/* Bytes FluidSolver estimates one step moved between memory and the cores,
+ * by stage. Every pass over the grid counts as streaming each array it
+ * touches once; sweeps that temporal blocking runs on a tile already in
+ * cache are not counted again. The multigrid and CG solvers don't report
+ * their traffic, so `solve' is only filled in for Gauss-Seidel and SOR.
+ */
+struct TrafficStats {
+    long rhs;
+    long solve;
+    long pressure;
+    long advect;
+
+    long total() const {
+        return rhs + solve + pressure + advect;
+    }
+};
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef __TELEMETRY__
+#define __TELEMETRY__
+
+/* Low-overhead timing and counters for both solvers.
+ *
+ * Code is instrumented with the macros at the bottom of this file:
+ * TELEMETRY_SCOPE(stage) times the rest of the enclosing block,
+ * TELEMETRY_COUNT(counter, value) records a value and TELEMETRY_STEP()
+ * starts the next step, which samples are tagged with. Without
+ * FLUID_TELEMETRY defined the macros expand to nothing and none of the
+ * code below is compiled.
+ *
+ * Samples go into a fixed-size ring buffer that any number of threads
+ * append to without locking; once it is full the oldest samples are
+ * overwritten. write() dumps what the ring holds as CSV, JSON, or Chrome
+ * trace events (load the file in chrome://tracing or Perfetto).
+ */
+
+/* Stages timed by TELEMETRY_SCOPE */
+enum TelemetryStage {
+    STAGE_ADVECT,
+    STAGE_BUILD_RHS,
+    STAGE_PROJECT,
+    STAGE_APPLY_PRESSURE,
+    STAGE_OUTPUT,
+    STAGE_COUNT
+};
+
+/* Values recorded by TELEMETRY_COUNT */
+enum TelemetryCounter {
+    COUNTER_SOLVE_ITERATIONS, /* Iterations, cycles or sweeps of a pressure solve */
+    COUNTER_SOLVE_ERROR,      /* Maximum error a pressure solve ended with */
+    COUNTER_SWEEP_ERROR,      /* Maximum change of each sweep, the residual history */
+    COUNTER_SUBSTEPS,         /* Substeps taken for a frame */
+    COUNTER_BYTES_WRITTEN,    /* Bytes of output written for a frame */
+    COUNTER_COLD_ITERATIONS,  /* Iterations of the same solve from zero, see setWarmStartMeasurement() */
+    COUNTER_COUNT
+};
+
+/* File formats of Telemetry::write() */
+enum TelemetryFormat {
+    TELEMETRY_CSV,
+    TELEMETRY_JSON,
+    TELEMETRY_CHROME_TRACE
+};
+
+#ifdef FLUID_TELEMETRY
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* One timed span or counter value */
+struct TelemetrySample {
+    uint32_t step;
+    uint16_t counter; /* 1 for counters, 0 for spans */
+    uint16_t id;      /* TelemetryStage or TelemetryCounter */
+    uint32_t thread;  /* Small number per recording thread */
+    int64_t start;    /* Nanoseconds since the recorder was created */
+    double value;     /* Duration in nanoseconds, or the counter's value */
+};
+
+class Telemetry {
+    /* A slot's sequence is the index of the sample it holds plus one, or
+     * zero while a writer is filling it in, so that readers can tell
+     * a consistent sample from a torn or stale one.
+     */
+    struct alignas(64) Slot {
+        atomic<uint64_t> sequence;
+        TelemetrySample sample;
+    };
+
+    vector<Slot> slots;
+    uint64_t mask;
+    atomic<uint64_t> head;
+    atomic<uint32_t> currentStep;
+    atomic<uint32_t> threads;
+    chrono::steady_clock::time_point epoch;
+
+    uint32_t threadNumber() {
+        static thread_local uint32_t number = threads.fetch_add(1, memory_order_relaxed);
+        return number;
+    }
+
+    void record(bool counter, int id, int64_t start, double value) {
+        TelemetrySample s = {currentStep.load(memory_order_relaxed), (uint16_t)counter, (uint16_t)id,
+                threadNumber(), start, value};
+        uint64_t n = head.fetch_add(1, memory_order_relaxed);
+        Slot &slot = slots[n & mask];
+        slot.sequence.store(0, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        slot.sample = s;
+        slot.sequence.store(n + 1, memory_order_release);
+    }
+
+    static const char *name(const TelemetrySample &s) {
+        static const char *stages[STAGE_COUNT] = {
+            "advect", "build_rhs", "project", "apply_pressure", "output"
+        };
+        static const char *counters[COUNTER_COUNT] = {
+            "solve_iterations", "solve_error", "sweep_error", "substeps", "bytes_written",
+            "cold_iterations"
+        };
+        return s.counter ? counters[s.id] : stages[s.id];
+    }
+
+public:
+    /* Keeps the last 2^logCapacity samples */
+    explicit Telemetry(int logCapacity = 16) : slots((size_t)1 << logCapacity), mask(((uint64_t)1 << logCapacity) - 1),
+            head(0), currentStep(0), threads(0), epoch(chrono::steady_clock::now()) {
+        for (size_t i = 0; i < slots.size(); i++)
+            slots[i].sequence.store(0, memory_order_relaxed);
+    }
+
+    /* The recorder the macros write to */
+    static Telemetry &global() {
+        static Telemetry instance;
+        return instance;
+    }
+
+    int64_t now() const {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    void span(TelemetryStage stage, int64_t start) {
+        record(false, stage, start, double(now() - start));
+    }
+
+    void count(TelemetryCounter counter, double value) {
+        record(true, counter, now(), value);
+    }
+
+    void nextStep() {
+        currentStep.fetch_add(1, memory_order_relaxed);
+    }
+
+    /* Copies out the samples the ring holds, oldest first. Samples being
+     * written at the same time are skipped.
+     */
+    vector<TelemetrySample> samples() const {
+        vector<TelemetrySample> out;
+        uint64_t end = head.load(memory_order_acquire);
+        uint64_t begin = end > slots.size() ? end - slots.size() : 0;
+        out.reserve(end - begin);
+        for (uint64_t n = begin; n < end; n++) {
+            const Slot &slot = slots[n & mask];
+            if (slot.sequence.load(memory_order_acquire) != n + 1)
+                continue;
+            TelemetrySample s;
+            memcpy(&s, &slot.sample, sizeof(s));
+            atomic_thread_fence(memory_order_acquire);
+            if (slot.sequence.load(memory_order_relaxed) == n + 1)
+                out.push_back(s);
+        }
+        return out;
+    }
+
+    /* Writes the samples to `fileName'. Returns false if it can't be
+     * written.
+     */
+    bool write(const string &fileName, TelemetryFormat format) const {
+        ofstream out(fileName);
+        if (!out)
+            return false;
+
+        vector<TelemetrySample> all = samples();
+        if (format == TELEMETRY_CSV) {
+            out << "step,thread,kind,name,start_ns,value" << endl;
+            for (size_t i = 0; i < all.size(); i++) {
+                const TelemetrySample &s = all[i];
+                out << s.step << "," << s.thread << "," << (s.counter ? "counter" : "span") << ","
+                    << name(s) << "," << s.start << "," << s.value << "\n";
+            }
+        } else if (format == TELEMETRY_JSON) {
+            out << "[" << endl;
+            for (size_t i = 0; i < all.size(); i++) {
+                const TelemetrySample &s = all[i];
+                out << "{\"step\": " << s.step << ", \"thread\": " << s.thread << ", \"kind\": \""
+                    << (s.counter ? "counter" : "span") << "\", \"name\": \"" << name(s) << "\", \"start_ns\": "
+                    << s.start << ", \"value\": " << s.value << "}" << (i + 1 < all.size() ? "," : "") << "\n";
+            }
+            out << "]" << endl;
+        } else {
+            /* Trace event timestamps are in microseconds */
+            out << "{\"traceEvents\": [" << endl;
+            for (size_t i = 0; i < all.size(); i++) {
+                const TelemetrySample &s = all[i];
+                out << "{\"name\": \"" << name(s) << "\", \"pid\": 0, \"tid\": " << s.thread
+                    << ", \"ts\": " << s.start/1000.0;
+                if (s.counter)
+                    out << ", \"ph\": \"C\", \"args\": {\"value\": " << s.value << "}}";
+                else
+                    out << ", \"ph\": \"X\", \"dur\": " << s.value/1000.0 << ", \"args\": {\"step\": " << s.step << "}}";
+                out << (i + 1 < all.size() ? "," : "") << "\n";
+            }
+            out << "]}" << endl;
+        }
+        return bool(out);
+    }
+};
+
+/* Times its own lifetime as one span of `stage' */
+class TelemetryScope {
+    TelemetryStage stage;
+    int64_t start;
+
+public:
+    explicit TelemetryScope(TelemetryStage s) : stage(s), start(Telemetry::global().now()) {}
+
+    ~TelemetryScope() {
+        Telemetry::global().span(stage, start);
+    }
+};
+
+#define TELEMETRY_JOIN2(a, b) a##b
+#define TELEMETRY_JOIN(a, b) TELEMETRY_JOIN2(a, b)
+#define TELEMETRY_SCOPE(stage) TelemetryScope TELEMETRY_JOIN(telemetryScope, __LINE__)(stage)
+#define TELEMETRY_COUNT(counter, value) Telemetry::global().count(counter, value)
+#define TELEMETRY_STEP() Telemetry::global().nextStep()
+
+#else
+
+/* sizeof keeps the value unevaluated but still counts its variables as used */
+#define TELEMETRY_SCOPE(stage) ((void)0)
+#define TELEMETRY_COUNT(counter, value) ((void)sizeof(value))
+#define TELEMETRY_STEP() ((void)0)
+
+#endif
+
+#endif
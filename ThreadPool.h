@@ -0,0 +1,297 @@
+#ifndef __THREADPOOL__
+#define __THREADPOOL__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/* A rectangular block of grid cells [x0, x1) x [y0, y1). `index' numbers
+ * the tiles of a domain row by row, so kernels can keep per-tile partial
+ * results and combine them in a fixed order, independent of which thread
+ * ran which tile.
+ */
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+    int index;
+};
+
+/* Persistent pool of worker threads for running per-cell kernels in parallel.
+ *
+ * A domain is cut into 2D tiles small enough that the data a kernel touches
+ * in one tile stays in the L2 cache. Each thread (the calling thread takes
+ * part as well) starts out owning a contiguous range of tiles, which keeps
+ * neighbouring tiles on the same core. A thread that runs out of work steals
+ * tiles from the far end of another thread's range, so uneven tiles or a
+ * descheduled thread don't leave the rest of the pool idle.
+ *
+ * The pool runs one job at a time and must only be driven from a single
+ * thread. Kernels run on it must not write to cells outside their own tile.
+ */
+class ThreadPool {
+    /* A thread's share of the tiles, packed as (end << 32) | begin so that
+     * the owner taking from the front and thieves taking from the back can
+     * both update it with a single compare-and-swap.
+     */
+    struct alignas(64) TileRange {
+        atomic<uint64_t> range;
+    };
+
+    vector<thread> workers;
+    vector<TileRange> ranges;
+
+    mutex lock;
+    condition_variable wake;
+    condition_variable finished;
+    uint64_t generation;
+    int busyWorkers;
+    bool stopping;
+
+    /* The current job, type-erased so that running one never allocates */
+    void (*job)(void *context, const Tile &tile, int thread);
+    void *jobContext;
+    /* Tiles of the current job if given as a list, else they are computed */
+    const Tile *tileList;
+    int tilesX;
+    int tileW, tileH;
+    int domainW, domainH;
+
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return ((uint64_t)end << 32) | begin;
+    }
+
+    /* Takes the next tile from the front of thread t's own range */
+    bool popOwn(int t, int &tile) {
+        atomic<uint64_t> &r = ranges[t].range;
+        uint64_t cur = r.load(memory_order_relaxed);
+        for (;;) {
+            uint32_t begin = (uint32_t)cur, end = (uint32_t)(cur >> 32);
+            if (begin >= end)
+                return false;
+            if (r.compare_exchange_weak(cur, pack(begin + 1, end), memory_order_acq_rel)) {
+                tile = begin;
+                return true;
+            }
+        }
+    }
+
+    /* Takes a tile from the back of the fullest range of another thread */
+    bool steal(int t, int &tile) {
+        int n = (int)ranges.size();
+        for (;;) {
+            int victim = -1;
+            uint32_t most = 0;
+            for (int k = 1; k < n; k++) {
+                int other = (t + k) % n;
+                uint64_t cur = ranges[other].range.load(memory_order_relaxed);
+                uint32_t begin = (uint32_t)cur, end = (uint32_t)(cur >> 32);
+                if (end > begin && end - begin > most) {
+                    most = end - begin;
+                    victim = other;
+                }
+            }
+            if (victim < 0)
+                return false;
+
+            atomic<uint64_t> &r = ranges[victim].range;
+            uint64_t cur = r.load(memory_order_relaxed);
+            uint32_t begin = (uint32_t)cur, end = (uint32_t)(cur >> 32);
+            if (begin < end && r.compare_exchange_strong(cur, pack(begin, end - 1), memory_order_acq_rel)) {
+                tile = end - 1;
+                return true;
+            }
+            /* Lost the race for that range, look again */
+        }
+    }
+
+    void runTiles(int t) {
+        int index;
+        while (popOwn(t, index) || steal(t, index)) {
+            if (tileList) {
+                job(jobContext, tileList[index], t);
+                continue;
+            }
+            Tile tile;
+            tile.x0 = (index % tilesX)*tileW;
+            tile.y0 = (index / tilesX)*tileH;
+            tile.x1 = min(tile.x0 + tileW, domainW);
+            tile.y1 = min(tile.y0 + tileH, domainH);
+            tile.index = index;
+            job(jobContext, tile, t);
+        }
+    }
+
+    void workerLoop(int t) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+            }
+
+            runTiles(t);
+
+            {
+                lock_guard<mutex> guard(lock);
+                if (--busyWorkers == 0)
+                    finished.notify_one();
+            }
+        }
+    }
+
+    template<typename Kernel>
+    static void invoke(void *context, const Tile &tile, int thread) {
+        (*static_cast<const Kernel *>(context))(tile, thread);
+    }
+
+public:
+    /* Creates a pool that runs jobs on `threads' threads in total, including
+     * the caller. 0 uses one thread per hardware thread.
+     */
+    explicit ThreadPool(int threads = 0) : ranges(max(resolveCount(threads), 1)),
+            generation(0), busyWorkers(0), stopping(false), tileList(0) {
+        for (int t = 1; t < (int)ranges.size(); t++)
+            workers.push_back(thread(&ThreadPool::workerLoop, this, t));
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t t = 0; t < workers.size(); t++)
+            workers[t].join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    static int resolveCount(int threads) {
+        if (threads > 0)
+            return threads;
+        return max((int)thread::hardware_concurrency(), 1);
+    }
+
+    int threadCount() const {
+        return (int)ranges.size();
+    }
+
+    /* Size of the per-core L2 cache in bytes, or a conservative guess */
+    static long l2CacheSize() {
+        long size = -1;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+        size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return size > 0 ? size : 256*1024;
+    }
+
+    /* Picks a tile size for a width x height domain such that a tile's
+     * working set of `bytesPerCell' bytes per cell fills about half of L2,
+     * leaving room for the neighbouring rows that stencils read. Tiles span
+     * whole rows where possible since all grids are stored row by row.
+     */
+    static void tileSize(int width, int height, int bytesPerCell, int &tw, int &th) {
+        long cells = max(l2CacheSize()/2/max(bytesPerCell, 1), 64L);
+        tw = (int)min<long>(width, max(cells/8, 64L));
+        th = (int)max(min<long>(height, cells/max(tw, 1)), 1L);
+    }
+
+    /* Number of tiles forEachTile cuts a width x height domain into */
+    static int tileCount(int width, int height, int tw, int th) {
+        return ((width + tw - 1)/tw)*((height + th - 1)/th);
+    }
+
+    /* Runs kernel(tile, thread) over every tile of a width x height domain
+     * and returns once all of them are done. `thread' is in
+     * [0, threadCount()) and can be used to index per-thread scratch data.
+     */
+    template<typename Kernel>
+    void forEachTile(int width, int height, int tw, int th, const Kernel &kernel) {
+        if (width <= 0 || height <= 0)
+            return;
+
+        int tx = (width  + tw - 1)/tw;
+        int ty = (height + th - 1)/th;
+        int tiles = tx*ty;
+
+        if (workers.empty() || tiles == 1) {
+            for (int y = 0, index = 0; y < height; y += th)
+                for (int x = 0; x < width; x += tw, index++)
+                    kernel(Tile{x, y, min(x + tw, width), min(y + th, height), index}, 0);
+            return;
+        }
+
+        tilesX = tx;
+        tileW = tw;
+        tileH = th;
+        domainW = width;
+        domainH = height;
+        run(tiles, 0, kernel);
+    }
+
+    /* Same as above with the tile size picked by tileSize() */
+    template<typename Kernel>
+    void forEachTile(int width, int height, int bytesPerCell, const Kernel &kernel) {
+        int tw, th;
+        tileSize(width, height, bytesPerCell, tw, th);
+        forEachTile(width, height, tw, th, kernel);
+    }
+
+    /* Runs kernel(tile, thread) over the given tiles, for domains where only
+     * some tiles need work. Threads start out with contiguous ranges of the
+     * list, so it should be ordered to keep neighbouring tiles together.
+     */
+    template<typename Kernel>
+    void forEachTile(const vector<Tile> &tiles, const Kernel &kernel) {
+        if (tiles.empty())
+            return;
+
+        if (workers.empty() || tiles.size() == 1) {
+            for (size_t i = 0; i < tiles.size(); i++)
+                kernel(tiles[i], 0);
+            return;
+        }
+
+        run((int)tiles.size(), tiles.data(), kernel);
+    }
+
+private:
+    /* Hands `tiles' tiles out to all threads and waits for them */
+    template<typename Kernel>
+    void run(int tiles, const Tile *list, const Kernel &kernel) {
+        int n = threadCount();
+        for (int t = 0; t < n; t++) {
+            uint32_t begin = (uint32_t)((int64_t)tiles*t/n);
+            uint32_t end   = (uint32_t)((int64_t)tiles*(t + 1)/n);
+            ranges[t].range.store(pack(begin, end), memory_order_relaxed);
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            job = &invoke<Kernel>;
+            jobContext = const_cast<Kernel *>(&kernel);
+            tileList = list;
+            busyWorkers = (int)workers.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        runTiles(0);
+
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&] { return busyWorkers == 0; });
+    }
+};
+
+#endif
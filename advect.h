@@ -1,6 +1,9 @@
 #ifndef __ADVECT__
 #define __ADVECT__
 
+#include "mac_grid.h"
+#include "grid_fns.h"
+#include "Telemetry.h"
 #include <cmath>
 #include <typeinfo>
 using namespace std;
@@ -27,15 +30,23 @@ float bound(float input, float maxSize){
 	return input;
 }
 
+/*
+	Pair of cell indices to interpolate between, returned by value.
+*/
+struct CellPair {
+	int left;
+	int right;
+};
+
 /*
 	factor: float&; possibly incorrect interpolation factor
 	cell_prev: int; cell index closest to prev
 	prev: float; location in velocity field at previous time step
 
 	Alters by reference: factor
-	Return type: vector<float> of size 2
+	Return type: CellPair
 */
-vector<int> cellLeftOrRight(float &factor, int cell_prev, float prev, int max) {
+CellPair cellLeftOrRight(float &factor, int cell_prev, float prev, int max) {
 	/*
 	Returns the correct cell indices to use in interpolation.
 	May change factor if prev is to the left/below cell_prev.
@@ -52,36 +63,43 @@ vector<int> cellLeftOrRight(float &factor, int cell_prev, float prev, int max) {
 		cell_left = cell_prev;
 		cell_right = cell_prev + 1;
 	}
-	return vector<int> {bound(cell_left, max), bound(cell_right, max)};
+	return CellPair {(int)bound(cell_left, max), (int)bound(cell_right, max)};
 }
 
 /*
-	horizVelocityGrid: 2D vector of floats; holds vertical horizontal components at 1/2 indices
-	vertVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
-	updatedHorizGrid: 2D vector of floats; will hold the updated horizontal velocities
-	updatedVertGrid: 2D vector of floats; will hold the updated vertical velocities
+	horizVelocityField: MACField; horizontal velocity components at 1/2 indices, read from src, written to dst
+	vertVelocityField: MACField; vertical velocity components at 1/2 indices, read from src, written to dst
 	xDim: int; number of cells in x direction
 	yDim: int; number of cells in y direction
 	deltaT: float; time step over which we advect the velocity
 	i: integer; index for ith row
 	j: integer; index for jth column
 
-	Alters by reference: updatedHorizGrid and updatedVertGrid
+	Alters by reference: dst buffers of horizVelocityField and vertVelocityField
 	Return type: void
 */
-void advect(vector< vector<float> > &horizVelocityGrid, vector< vector<float> > &vertVelocityGrid, vector< vector<float> >& updatedHorizGrid, vector< vector<float> >& updatedVertGrid, int xDim, int yDim, float deltaT) {
+void advect(MACField &horizVelocityField, MACField &vertVelocityField, int xDim, int yDim, float deltaT) {
 	/*
 	Updates the velocity field due to advection.
+	The result is written to the dst buffers; call flip() on both fields to make it current.
 	*/
+	TELEMETRY_SCOPE(STAGE_ADVECT);
+	const MACGrid &horizVelocityGrid = horizVelocityField.src();
+	const MACGrid &vertVelocityGrid = vertVelocityField.src();
+	MACGrid &updatedHorizGrid = horizVelocityField.dst();
+	MACGrid &updatedVertGrid = vertVelocityField.dst();
+
+	float* centerX = rowScratch(yDim);
+	float* centerY = centerX + yDim;
 
 	// For all grid cells
 	for (int i = 0; i < xDim; ++i) {
+		// Get center velocities for the whole ith row
+		centerVelRow(horizVelocityGrid, vertVelocityGrid, i, yDim, centerX, centerY);
 		for (int j = 0; j < yDim; ++j) {
-			// Get center velocity for (i,j)th cell
-			vector<float>* centerVelocity_n1 = centerVel(horizVelocityGrid, vertVelocityGrid, i, j);
 			// Trace velocity at (i,j) backwards over timeframe deltaT
-			float x_prev = bound(i - centerVelocity_n1->at(0) * deltaT, xDim-1);
-			float y_prev = bound(j - centerVelocity_n1->at(1) * deltaT, yDim-1);
+			float x_prev = bound(i - centerX[j] * deltaT, xDim-1);
+			float y_prev = bound(j - centerY[j] * deltaT, yDim-1);
 			// Get cell of floating point locations
 			int cell_x_prev = round(x_prev);
 			int cell_y_prev = round(y_prev);
@@ -89,24 +107,28 @@ void advect(vector< vector<float> > &horizVelocityGrid, vector< vector<float> >
 			// Interpolate floating point location with velocities at cell locations
 			float alpha = x_prev - cell_x_prev;
 			float beta = y_prev - cell_y_prev;
-			vector<int> xCellsLeftAndRight = cellLeftOrRight(alpha, cell_x_prev, x_prev, xDim-1);
-			vector<int> yCellsTopAndBottom = cellLeftOrRight(alpha, cell_y_prev, y_prev, yDim-1);
-			float horizVelTerm1 = (1-alpha) * horizVelocityGrid.at(xCellsLeftAndRight.at(0)).at(cell_y_prev);
+			CellPair xCellsLeftAndRight = cellLeftOrRight(alpha, cell_x_prev, x_prev, xDim-1);
+			CellPair yCellsTopAndBottom = cellLeftOrRight(alpha, cell_y_prev, y_prev, yDim-1);
+			float horizVelTerm1 = (1-alpha) * horizVelocityGrid.at(xCellsLeftAndRight.left, cell_y_prev);
 
-			float horizVelTerm2 = alpha * horizVelocityGrid.at(xCellsLeftAndRight.at(1)).at(cell_y_prev);
+			float horizVelTerm2 = alpha * horizVelocityGrid.at(xCellsLeftAndRight.right, cell_y_prev);
 
 			// Update horizontal velocity of current cell with interpolated velocity at previous location
-			updatedHorizGrid.at(i).at(j) = horizVelTerm1 + horizVelTerm2;
+			updatedHorizGrid.at(i, j) = horizVelTerm1 + horizVelTerm2;
 
-			float vertVelTerm1 = (1-alpha) * vertVelocityGrid.at(cell_x_prev).at(yCellsTopAndBottom.at(0));
+			float vertVelTerm1 = (1-alpha) * vertVelocityGrid.at(cell_x_prev, yCellsTopAndBottom.left);
 
-			float vertVelTerm2 = alpha * vertVelocityGrid.at(cell_x_prev).at(yCellsTopAndBottom.at(1));
+			float vertVelTerm2 = alpha * vertVelocityGrid.at(cell_x_prev, yCellsTopAndBottom.right);
 
 			// Update vertical velocity of current cell with interpolated velocity at previous location
-			updatedVertGrid.at(i).at(j) = vertVelTerm1 + vertVelTerm2;
-
-			delete centerVelocity_n1;
+			updatedVertGrid.at(i, j) = vertVelTerm1 + vertVelTerm2;
 		}
+		// The top face of the row isn't advected; carry it over unchanged
+		updatedVertGrid.at(i, yDim) = vertVelocityGrid.at(i, yDim);
+	}
+	// Nor is the rightmost column of horizontal faces
+	for (int j = 0; j < yDim; ++j) {
+		updatedHorizGrid.at(xDim, j) = horizVelocityGrid.at(xDim, j);
 	}
 }
 
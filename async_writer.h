@@ -0,0 +1,261 @@
+#ifndef __ASYNCWRITER__
+#define __ASYNCWRITER__
+
+#include "frame_file.h"
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// What submitting a frame does when every buffer is waiting to be written
+enum BackPressure {
+	BACKPRESSURE_BLOCK, // Wait for the writer thread to free a buffer
+	BACKPRESSURE_DROP   // Discard the frame and carry on
+};
+
+/*
+	Counters of an AsyncFrameWriter, as returned by stats()
+*/
+struct FrameQueueStats {
+	long framesQueued;
+	long framesWritten;
+	long framesDropped;
+	// Frames waiting to be written right now, and the most there have been
+	int depth;
+	int maxDepth;
+	// Time submitting threads spent blocked on a full queue
+	double stallSeconds;
+	// Time the writer thread spent writing
+	double writeSeconds;
+};
+
+/*
+	Moves frame output off the time loop. Frames are handed over in one of a
+	fixed number of preallocated buffers and a dedicated thread writes them
+	to a FrameWriter in order.
+
+	Submitting only copies the frame into a free buffer, so the caller
+	blocks (or drops the frame, depending on the BackPressure mode) only when
+	the writer thread has fallen behind by the whole queue.
+*/
+class AsyncFrameWriter {
+	FrameWriter &writer;
+	BackPressure mode;
+
+	// Preallocated frame buffers, each either free or queued for writing
+	vector<vector<float>> buffers;
+	vector<int> freeBuffers;
+	// Queued buffers, a ring of `queued' entries starting at `head'
+	vector<int> queue;
+	int head;
+	int queued;
+	bool writing;
+
+	mutex lock;
+	condition_variable bufferFreed;
+	condition_variable frameQueued;
+	bool stopping;
+	exception_ptr failure;
+	FrameQueueStats counters;
+	thread worker;
+
+	void writerLoop() {
+		/*
+		Writes queued frames until close() is called and the queue is empty.
+		*/
+		unique_lock<mutex> guard(lock);
+		for (;;) {
+			frameQueued.wait(guard, [&] { return stopping || queued > 0; });
+			if (queued == 0) {
+				return;
+			}
+			int buffer = queue[head];
+			head = (head + 1) % queue.size();
+			queued--;
+			writing = true;
+			guard.unlock();
+
+			auto start = chrono::steady_clock::now();
+			exception_ptr error;
+			try {
+				writer.writeFrame(buffers[buffer].data());
+			} catch (...) {
+				error = current_exception();
+			}
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			guard.lock();
+			writing = false;
+			counters.writeSeconds += seconds;
+			if (error) {
+				if (!failure) {
+					failure = error;
+				}
+			} else {
+				counters.framesWritten++;
+			}
+			freeBuffers.push_back(buffer);
+			bufferFreed.notify_all();
+		}
+	}
+
+	/*
+		guard: unique_lock by reference; holds `lock'
+
+		Return type: int
+	*/
+	int acquireBuffer(unique_lock<mutex> &guard) {
+		/*
+		Returns a free buffer, or -1 if the frame has to be dropped.
+		*/
+		if (failure) {
+			rethrow_exception(failure);
+		}
+		if (freeBuffers.empty()) {
+			if (mode == BACKPRESSURE_DROP) {
+				counters.framesDropped++;
+				return -1;
+			}
+			auto start = chrono::steady_clock::now();
+			bufferFreed.wait(guard, [&] { return !freeBuffers.empty() || failure; });
+			counters.stallSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			if (failure) {
+				rethrow_exception(failure);
+			}
+		}
+		int buffer = freeBuffers.back();
+		freeBuffers.pop_back();
+		return buffer;
+	}
+
+	/*
+		buffer: int; buffer holding the frame
+
+		Return type: void
+	*/
+	void enqueue(int buffer) {
+		/*
+		Hands a filled buffer to the writer thread.
+		*/
+		lock_guard<mutex> guard(lock);
+		queue[(head + queued) % queue.size()] = buffer;
+		queued++;
+		counters.framesQueued++;
+		counters.maxDepth = max(counters.maxDepth, queued);
+		frameQueued.notify_one();
+	}
+
+public:
+	/*
+		output: FrameWriter by reference; file the frames go to, must outlive this
+		capacity: int; number of frame buffers, i.e. how far writing may fall behind
+		backPressure: BackPressure; what to do with a frame when all buffers are in use
+	*/
+	AsyncFrameWriter(FrameWriter &output, int capacity = 4, BackPressure backPressure = BACKPRESSURE_BLOCK)
+			: writer(output), mode(backPressure), buffers(max(capacity, 1), vector<float>(output.frameSize())),
+			  queue(buffers.size()), head(0), queued(0), writing(false), stopping(false), counters() {
+		for (int b = (int)buffers.size() - 1; b >= 0; --b) {
+			freeBuffers.push_back(b);
+		}
+		worker = thread(&AsyncFrameWriter::writerLoop, this);
+	}
+
+	AsyncFrameWriter(const AsyncFrameWriter&) = delete;
+	AsyncFrameWriter& operator=(const AsyncFrameWriter&) = delete;
+
+	~AsyncFrameWriter() {
+		if (worker.joinable()) {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			frameQueued.notify_one();
+			worker.join();
+		}
+	}
+
+	/*
+		horizVelocityGrid: MACGrid; holds horizontal velocity components at 1/2 indices
+		vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
+
+		Return type: bool
+	*/
+	bool submitVelocityField(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid) {
+		/*
+		Snapshots the center velocities of the given fields and queues them as
+		a frame. Returns false if the frame was dropped. The grids can be
+		modified as soon as this returns.
+		*/
+		int buffer;
+		{
+			unique_lock<mutex> guard(lock);
+			buffer = acquireBuffer(guard);
+		}
+		if (buffer < 0) {
+			return false;
+		}
+		packVelocityFrame(horizVelocityGrid, vertVelocityGrid, writer.rows(), writer.cols(), buffers[buffer].data());
+		enqueue(buffer);
+		return true;
+	}
+
+	/*
+		data: const float*; writer.frameSize() floats in the frame layout
+
+		Return type: bool
+	*/
+	bool submitFrame(const float* data) {
+		/*
+		Copies the frame and queues it. Returns false if it was dropped.
+		*/
+		int buffer;
+		{
+			unique_lock<mutex> guard(lock);
+			buffer = acquireBuffer(guard);
+		}
+		if (buffer < 0) {
+			return false;
+		}
+		copy(data, data + buffers[buffer].size(), buffers[buffer].data());
+		enqueue(buffer);
+		return true;
+	}
+
+	/*
+		Return type: FrameQueueStats
+	*/
+	FrameQueueStats stats() {
+		lock_guard<mutex> guard(lock);
+		FrameQueueStats current = counters;
+		current.depth = queued + (writing ? 1 : 0);
+		return current;
+	}
+
+	/*
+		Return type: void
+	*/
+	void close() {
+		/*
+		Waits for every queued frame to be written, stops the writer thread
+		and closes the FrameWriter. Rethrows the first error the writer thread
+		ran into.
+		*/
+		if (worker.joinable()) {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			frameQueued.notify_one();
+			worker.join();
+		}
+		if (failure) {
+			rethrow_exception(failure);
+		}
+		writer.close();
+	}
+};
+
+#endif
@@ -0,0 +1,496 @@
+#include "mac_grid.h"
+#include "grid_fns.h"
+#include "utils.h"
+#include "advect.h"
+#include "grid_loader.h"
+#include "FluidSolver.cpp"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <stdlib.h>
+#include <iostream>
+
+/*
+	Benchmarks every stage of both solvers at grid sizes from 32^2 up to
+	4096^2: the velocity-only solver of solver.cpp (advect, center velocity
+	sampling and the text I/O) and FluidSolver (inflow, right hand side, each
+	pressure solver, applying pressure, advection and whole steps).
+
+	FluidSolver is benchmarked in double and float, the latter with names
+	ending in _float. Every benchmark reports the time per grid cell, the
+	effective memory bandwidth from a model of the bytes it has to stream,
+	and for pressure solves the iterations it took to reach the tolerance. Results can be
+	written as JSON and compared against an earlier run, flagging any
+	benchmark that got slower by more than the allowed margin.
+
+	--filter NAME only runs the benchmarks whose name contains NAME.
+
+	Usage: benchmark [--min-size N] [--max-size N] [--filter NAME]
+	                 [--json FILE] [--baseline FILE] [--margin F]
+	Exits with status 2 if any benchmark regressed against the baseline.
+	Build like solver.cpp, e.g. g++ -O2 -std=c++17 -pthread benchmark.cpp
+*/
+
+/* Lets the benchmarks reach the stages of FluidSolver::update() */
+struct FluidSolverBenchmark {
+	template<typename T>
+	static void buildRHS(FluidSolver<T> &solver) {
+		solver.updateCells();
+		solver.buildRHS();
+	}
+
+	template<typename T>
+	static SolveStats project(FluidSolver<T> &solver, int limit, double timestep) {
+		return solver.project(limit, timestep);
+	}
+
+	template<typename T>
+	static void clearPressure(FluidSolver<T> &solver) {
+		fill(solver.p, solver.p + solver.width * solver.height, T(0));
+	}
+
+	template<typename T>
+	static void applyPressure(FluidSolver<T> &solver, double timestep) {
+		solver.applyPressure(timestep);
+	}
+
+	template<typename T>
+	static void advect(FluidSolver<T> &solver, double timestep) {
+		solver.d->advect(timestep, *solver.ux, *solver.uy, solver.pool);
+		solver.ux->advect(timestep, *solver.ux, *solver.uy, solver.pool);
+		solver.uy->advect(timestep, *solver.ux, *solver.uy, solver.pool);
+	}
+};
+
+const double TIMESTEP = 0.005;
+/* Iteration budget of the pressure solves, as in FluidSolver::update() */
+const int SOLVE_LIMIT = 600;
+/* Text files grow to gigabytes above this size, so I/O stops here */
+const int IO_MAX_SIZE = 1024;
+
+/* Sampled values end up here so that the samplers can't be optimized away */
+volatile float sampleSink;
+
+/* Part of a benchmark name a benchmark has to contain to run, see --filter */
+string benchmarkFilter;
+
+/*
+	name: string; benchmark name
+
+	Return type: bool
+*/
+bool selected(const string &name) {
+	/*
+	Returns whether the named benchmark passes --filter, checked before
+	running it so that filtered out benchmarks cost nothing.
+	*/
+	return benchmarkFilter.empty() || name.find(benchmarkFilter) != string::npos;
+}
+
+struct BenchmarkResult {
+	string name;
+	int size;
+	double nsPerCell;
+	double gbPerSecond;
+	/* Solver iterations to reach the tolerance, 0 where that doesn't apply */
+	int iterations;
+	/* Runs of the benchmarked operation per second; frames for whole steps */
+	double perSecond;
+};
+
+/*
+	setup: function; run untimed before each repetition
+	work: function; the operation to time
+	minSeconds: double; keep repeating until this much time was measured
+
+	Return type: double
+*/
+double timeRepeated(const function<void()> &setup, const function<void()> &work, double minSeconds = 0.2) {
+	/*
+	Returns the fastest of several runs of work in nanoseconds. Runs at least
+	three times, and at most 1000.
+	*/
+	double best = 1e300, total = 0;
+	for (int run = 0; run < 1000 && (run < 3 || total < minSeconds * 1e9); ++run) {
+		setup();
+		auto start = chrono::steady_clock::now();
+		work();
+		double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+		best = min(best, ns);
+		total += ns;
+	}
+	return best;
+}
+
+/*
+	name: string; benchmark name
+	size: int; grid side length
+	cells: double; cells the operation covers
+	bytes: double; bytes the operation streams, by its model
+	ns: double; time the operation took
+	iterations: int; solver iterations, 0 if none
+
+	Return type: BenchmarkResult
+*/
+BenchmarkResult makeResult(string name, int size, double cells, double bytes, double ns, int iterations = 0) {
+	return BenchmarkResult {name, size, ns / cells, bytes / ns, iterations, 1e9 / ns};
+}
+
+/*
+	Two velocity fields of an n x n grid of solver.cpp, swirling so that
+	advection has to trace back over varying distances.
+*/
+struct GridFields {
+	MACField horiz;
+	MACField vert;
+
+	GridFields(int n) : horiz(n + 1, n, 0, 1, 0), vert(n, n + 1, 0, 0, 1) {
+		for (int buffer = 0; buffer < 2; ++buffer) {
+			for (int i = 0; i < n + 1; ++i) {
+				for (int j = 0; j < n; ++j) {
+					horiz.src().row(i)[j] = sin(0.1f * j);
+				}
+			}
+			for (int i = 0; i < n; ++i) {
+				for (int j = 0; j < n + 1; ++j) {
+					vert.src().row(i)[j] = cos(0.1f * i);
+				}
+			}
+			horiz.flip();
+			vert.flip();
+		}
+	}
+};
+
+/*
+	solver: FluidSolver by reference; the solver to add to
+
+	Return type: void
+*/
+template<typename T>
+void addPlumeInflow(FluidSolver<T> &solver) {
+	/*
+	Adds the inflow of a plume, a few cells high at every size.
+	*/
+	solver.addInflow(0.45, 0.2, 0.1, 0.05, 1.0, 0.0, 3.0);
+}
+
+/*
+	n: int; grid side length
+	pressureSolver: PressureSolver; the method project() uses
+	direct: bool; whether the DCT solver may take over
+
+	Return type: FluidSolver<T>*
+*/
+template<typename T>
+FluidSolver<T>* makeSolver(int n, PressureSolver pressureSolver = SOLVER_GAUSS_SEIDEL, bool direct = true) {
+	/*
+	Returns a solver with a plume's worth of inflow, so that the pressure
+	solve has divergence to remove.
+	*/
+	FluidSolver<T>* solver = new FluidSolver<T>(n, n, 0.1);
+	solver->setPressureSolver(pressureSolver);
+	solver->setDirectSolve(direct);
+	addPlumeInflow(*solver);
+	return solver;
+}
+
+/*
+	n: int; grid side length
+	run: function; receives each result
+
+	Return type: void
+*/
+void gridBenchmarks(int n, const function<void(const BenchmarkResult&)> &run) {
+	double cells = (double)n * n;
+	GridFields fields(n);
+
+	// Reads the other field and its own, writes its own, for both fields
+	if (selected("advect")) {
+		double ns = timeRepeated([] {}, [&] {
+			advect(fields.horiz, fields.vert, n, n, TIMESTEP);
+		});
+		run(makeResult("advect", n, cells, cells * 6 * sizeof(float), ns));
+	}
+
+	// Reads two faces per component and writes the two components
+	if (selected("center_vel")) {
+		double ns = timeRepeated([] {}, [&] {
+			float sum = 0;
+			for (int i = 0; i < n; ++i) {
+				for (int j = 0; j < n; ++j) {
+					sum += centerVel(fields.horiz.src(), fields.vert.src(), i, j).x;
+				}
+			}
+			sampleSink = sum;
+		});
+		run(makeResult("center_vel", n, cells, cells * 2 * sizeof(float), ns));
+	}
+
+	if (selected("center_vel_row")) {
+		float* centerX = rowScratch(n);
+		float* centerY = centerX + n;
+		double ns = timeRepeated([] {}, [&] {
+			for (int i = 0; i < n; ++i) {
+				centerVelRow(fields.horiz.src(), fields.vert.src(), i, n, centerX, centerY);
+			}
+			sampleSink = centerX[0];
+		});
+		run(makeResult("center_vel_row", n, cells, cells * 4 * sizeof(float), ns));
+	}
+
+	if (n > IO_MAX_SIZE) {
+		return;
+	}
+
+	// Bandwidth of the I/O paths is that of the text they produce or parse
+	string fileName = "benchmark_io.tmp";
+	if (selected("save_velocity_field")) {
+		double ns = timeRepeated([&] {
+			clearOutputFile(fileName, 1, n, n);
+		}, [&] {
+			saveVelocityField(fields.horiz.src(), fields.vert.src(), n, n, fileName);
+		});
+		ifstream written(fileName, ios::binary | ios::ate);
+		double textBytes = written.tellg();
+		run(makeResult("save_velocity_field", n, cells, textBytes, ns));
+	}
+
+	if (selected("get_input_data")) {
+		{
+			ofstream text(fileName, ios::trunc);
+			for (int i = 0; i < n; ++i) {
+				for (int j = 0; j < n; ++j) {
+					text << sin(0.1 * i * j) << (j + 1 < n ? " " : "\n");
+				}
+			}
+		}
+		ifstream input(fileName, ios::binary | ios::ate);
+		double textBytes = input.tellg();
+		double ns = timeRepeated([] {}, [&] {
+			delete getInputData(fileName);
+		});
+		run(makeResult("get_input_data", n, cells, textBytes, ns));
+	}
+	remove(fileName.c_str());
+}
+
+/*
+	n: int; grid side length
+	suffix: string; appended to every benchmark name, to tell the
+		precisions apart
+	run: function; receives each result
+
+	Return type: void
+*/
+template<typename T>
+void solverBenchmarks(int n, const string &suffix, const function<void(const BenchmarkResult&)> &run) {
+	const int B = sizeof(T);
+	double cells = (double)n * n;
+	FluidSolver<T>* solver = makeSolver<T>(n);
+
+	// The inflow covers a tenth of the domain each way; each quantity is read and written
+	double inflowCells = cells / 100;
+	if (selected("add_inflow" + suffix)) {
+		double ns = timeRepeated([] {}, [&] {
+			solver->addInflow(0.45, 0.45, 0.1, 0.1, 1.0, 0.0, 3.0);
+		});
+		run(makeResult("add_inflow" + suffix, n, inflowCells, inflowCells * 3 * 2 * B, ns));
+	}
+
+	// Reads ux, uy and two stencil bytes, writes r
+	if (selected("build_rhs" + suffix)) {
+		double ns = timeRepeated([] {}, [&] {
+			FluidSolverBenchmark::buildRHS(*solver);
+		});
+		run(makeResult("build_rhs" + suffix, n, cells, cells * (3 * B + 2), ns));
+	}
+
+	// Reads p, ux, uy and a stencil byte, writes ux, uy
+	if (selected("apply_pressure" + suffix)) {
+		double ns = timeRepeated([] {}, [&] {
+			FluidSolverBenchmark::applyPressure(*solver, TIMESTEP);
+		});
+		run(makeResult("apply_pressure" + suffix, n, cells, cells * (5 * B + 1), ns));
+	}
+
+	// Three quantities, each reading itself and both velocities and writing itself
+	if (selected("quantity_advect" + suffix)) {
+		double ns = timeRepeated([] {}, [&] {
+			FluidSolverBenchmark::advect(*solver, TIMESTEP);
+		});
+		run(makeResult("quantity_advect" + suffix, n, cells, cells * 3 * 4 * B, ns));
+	}
+	delete solver;
+
+	// Every solve starts from zero pressure on the same right hand side.
+	// Bandwidth counts one sweep over p, r and the stencil per iteration,
+	// which undercounts multigrid and CG; the direct solve moves about six
+	// passes over the grid. Multigrid, CG and the direct solver work in
+	// double whatever T is.
+	// Temporal blocking takes the same iterations as plain red-black SOR
+	// in fewer passes over memory, so its bandwidth is an effective one.
+	struct {
+		const char* name;
+		PressureSolver method;
+		bool direct;
+		int blocking;
+	} solves[] = {
+		{"project_gauss_seidel", SOLVER_GAUSS_SEIDEL, false, 1},
+		{"project_red_black_sor", SOLVER_RED_BLACK_SOR, false, 1},
+		{"project_sor_blocked", SOLVER_RED_BLACK_SOR, false, 4},
+		{"project_multigrid", SOLVER_MULTIGRID, false, 1},
+		{"project_pcg", SOLVER_CONJUGATE_GRADIENT, false, 1},
+		{"project_dct", SOLVER_GAUSS_SEIDEL, true, 1},
+	};
+	for (auto &solve : solves) {
+		string name = solve.name + suffix;
+		if (!selected(name)) {
+			continue;
+		}
+		solver = makeSolver<T>(n, solve.method, solve.direct);
+		solver->setTemporalBlocking(solve.blocking);
+		FluidSolverBenchmark::buildRHS(*solver);
+		SolveStats stats;
+		double ns = timeRepeated([&] {
+			FluidSolverBenchmark::clearPressure(*solver);
+		}, [&] {
+			stats = FluidSolverBenchmark::project(*solver, SOLVE_LIMIT, TIMESTEP);
+		}, 0.5);
+		double passes = solve.direct ? 6 : stats.iterations;
+		bool inDouble = solve.direct || solve.method == SOLVER_MULTIGRID || solve.method == SOLVER_CONJUGATE_GRADIENT;
+		int valueBytes = inDouble ? (int)sizeof(double) : B;
+		run(makeResult(name, n, cells, cells * (3 * valueBytes + 2) * passes, ns, stats.iterations));
+		delete solver;
+	}
+
+	// Whole steps with a fresh inflow every frame; bandwidth is what
+	// FluidSolver estimates it moved
+	if (selected("end_to_end_step" + suffix)) {
+		solver = makeSolver<T>(n);
+		solver->update(TIMESTEP);
+		double ns = timeRepeated([&] {
+			addPlumeInflow(*solver);
+		}, [&] {
+			solver->update(TIMESTEP);
+		}, 1.0);
+		run(makeResult("end_to_end_step" + suffix, n, cells, solver->lastStepTraffic().total(), ns));
+		delete solver;
+	}
+}
+
+/*
+	out: ostream by reference; the stream to write to
+	results: vector<BenchmarkResult>; results to write
+
+	Return type: void
+*/
+void writeJson(ostream &out, const vector<BenchmarkResult> &results) {
+	/*
+	Writes the results as a JSON array with one object per line, which is
+	also the layout readBaseline() expects.
+	*/
+	out << "[" << endl;
+	for (size_t i = 0; i < results.size(); ++i) {
+		const BenchmarkResult &r = results[i];
+		out << "{\"name\": \"" << r.name << "\", \"size\": " << r.size << ", \"ns_per_cell\": " << r.nsPerCell
+			<< ", \"gb_per_s\": " << r.gbPerSecond << ", \"iterations\": " << r.iterations
+			<< ", \"per_second\": " << r.perSecond << "}" << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	out << "]" << endl;
+}
+
+/*
+	fileName: string; JSON file written by an earlier run
+
+	Return type: map<string, double>
+*/
+map<string, double> readBaseline(string fileName) {
+	/*
+	Returns the ns per cell of every benchmark in the file, keyed by name
+	and size as "name/size".
+	*/
+	map<string, double> baseline;
+	ifstream in(fileName);
+	if (!in) {
+		throw runtime_error("benchmark: cannot open baseline " + fileName);
+	}
+	string line;
+	while (getline(in, line)) {
+		char name[64];
+		int size;
+		double nsPerCell;
+		if (sscanf(line.c_str(), "{\"name\": \"%63[^\"]\", \"size\": %d, \"ns_per_cell\": %lf", name, &size, &nsPerCell) == 3) {
+			baseline[string(name) + "/" + to_string(size)] = nsPerCell;
+		}
+	}
+	return baseline;
+}
+
+int main(int argc, char* argv[]) {
+	int minSize = 32;
+	int maxSize = 4096;
+	string jsonFile;
+	string baselineFile;
+	// Slowdown relative to the baseline that counts as a regression
+	double margin = 0.1;
+	for (int arg = 1; arg < argc; ++arg) {
+		string option = argv[arg];
+		if (option == "--min-size" && arg + 1 < argc) {
+			minSize = atoi(argv[++arg]);
+		} else if (option == "--max-size" && arg + 1 < argc) {
+			maxSize = atoi(argv[++arg]);
+		} else if (option == "--filter" && arg + 1 < argc) {
+			benchmarkFilter = argv[++arg];
+		} else if (option == "--json" && arg + 1 < argc) {
+			jsonFile = argv[++arg];
+		} else if (option == "--baseline" && arg + 1 < argc) {
+			baselineFile = argv[++arg];
+		} else if (option == "--margin" && arg + 1 < argc) {
+			margin = atof(argv[++arg]);
+		} else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	map<string, double> baseline;
+	if (!baselineFile.empty()) {
+		baseline = readBaseline(baselineFile);
+	}
+
+	vector<BenchmarkResult> results;
+	int regressions = 0;
+	printf("%-28s %6s %12s %10s %10s %12s\n", "benchmark", "size", "ns/cell", "GB/s", "iters", "per second");
+	auto run = [&](const BenchmarkResult &r) {
+		results.push_back(r);
+		printf("%-28s %6d %12.3f %10.2f %10d %12.2f", r.name.c_str(), r.size, r.nsPerCell,
+				r.gbPerSecond, r.iterations, r.perSecond);
+		auto before = baseline.find(r.name + "/" + to_string(r.size));
+		if (before != baseline.end()) {
+			double change = r.nsPerCell / before->second - 1;
+			printf("  %+6.1f%%", 100 * change);
+			if (change > margin) {
+				printf("  REGRESSION");
+				regressions++;
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	};
+
+	for (int n = minSize; n <= maxSize; n *= 2) {
+		gridBenchmarks(n, run);
+		solverBenchmarks<double>(n, "", run);
+		solverBenchmarks<float>(n, "_float", run);
+	}
+
+	if (!jsonFile.empty()) {
+		ofstream json(jsonFile);
+		writeJson(json, results);
+	}
+	if (!baseline.empty()) {
+		printf("%d regressions beyond %.0f%% against %s\n", regressions, 100 * margin, baselineFile.c_str());
+	}
+	return regressions > 0 ? 2 : 0;
+}
@@ -0,0 +1,518 @@
+#ifndef __CHECKPOINT__
+#define __CHECKPOINT__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+	Snapshots of simulation state for restarting a run.
+
+	A checkpoint file holds a CheckpointHeader, a table of CheckpointSection
+	entries and then the data of every section: a named rows x cols array of
+	one scalar type, stored densely in row-major order. Each section starts
+	on a page boundary, so a reader can map the file and copy sections out
+	page by page without any parsing. All values are little-endian.
+
+	Files are written under a temporary name and renamed into place once
+	complete, so a run that dies while checkpointing still leaves the
+	previous checkpoint intact.
+*/
+
+const char CHECKPOINT_MAGIC[8] = {'F', 'L', 'U', 'I', 'D', 'C', 'K', 'P'};
+const uint32_t CHECKPOINT_VERSION = 1;
+const uint64_t CHECKPOINT_ALIGN = 4096;
+
+// Values of CheckpointSection::scalarType
+const uint32_t CHECKPOINT_UINT8   = 1;
+const uint32_t CHECKPOINT_FLOAT32 = 2;
+const uint32_t CHECKPOINT_FLOAT64 = 3;
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerBytes;
+	uint32_t sectionCount;
+	uint32_t reserved0;
+	// Frame and simulated time the state belongs to
+	uint64_t frame;
+	double time;
+	uint64_t fileBytes;
+	uint8_t reserved[16];
+};
+static_assert(sizeof(CheckpointHeader) == 64, "checkpoint header must stay 64 bytes");
+
+struct CheckpointSection {
+	char name[16];
+	uint32_t scalarType;
+	uint32_t rows;
+	uint32_t cols;
+	uint32_t reserved;
+	uint64_t offset;
+	uint64_t bytes;
+};
+static_assert(sizeof(CheckpointSection) == 48, "checkpoint section must stay 48 bytes");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "checkpoints are written in host byte order, which must be little-endian"
+#endif
+
+inline uint32_t checkpointType(const uint8_t*) { return CHECKPOINT_UINT8; }
+inline uint32_t checkpointType(const float*) { return CHECKPOINT_FLOAT32; }
+inline uint32_t checkpointType(const double*) { return CHECKPOINT_FLOAT64; }
+
+/*
+	State staged for one checkpoint. Sections are copied in when added, so
+	the simulation can carry on while the copy is written. Buffers are kept
+	between checkpoints and only grow.
+*/
+class Checkpoint {
+	struct Staged {
+		CheckpointSection section;
+		vector<char> data;
+	};
+	vector<Staged> sections;
+	size_t used;
+
+	friend class CheckpointWriter;
+
+public:
+	uint64_t frame;
+	double time;
+
+	Checkpoint() : used(0), frame(0), time(0.0) {}
+
+	/*
+		Return type: void
+	*/
+	void clear() {
+		/*
+		Drops all sections, keeping their buffers for reuse.
+		*/
+		used = 0;
+	}
+
+	/*
+		name: const char*; section name, at most 15 characters
+		values: const T*; first value of row 0
+		rows: int; number of rows
+		cols: int; number of values per row
+		rowStride: int; distance in values between the starts of rows, cols if 0
+
+		Return type: void
+	*/
+	template<typename T>
+	void add(const char* name, const T* values, int rows, int cols, int rowStride = 0) {
+		/*
+		Copies a rows x cols array into the checkpoint.
+		*/
+		if (strlen(name) >= sizeof(CheckpointSection::name)) {
+			throw invalid_argument("checkpoint: section name too long");
+		}
+		if (rowStride == 0) {
+			rowStride = cols;
+		}
+		if (used == sections.size()) {
+			sections.emplace_back();
+		}
+		Staged &staged = sections[used++];
+		memset(&staged.section, 0, sizeof(staged.section));
+		strcpy(staged.section.name, name);
+		staged.section.scalarType = checkpointType(values);
+		staged.section.rows = rows;
+		staged.section.cols = cols;
+		staged.section.bytes = (uint64_t)rows * cols * sizeof(T);
+
+		staged.data.resize(staged.section.bytes);
+		T* out = reinterpret_cast<T*>(staged.data.data());
+		if (rowStride == cols) {
+			memcpy(out, values, staged.section.bytes);
+			return;
+		}
+		for (int i = 0; i < rows; ++i) {
+			memcpy(out + (size_t)i * cols, values + (size_t)i * rowStride, cols * sizeof(T));
+		}
+	}
+};
+
+/*
+	Counters of a CheckpointWriter, as returned by stats()
+*/
+struct CheckpointStats {
+	long checkpointsWritten;
+	// Time begin() spent waiting for the previous checkpoint to be written
+	double stallSeconds;
+	// Time the writer thread spent writing
+	double writeSeconds;
+};
+
+/*
+	Writes checkpoints on a background thread. A checkpoint is staged with
+	begin(), filled with Checkpoint::add and handed over with commit(). Only
+	staging copies data on the caller's thread; if the previous checkpoint
+	is still being written when the next one is due, begin() waits for it.
+*/
+class CheckpointWriter {
+	string fileName;
+
+	// One checkpoint can be staged while the other is written
+	Checkpoint buffers[2];
+	int staging;
+	int pending;
+	int writing;
+
+	mutex lock;
+	condition_variable written;
+	condition_variable committed;
+	bool stopping;
+	exception_ptr failure;
+	CheckpointStats counters;
+	thread worker;
+
+	/*
+		fd: int; open file
+		data: const void*; bytes to write
+		bytes: size_t; number of bytes
+		at: uint64_t; file offset
+
+		Return type: void
+	*/
+	static void writeAt(int fd, const void* data, size_t bytes, uint64_t at) {
+		/*
+		Writes all of data at the given offset, retrying short writes.
+		*/
+		const char* next = static_cast<const char*>(data);
+		while (bytes > 0) {
+			ssize_t written = pwrite(fd, next, bytes, at);
+			if (written < 0) {
+				throw runtime_error("checkpoint: write failed");
+			}
+			next += written;
+			bytes -= written;
+			at += written;
+		}
+	}
+
+	/*
+		checkpoint: Checkpoint; state to write
+
+		Return type: void
+	*/
+	void writeFile(Checkpoint &checkpoint) {
+		/*
+		Writes the checkpoint to a temporary file, flushes it to disk and
+		renames it over fileName.
+		*/
+		CheckpointHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+		header.version = CHECKPOINT_VERSION;
+		header.headerBytes = sizeof(header);
+		header.sectionCount = checkpoint.used;
+		header.frame = checkpoint.frame;
+		header.time = checkpoint.time;
+
+		uint64_t offset = sizeof(header) + checkpoint.used * sizeof(CheckpointSection);
+		for (size_t s = 0; s < checkpoint.used; ++s) {
+			offset = (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+			checkpoint.sections[s].section.offset = offset;
+			offset += checkpoint.sections[s].section.bytes;
+		}
+		header.fileBytes = offset;
+
+		string temporary = fileName + ".tmp";
+		int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			throw runtime_error("checkpoint: cannot create " + temporary);
+		}
+		try {
+			writeAt(fd, &header, sizeof(header), 0);
+			for (size_t s = 0; s < checkpoint.used; ++s) {
+				const Checkpoint::Staged &staged = checkpoint.sections[s];
+				writeAt(fd, &staged.section, sizeof(staged.section), sizeof(header) + s * sizeof(CheckpointSection));
+				writeAt(fd, staged.data.data(), staged.section.bytes, staged.section.offset);
+			}
+			if (ftruncate(fd, header.fileBytes) != 0 || fsync(fd) != 0) {
+				throw runtime_error("checkpoint: cannot flush " + temporary);
+			}
+		} catch (...) {
+			::close(fd);
+			unlink(temporary.c_str());
+			throw;
+		}
+		::close(fd);
+		if (rename(temporary.c_str(), fileName.c_str()) != 0) {
+			unlink(temporary.c_str());
+			throw runtime_error("checkpoint: cannot replace " + fileName);
+		}
+	}
+
+	void writerLoop() {
+		/*
+		Writes committed checkpoints until close() is called and none is left.
+		*/
+		unique_lock<mutex> guard(lock);
+		for (;;) {
+			committed.wait(guard, [&] { return stopping || pending >= 0; });
+			if (pending < 0) {
+				return;
+			}
+			writing = pending;
+			pending = -1;
+			guard.unlock();
+
+			auto start = chrono::steady_clock::now();
+			exception_ptr error;
+			try {
+				writeFile(buffers[writing]);
+			} catch (...) {
+				error = current_exception();
+			}
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			guard.lock();
+			writing = -1;
+			counters.writeSeconds += seconds;
+			if (error) {
+				if (!failure) {
+					failure = error;
+				}
+			} else {
+				counters.checkpointsWritten++;
+			}
+			written.notify_all();
+		}
+	}
+
+public:
+	/*
+		fileName: string; file every checkpoint replaces
+	*/
+	CheckpointWriter(string fileName)
+			: fileName(fileName), staging(-1), pending(-1), writing(-1), stopping(false), counters() {
+		worker = thread(&CheckpointWriter::writerLoop, this);
+	}
+
+	CheckpointWriter(const CheckpointWriter&) = delete;
+	CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+	~CheckpointWriter() {
+		if (worker.joinable()) {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			committed.notify_one();
+			worker.join();
+		}
+	}
+
+	/*
+		frame: uint64_t; frame the state belongs to
+		time: double; simulated time of the state
+
+		Return type: Checkpoint&
+	*/
+	Checkpoint& begin(uint64_t frame, double time) {
+		/*
+		Returns an empty checkpoint to stage the state in. Waits if the one
+		committed before is still queued, and rethrows the first error the
+		writer thread ran into.
+		*/
+		unique_lock<mutex> guard(lock);
+		if (pending >= 0) {
+			auto start = chrono::steady_clock::now();
+			written.wait(guard, [&] { return pending < 0 || failure; });
+			counters.stallSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}
+		if (failure) {
+			rethrow_exception(failure);
+		}
+		staging = writing == 0 ? 1 : 0;
+		Checkpoint &checkpoint = buffers[staging];
+		checkpoint.clear();
+		checkpoint.frame = frame;
+		checkpoint.time = time;
+		return checkpoint;
+	}
+
+	/*
+		Return type: void
+	*/
+	void commit() {
+		/*
+		Hands the checkpoint staged by begin() to the writer thread.
+		*/
+		lock_guard<mutex> guard(lock);
+		pending = staging;
+		staging = -1;
+		committed.notify_one();
+	}
+
+	/*
+		Return type: CheckpointStats
+	*/
+	CheckpointStats stats() {
+		lock_guard<mutex> guard(lock);
+		return counters;
+	}
+
+	/*
+		Return type: void
+	*/
+	void close() {
+		/*
+		Waits for the last checkpoint to be written and stops the writer
+		thread. Rethrows the first error the writer thread ran into.
+		*/
+		if (worker.joinable()) {
+			{
+				lock_guard<mutex> guard(lock);
+				stopping = true;
+			}
+			committed.notify_one();
+			worker.join();
+		}
+		if (failure) {
+			rethrow_exception(failure);
+		}
+	}
+};
+
+/*
+	Read-only view of a checkpoint file through mmap.
+*/
+class CheckpointReader {
+	const char* mapping;
+	size_t mappedBytes;
+	CheckpointHeader header;
+	const CheckpointSection* sections;
+
+	void fail(const string &message) {
+		if (mapping != nullptr) {
+			munmap(const_cast<char*>(mapping), mappedBytes);
+			mapping = nullptr;
+		}
+		throw runtime_error("checkpoint: " + message);
+	}
+
+	const CheckpointSection* find(const char* name) const {
+		for (uint32_t s = 0; s < header.sectionCount; ++s) {
+			if (strncmp(sections[s].name, name, sizeof(sections[s].name)) == 0) {
+				return &sections[s];
+			}
+		}
+		return nullptr;
+	}
+
+public:
+	/*
+		fileName: string; checkpoint file to open
+	*/
+	CheckpointReader(string fileName) : mapping(nullptr), mappedBytes(0), sections(nullptr) {
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("checkpoint: cannot open " + fileName);
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(header)) {
+			::close(fd);
+			throw runtime_error("checkpoint: " + fileName + " is too short");
+		}
+		mappedBytes = info.st_size;
+		void* address = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if (address == MAP_FAILED) {
+			throw runtime_error("checkpoint: cannot map " + fileName);
+		}
+		mapping = static_cast<const char*>(address);
+		memcpy(&header, mapping, sizeof(header));
+
+		if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+			fail(fileName + " is not a checkpoint");
+		}
+		if (header.version != CHECKPOINT_VERSION || header.headerBytes != sizeof(header)) {
+			fail(fileName + " has an unsupported version");
+		}
+		if (header.fileBytes != mappedBytes ||
+				sizeof(header) + (uint64_t)header.sectionCount * sizeof(CheckpointSection) > mappedBytes) {
+			fail(fileName + " is truncated");
+		}
+		sections = reinterpret_cast<const CheckpointSection*>(mapping + sizeof(header));
+		for (uint32_t s = 0; s < header.sectionCount; ++s) {
+			if (sections[s].offset % CHECKPOINT_ALIGN != 0 || sections[s].offset + sections[s].bytes > mappedBytes) {
+				fail(fileName + " has a corrupt section table");
+			}
+		}
+		madvise(const_cast<char*>(mapping), mappedBytes, MADV_SEQUENTIAL);
+	}
+
+	CheckpointReader(const CheckpointReader&) = delete;
+	CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+	~CheckpointReader() {
+		if (mapping != nullptr) {
+			munmap(const_cast<char*>(mapping), mappedBytes);
+		}
+	}
+
+	uint64_t frame() const { return header.frame; }
+	double time() const { return header.time; }
+
+	bool has(const char* name) const {
+		return find(name) != nullptr;
+	}
+
+	/*
+		name: const char*; section to restore
+		values: T*; first value of row 0 of the destination
+		rows: int; number of rows the destination has
+		cols: int; number of values per row
+		rowStride: int; distance in values between the starts of rows, cols if 0
+
+		Altered by reference: values
+		Return type: void
+	*/
+	template<typename T>
+	void restore(const char* name, T* values, int rows, int cols, int rowStride = 0) const {
+		/*
+		Copies a section out of the mapping into the destination, which must
+		have the section's type and shape.
+		*/
+		const CheckpointSection* section = find(name);
+		if (section == nullptr) {
+			throw runtime_error(string("checkpoint: no section ") + name);
+		}
+		if (section->scalarType != checkpointType(values) || section->rows != (uint32_t)rows ||
+				section->cols != (uint32_t)cols || section->bytes != (uint64_t)rows * cols * sizeof(T)) {
+			throw runtime_error(string("checkpoint: section ") + name + " doesn't match the " + to_string(rows) +
+					" x " + to_string(cols) + " grid it is restored into");
+		}
+		if (rowStride == 0) {
+			rowStride = cols;
+		}
+		const T* in = reinterpret_cast<const T*>(mapping + section->offset);
+		if (rowStride == cols) {
+			memcpy(values, in, section->bytes);
+			return;
+		}
+		for (int i = 0; i < rows; ++i) {
+			memcpy(values + (size_t)i * rowStride, in + (size_t)i * cols, cols * sizeof(T));
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include "FluidEnsemble.cpp"
+#include <chrono>
+#include <string>
+#include <stdlib.h>
+#include <iostream>
+
+/*
+	Runs a parameter sweep as one FluidEnsemble instead of one process per
+	simulation. Member m of N gets the fluid density and inflow speed at
+	m / (N - 1) of the way through the given ranges, all members share one
+	thread pool, and their frames go to one frame file: frame k holds member
+	k % N of output frame k / N, with density and center velocity per cell.
+
+	Usage: ensemble MEMBERS FRAMES SIZE [--density LO:HI] [--inflow LO:HI]
+	                [--threads N] [--cfl C] [--float] [--output FILE]
+	Build like solver.cpp, e.g. g++ -O2 -std=c++17 -pthread ensemble.cpp
+*/
+
+struct SweepOptions {
+	int members;
+	int frames;
+	int size;
+	double densityLow, densityHigh;
+	double inflowLow, inflowHigh;
+	int threads;
+	double cfl;
+	string fileName;
+};
+
+/*
+	text: string; "LO:HI", or a single value for both
+	low: double by reference; receives LO
+	high: double by reference; receives HI
+
+	Return type: void
+*/
+void parseRange(const string &text, double &low, double &high) {
+	size_t colon = text.find(':');
+	low = atof(text.substr(0, colon).c_str());
+	high = colon == string::npos ? low : atof(text.substr(colon + 1).c_str());
+}
+
+/*
+	options: SweepOptions; the sweep to run
+
+	Return type: void
+*/
+template<typename T>
+void runSweep(const SweepOptions &options) {
+	/*
+	Runs the sweep in precision T and reports the throughput in member steps.
+	*/
+	const double TIME_PER_FRAME = 1 / 15.0;
+	int n = options.size;
+	FluidEnsemble<T> ensemble(n, n, options.members);
+	ensemble.setThreadCount(options.threads);
+
+	vector<double> inflow(options.members);
+	for (int m = 0; m < options.members; ++m) {
+		double f = options.members > 1 ? double(m) / (options.members - 1) : 0.0;
+		ensemble.setDensity(m, options.densityLow + f * (options.densityHigh - options.densityLow));
+		inflow[m] = options.inflowLow + f * (options.inflowHigh - options.inflowLow);
+	}
+
+	FrameWriter frames(options.fileName, n, n, FrameEncoding(), FluidEnsemble<T>::FRAME_COMPONENTS);
+	AsyncFrameWriter output(frames, 2 * options.members, BACKPRESSURE_BLOCK);
+
+	// At least two cells wide and high, so the inflow covers cells of
+	// every field at small sizes too
+	double inflowWidth = max(0.1, 2.0 / n);
+	double inflowHeight = max(0.05, 2.0 / n);
+
+	auto start = chrono::steady_clock::now();
+	long substeps = 0;
+	for (int frame = 0; frame < options.frames; ++frame) {
+		for (int m = 0; m < options.members; ++m) {
+			ensemble.addInflow(m, 0.5 - inflowWidth / 2, 0.2, inflowWidth, inflowHeight, 1.0, 0.0, inflow[m]);
+		}
+		substeps += ensemble.advance(TIME_PER_FRAME, options.cfl);
+		ensemble.submitFrames(output);
+	}
+	output.close();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "Ran " << options.members << " members of " << n << "x" << n << " for " << options.frames
+		 << " frames in " << substeps << " substeps, " << seconds << " s" << endl;
+	cout << "Throughput " << options.members * substeps / seconds << " member steps/s on "
+		 << ensemble.threadCount() << " threads, " << ensemble.memoryFootprint() / 1048576.0 << " MiB of fields" << endl;
+	FrameQueueStats stats = output.stats();
+	cout << "Wrote " << stats.framesWritten << " frames to " << options.fileName << ", stalled "
+		 << stats.stallSeconds << " s waiting on output" << endl;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 4) {
+		cerr << "Usage: ensemble MEMBERS FRAMES SIZE [--density LO:HI] [--inflow LO:HI]" << endl
+			 << "                [--threads N] [--cfl C] [--float] [--output FILE]" << endl;
+		return 1;
+	}
+
+	SweepOptions options;
+	options.members = atoi(argv[1]);
+	options.frames = atoi(argv[2]);
+	options.size = atoi(argv[3]);
+	options.densityLow = options.densityHigh = 0.1;
+	options.inflowLow = options.inflowHigh = 3.0;
+	options.threads = 0;
+	options.cfl = 1;
+	options.fileName = "ensembleFrames.bin";
+	bool singlePrecision = false;
+	for (int arg = 4; arg < argc; ++arg) {
+		string option = argv[arg];
+		if (option == "--density" && arg + 1 < argc) {
+			parseRange(argv[++arg], options.densityLow, options.densityHigh);
+		} else if (option == "--inflow" && arg + 1 < argc) {
+			parseRange(argv[++arg], options.inflowLow, options.inflowHigh);
+		} else if (option == "--threads" && arg + 1 < argc) {
+			options.threads = atoi(argv[++arg]);
+		} else if (option == "--cfl" && arg + 1 < argc) {
+			options.cfl = atof(argv[++arg]);
+		} else if (option == "--output" && arg + 1 < argc) {
+			options.fileName = argv[++arg];
+		} else if (option == "--float") {
+			singlePrecision = true;
+		} else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	if (options.members < 1 || options.frames < 0 || options.size < 2) {
+		cerr << "Need at least one member and a grid of at least 2x2" << endl;
+		return 1;
+	}
+
+	if (singlePrecision) {
+		runSweep<float>(options);
+	} else {
+		runSweep<double>(options);
+	}
+	return 0;
+}
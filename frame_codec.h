@@ -0,0 +1,612 @@
+#ifndef __FRAMECODEC__
+#define __FRAMECODEC__
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+/*
+	Lossy encodings for frame files (see frame_file.h), for consumers such as
+	the viewer that don't need full float precision.
+
+	Every value is first turned into an integer code: the bits of a float16,
+	or a value scaled between the per-frame minimum and maximum of its
+	component to 8 or 16 bits. Codes are then predicted, either from the
+	previous value of the same component in the frame (key frames) or from
+	the previous decoded frame (delta frames), and only the difference is
+	kept. Differences are zigzag-mapped so that small ones of either sign
+	become small numbers, split into byte planes, and each plane is
+	optionally compressed with an order-0 rANS coder.
+
+	The decoder repeats the encoder's quantization of the previous decoded
+	frame bit for bit, so the only loss is the quantization itself. Its
+	bound is measured while encoding and stored with every frame.
+*/
+
+// Values of FrameFileHeader::scalarType
+const uint32_t FRAME_SCALAR_FLOAT32 = 1;
+const uint32_t FRAME_SCALAR_FLOAT16 = 2;
+const uint32_t FRAME_SCALAR_UNORM16 = 3;
+const uint32_t FRAME_SCALAR_UNORM8  = 4;
+
+// Most values a cell may hold in an encoded frame
+const int FRAME_MAX_COMPONENTS = 4;
+
+// Bits of EncodedFrameHeader::flags
+const uint32_t FRAME_FLAG_KEY = 1;
+
+/*
+	Stored in front of every encoded frame
+*/
+struct EncodedFrameHeader {
+	uint32_t flags;
+	uint32_t planes;
+	// Quantization range of each component, for the UNORM types
+	float low[FRAME_MAX_COMPONENTS];
+	float high[FRAME_MAX_COMPONENTS];
+	// Largest difference between a decoded and an original value, per component
+	float maxError[FRAME_MAX_COMPONENTS];
+};
+
+// Ways a byte plane can be stored
+const uint8_t PLANE_STORED = 0;
+const uint8_t PLANE_RANS   = 1;
+
+/*
+	value: float; value to convert
+
+	Return type: uint16_t
+*/
+inline uint16_t floatToHalf(float value) {
+	/*
+	Converts to IEEE half precision, rounding to nearest even. Overflows
+	become infinity, NaN stays NaN.
+	*/
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+	uint32_t exponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent == 0xff) {
+		return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+	}
+	int e = (int)exponent - 127 + 15;
+	if (e >= 31) {
+		return sign | 0x7c00;
+	}
+	if (e <= 0) {
+		if (e < -10) {
+			return sign;
+		}
+		// Subnormal half: shift in the implicit bit, then round
+		mantissa |= 0x800000;
+		int shift = 14 - e;
+		uint32_t half = mantissa >> shift;
+		uint32_t rest = mantissa & ((1u << shift) - 1);
+		uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1))) {
+			half++;
+		}
+		return sign | half;
+	}
+	uint32_t half = ((uint32_t)e << 10) | (mantissa >> 13);
+	uint32_t rest = mantissa & 0x1fff;
+	// A carry out of the mantissa correctly bumps the exponent
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+		half++;
+	}
+	return sign | half;
+}
+
+/*
+	half: uint16_t; IEEE half precision bits
+
+	Return type: float
+*/
+inline float halfToFloat(uint16_t half) {
+	uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+	uint32_t bits;
+
+	if (exponent == 0x1f) {
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	} else if (exponent != 0) {
+		bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+	} else if (mantissa == 0) {
+		bits = sign;
+	} else {
+		// Subnormal half, normalize
+		int e = -1;
+		do {
+			mantissa <<= 1;
+			e++;
+		} while ((mantissa & 0x400) == 0);
+		bits = sign | ((uint32_t)(127 - 15 - e) << 23) | ((mantissa & 0x3ff) << 13);
+	}
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/*
+	Order-0 range asymmetric numeral system coder over bytes, after the
+	public domain rANS of Fabian Giesen. Symbol frequencies are normalized
+	to 1 << SCALE_BITS and stored with the data.
+*/
+class RansCoder {
+	static const int SCALE_BITS = 12;
+	static const uint32_t TOTAL = 1u << SCALE_BITS;
+	// Lower bound of the normalized state
+	static const uint32_t LOWER = 1u << 23;
+
+	/*
+		data: const uint8_t*; bytes to model
+		count: size_t; number of bytes
+		freq: uint16_t*; receives 256 frequencies summing to TOTAL
+
+		Return type: void
+	*/
+	static void normalize(const uint8_t* data, size_t count, uint16_t* freq) {
+		uint64_t counts[256] = {0};
+		for (size_t i = 0; i < count; ++i) {
+			counts[data[i]]++;
+		}
+
+		uint32_t sum = 0;
+		int largest = 0;
+		for (int s = 0; s < 256; ++s) {
+			freq[s] = 0;
+			if (counts[s] > 0) {
+				// Every symbol that occurs needs a nonzero frequency
+				freq[s] = (uint16_t)max<uint64_t>(1, counts[s] * TOTAL / count);
+				sum += freq[s];
+				if (counts[s] > counts[largest]) {
+					largest = s;
+				}
+			}
+		}
+		// Rounding leaves the sum off by a little; the most common symbol absorbs it
+		while (sum != TOTAL) {
+			if (sum < TOTAL) {
+				freq[largest] += TOTAL - sum;
+				sum = TOTAL;
+			} else {
+				int s = 0;
+				for (int t = 0; t < 256; ++t) {
+					if (freq[t] > freq[s]) {
+						s = t;
+					}
+				}
+				uint32_t take = min<uint32_t>(sum - TOTAL, freq[s] - 1);
+				freq[s] -= take;
+				sum -= take;
+			}
+		}
+	}
+
+public:
+	/*
+		data: const uint8_t*; bytes to compress
+		count: size_t; number of bytes, at least 1
+		out: vector<uint8_t> by reference; the frequency table and coded bytes are appended
+
+		Return type: void
+	*/
+	static void encode(const uint8_t* data, size_t count, vector<uint8_t> &out) {
+		uint16_t freq[256];
+		uint32_t start[256];
+		normalize(data, count, freq);
+		for (int s = 0, c = 0; s < 256; c += freq[s], ++s) {
+			start[s] = c;
+		}
+
+		// rANS emits in reverse, so code into a scratch buffer from the back
+		static thread_local vector<uint8_t> scratch;
+		scratch.resize(count + count / 2 + 16);
+		uint8_t* end = scratch.data() + scratch.size();
+		uint8_t* next = end;
+
+		uint32_t state = LOWER;
+		for (size_t i = count; i-- > 0;) {
+			uint32_t f = freq[data[i]];
+			uint32_t limit = ((LOWER >> SCALE_BITS) << 8) * f;
+			while (state >= limit) {
+				if (next == scratch.data()) {
+					throw runtime_error("rANS: output larger than expected");
+				}
+				*--next = (uint8_t)state;
+				state >>= 8;
+			}
+			state = ((state / f) << SCALE_BITS) + (state % f) + start[data[i]];
+		}
+		// Flush the state so that the decoder reads its top byte first
+		for (int b = 0; b < 4; ++b) {
+			*--next = (uint8_t)(state >> (8*b));
+		}
+
+		size_t table = out.size();
+		out.resize(table + sizeof(freq));
+		memcpy(out.data() + table, freq, sizeof(freq));
+		out.insert(out.end(), next, end);
+	}
+
+	/*
+		in: const uint8_t*; frequency table followed by coded bytes
+		inBytes: size_t; number of bytes available at in
+		out: uint8_t*; receives the decoded bytes
+		count: size_t; number of bytes to decode
+
+		Return type: void
+	*/
+	static void decode(const uint8_t* in, size_t inBytes, uint8_t* out, size_t count) {
+		uint16_t freq[256];
+		if (inBytes < sizeof(freq) + 4) {
+			throw runtime_error("rANS: truncated input");
+		}
+		memcpy(freq, in, sizeof(freq));
+		const uint8_t* next = in + sizeof(freq);
+		const uint8_t* end = in + inBytes;
+
+		uint32_t start[256];
+		uint8_t symbol[TOTAL];
+		uint32_t c = 0;
+		for (int s = 0; s < 256; ++s) {
+			start[s] = c;
+			if (c + freq[s] > TOTAL) {
+				throw runtime_error("rANS: corrupt frequency table");
+			}
+			memset(symbol + c, s, freq[s]);
+			c += freq[s];
+		}
+		if (c != TOTAL) {
+			throw runtime_error("rANS: corrupt frequency table");
+		}
+
+		uint32_t state = 0;
+		for (int b = 0; b < 4; ++b) {
+			state = (state << 8) | *next++;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t slot = state & (TOTAL - 1);
+			uint8_t s = symbol[slot];
+			out[i] = s;
+			state = freq[s] * (state >> SCALE_BITS) + slot - start[s];
+			while (state < LOWER) {
+				if (next == end) {
+					throw runtime_error("rANS: truncated input");
+				}
+				state = (state << 8) | *next++;
+			}
+		}
+	}
+};
+
+/*
+	Quantization of one frame: how values of each component map to codes and
+	back. Encoder and decoder both go through these functions so that they
+	agree bit for bit.
+*/
+struct FrameQuantizer {
+	uint32_t scalarType;
+	int components;
+	float low[FRAME_MAX_COMPONENTS];
+	float high[FRAME_MAX_COMPONENTS];
+
+	// Largest code of the UNORM types
+	uint32_t maxCode() const {
+		return scalarType == FRAME_SCALAR_UNORM8 ? 0xff : 0xffff;
+	}
+
+	// Bytes per code
+	int codeBytes() const {
+		return scalarType == FRAME_SCALAR_UNORM8 ? 1 : 2;
+	}
+
+	/*
+		value: float; value to quantize
+		c: int; component it belongs to
+
+		Return type: uint32_t
+	*/
+	uint32_t quantize(float value, int c) const {
+		if (scalarType == FRAME_SCALAR_FLOAT16) {
+			return floatToHalf(value);
+		}
+		float range = high[c] - low[c];
+		if (!(range > 0.0f)) {
+			return 0;
+		}
+		float scaled = (value - low[c]) / range * (float)maxCode();
+		if (!(scaled > 0.0f)) {
+			return 0;
+		}
+		return min((uint32_t)lrintf(min(scaled, (float)maxCode())), maxCode());
+	}
+
+	/*
+		code: uint32_t; code to expand
+		c: int; component it belongs to
+
+		Return type: float
+	*/
+	float dequantize(uint32_t code, int c) const {
+		if (scalarType == FRAME_SCALAR_FLOAT16) {
+			return halfToFloat((uint16_t)code);
+		}
+		return low[c] + (high[c] - low[c]) * ((float)code / (float)maxCode());
+	}
+};
+
+/*
+	code: uint32_t; difference of two codes, modulo the code width
+	bits: int; code width, 8 or 16
+
+	Return type: uint32_t
+*/
+inline uint32_t zigzag(uint32_t code, int bits) {
+	/*
+	Maps differences 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+	*/
+	uint32_t mask = (1u << bits) - 1;
+	uint32_t sign = (code >> (bits - 1)) & 1;
+	return ((code << 1) ^ (sign ? mask : 0)) & mask;
+}
+
+inline uint32_t unzigzag(uint32_t code, int bits) {
+	uint32_t mask = (1u << bits) - 1;
+	return ((code >> 1) ^ ((code & 1) ? mask : 0)) & mask;
+}
+
+/*
+	Encodes a sequence of frames. Keeps the previous decoded frame to predict
+	delta frames from.
+*/
+class FrameEncoder {
+	uint32_t scalarType;
+	int components;
+	size_t values;
+	int keyframeInterval;
+	bool entropy;
+	long framesEncoded;
+
+	vector<float> previous;
+	vector<uint32_t> codes;
+	vector<uint8_t> planes;
+
+public:
+	/*
+		scalarType: uint32_t; FRAME_SCALAR_FLOAT16, _UNORM16 or _UNORM8
+		components: int; values per cell, 1 ... FRAME_MAX_COMPONENTS
+		cells: size_t; cells per frame
+		keyframeInterval: int; every this many frames is a key frame, 1 for no delta frames
+		entropy: bool; whether to rANS code the byte planes
+	*/
+	FrameEncoder(uint32_t scalarType, int components, size_t cells, int keyframeInterval, bool entropy)
+			: scalarType(scalarType), components(components), values(cells * components),
+			  keyframeInterval(max(keyframeInterval, 1)), entropy(entropy), framesEncoded(0),
+			  previous(values), codes(values) {
+		if (components < 1 || components > FRAME_MAX_COMPONENTS) {
+			throw invalid_argument("frame encoder: unsupported number of components");
+		}
+	}
+
+	/*
+		data: const float*; values of the frame, components interleaved per cell
+		out: vector<uint8_t> by reference; replaced by the encoded frame
+		maxError: float*; receives the error bound of each component
+
+		Return type: void
+	*/
+	void encode(const float* data, vector<uint8_t> &out, float* maxError) {
+		EncodedFrameHeader header;
+		memset(&header, 0, sizeof(header));
+		bool key = framesEncoded % keyframeInterval == 0;
+		header.flags = key ? FRAME_FLAG_KEY : 0;
+
+		FrameQuantizer q;
+		q.scalarType = scalarType;
+		q.components = components;
+		for (int c = 0; c < components; ++c) {
+			q.low[c] = INFINITY;
+			q.high[c] = -INFINITY;
+		}
+		if (scalarType != FRAME_SCALAR_FLOAT16) {
+			for (size_t i = 0; i < values; ++i) {
+				int c = i % components;
+				if (isfinite(data[i])) {
+					q.low[c] = min(q.low[c], data[i]);
+					q.high[c] = max(q.high[c], data[i]);
+				}
+			}
+		}
+		for (int c = 0; c < components; ++c) {
+			if (q.low[c] > q.high[c]) {
+				q.low[c] = q.high[c] = 0.0f;
+			}
+			header.low[c] = q.low[c];
+			header.high[c] = q.high[c];
+			header.maxError[c] = 0.0f;
+		}
+
+		int bytes = q.codeBytes();
+		int bits = 8 * bytes;
+		uint32_t mask = (1u << bits) - 1;
+		planes.resize(values * bytes);
+
+		for (size_t i = 0; i < values; ++i) {
+			int c = i % components;
+			uint32_t code = q.quantize(data[i], c);
+			uint32_t predicted;
+			if (key) {
+				predicted = i >= (size_t)components ? codes[i - components] : 0;
+			} else {
+				predicted = q.quantize(previous[i], c);
+			}
+			codes[i] = code;
+
+			uint32_t residual = zigzag((code - predicted) & mask, bits);
+			for (int b = 0; b < bytes; ++b) {
+				planes[b * values + i] = (uint8_t)(residual >> (8 * b));
+			}
+
+			float decoded = q.dequantize(code, c);
+			float error = fabsf(decoded - data[i]);
+			if (error > header.maxError[c]) {
+				header.maxError[c] = error;
+			}
+			previous[i] = decoded;
+		}
+		header.planes = bytes;
+
+		out.resize(sizeof(header));
+		for (int b = 0; b < bytes; ++b) {
+			const uint8_t* plane = planes.data() + b * values;
+			size_t start = out.size();
+			out.resize(start + 5);
+			uint8_t method = PLANE_STORED;
+			if (entropy && values > 0) {
+				RansCoder::encode(plane, values, out);
+				method = PLANE_RANS;
+				if (out.size() - start - 5 >= values) {
+					// Incompressible, store it instead
+					out.resize(start + 5);
+					method = PLANE_STORED;
+				}
+			}
+			if (method == PLANE_STORED) {
+				out.insert(out.end(), plane, plane + values);
+			}
+			uint32_t planeBytes = out.size() - start - 5;
+			out[start] = method;
+			memcpy(out.data() + start + 1, &planeBytes, sizeof(planeBytes));
+		}
+
+		memcpy(out.data(), &header, sizeof(header));
+		for (int c = 0; c < components; ++c) {
+			maxError[c] = header.maxError[c];
+		}
+		framesEncoded++;
+	}
+};
+
+/*
+	Decodes frames written by FrameEncoder. Delta frames need the frame before
+	them, so frames have to be decoded in order starting from a key frame.
+*/
+class FrameDecoder {
+	uint32_t scalarType;
+	int components;
+	size_t values;
+
+	vector<float> previous;
+	vector<uint32_t> codes;
+	vector<uint8_t> planes;
+
+public:
+	/*
+		Same arguments as FrameEncoder
+	*/
+	FrameDecoder(uint32_t scalarType, int components, size_t cells)
+			: scalarType(scalarType), components(components), values(cells * components),
+			  previous(values), codes(values) {
+		if (components < 1 || components > FRAME_MAX_COMPONENTS) {
+			throw invalid_argument("frame decoder: unsupported number of components");
+		}
+	}
+
+	/*
+		in: const uint8_t*; encoded frame
+		inBytes: size_t; its size
+
+		Return type: bool
+	*/
+	static bool isKeyFrame(const uint8_t* in, size_t inBytes) {
+		EncodedFrameHeader header;
+		if (inBytes < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, in, sizeof(header));
+		return (header.flags & FRAME_FLAG_KEY) != 0;
+	}
+
+	/*
+		in: const uint8_t*; encoded frame
+		inBytes: size_t; its size
+		out: float*; receives the decoded values
+
+		Return type: void
+	*/
+	void decode(const uint8_t* in, size_t inBytes, float* out) {
+		EncodedFrameHeader header;
+		if (inBytes < sizeof(header)) {
+			throw runtime_error("frame decoder: truncated frame");
+		}
+		memcpy(&header, in, sizeof(header));
+		bool key = (header.flags & FRAME_FLAG_KEY) != 0;
+
+		FrameQuantizer q;
+		q.scalarType = scalarType;
+		q.components = components;
+		for (int c = 0; c < components; ++c) {
+			q.low[c] = header.low[c];
+			q.high[c] = header.high[c];
+		}
+		int bytes = q.codeBytes();
+		int bits = 8 * bytes;
+		uint32_t mask = (1u << bits) - 1;
+		if (header.planes != (uint32_t)bytes) {
+			throw runtime_error("frame decoder: unexpected number of planes");
+		}
+
+		planes.resize(values * bytes);
+		const uint8_t* next = in + sizeof(header);
+		const uint8_t* end = in + inBytes;
+		for (int b = 0; b < bytes; ++b) {
+			uint32_t planeBytes;
+			if (end - next < 5) {
+				throw runtime_error("frame decoder: truncated frame");
+			}
+			uint8_t method = next[0];
+			memcpy(&planeBytes, next + 1, sizeof(planeBytes));
+			next += 5;
+			if ((size_t)(end - next) < planeBytes) {
+				throw runtime_error("frame decoder: truncated frame");
+			}
+			uint8_t* plane = planes.data() + b * values;
+			if (method == PLANE_RANS) {
+				RansCoder::decode(next, planeBytes, plane, values);
+			} else if (method == PLANE_STORED && planeBytes == values) {
+				memcpy(plane, next, values);
+			} else {
+				throw runtime_error("frame decoder: corrupt plane");
+			}
+			next += planeBytes;
+		}
+
+		for (size_t i = 0; i < values; ++i) {
+			int c = i % components;
+			uint32_t residual = 0;
+			for (int b = 0; b < bytes; ++b) {
+				residual |= (uint32_t)planes[b * values + i] << (8 * b);
+			}
+			uint32_t predicted;
+			if (key) {
+				predicted = i >= (size_t)components ? codes[i - components] : 0;
+			} else {
+				predicted = q.quantize(previous[i], c);
+			}
+			uint32_t code = (predicted + unzigzag(residual, bits)) & mask;
+			codes[i] = code;
+			previous[i] = q.dequantize(code, c);
+			out[i] = previous[i];
+		}
+	}
+};
+
+#endif
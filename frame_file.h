@@ -0,0 +1,461 @@
+#ifndef __FRAMEFILE__
+#define __FRAMEFILE__
+
+#include "mac_grid.h"
+#include "grid_fns.h"
+#include "frame_codec.h"
+#include "Telemetry.h"
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+/*
+	Binary container for velocity frames, replacing the text written by
+	saveVelocityField for anything but small exports.
+
+	All values are little-endian. The file starts with a FrameFileHeader,
+	followed by the frames back to back and then, padded to a multiple of
+	8 bytes, the frame index, one FrameIndexEntry per frame. A frame holds
+	the center velocity of every cell as (x, y) pairs, in the same row-major
+	order as MACGrid: row i holds the cells j = 0 ... cols-1.
+
+	With scalarType FRAME_SCALAR_FLOAT32 the pairs are stored as raw floats.
+	Any other type means frames were written by a FrameEncoder (see
+	frame_codec.h) and vary in size; frameBytes is then the size of a
+	decoded frame.
+
+	frameCount, indexOffset and maxError are filled in when the writer is
+	closed. A raw file whose writer never closed has indexOffset 0; its
+	frames can still be found from frameBytes, since every frame has the
+	same size.
+*/
+
+const char FRAME_FILE_MAGIC[8] = {'F', 'L', 'U', 'I', 'D', 'F', 'R', 'M'};
+// Version 1 files are raw float32 and have no encoding fields
+const uint32_t FRAME_FILE_VERSION = 2;
+
+struct FrameFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerBytes;
+	uint32_t rows;
+	uint32_t cols;
+	// Values stored per cell, 2 for a velocity
+	uint32_t components;
+	uint32_t scalarType;
+	uint64_t frameCount;
+	uint64_t frameBytes;
+	uint64_t indexOffset;
+	// Every this many frames is a key frame that decodes on its own
+	uint32_t keyframeInterval;
+	// Largest error of any decoded value in the file, 0 for raw files
+	float maxError;
+};
+static_assert(sizeof(FrameFileHeader) == 64, "frame file header must stay 64 bytes");
+
+struct FrameIndexEntry {
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "frame files are written in host byte order, which must be little-endian"
+#endif
+
+/*
+	horizVelocityGrid: MACGrid; holds horizontal velocity components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
+	rows: int; number of rows (x direction)
+	cols: int; number of columns (y direction)
+	out: float*; receives rows*cols*2 floats in the frame layout
+
+	Return type: void
+*/
+void packVelocityFrame(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid, int rows, int cols, float* out) {
+	/*
+	Samples the center velocities of the given fields into a frame.
+	*/
+	float* centerX = rowScratch(cols);
+	float* centerY = centerX + cols;
+	for (int i = 0; i < rows; ++i) {
+		centerVelRow(horizVelocityGrid, vertVelocityGrid, i, cols, centerX, centerY);
+		float* row = out + (size_t)i * cols * 2;
+		for (int j = 0; j < cols; ++j) {
+			row[2*j] = centerX[j];
+			row[2*j + 1] = centerY[j];
+		}
+	}
+}
+
+/*
+	How FrameWriter stores frames. The default keeps them as raw floats.
+*/
+struct FrameEncoding {
+	// One of the FRAME_SCALAR_ types
+	uint32_t scalarType;
+	// Every this many frames is a key frame, the rest are deltas; 1 for none
+	int keyframeInterval;
+	// Whether to compress encoded frames with rANS
+	bool entropy;
+
+	FrameEncoding(uint32_t scalarType = FRAME_SCALAR_FLOAT32, int keyframeInterval = 1, bool entropy = false)
+			: scalarType(scalarType), keyframeInterval(keyframeInterval), entropy(entropy) {}
+};
+
+/*
+	Writes a frame file. Each frame goes to disk with a single write() from a
+	buffer the writer owns, so writing raw frames never allocates.
+*/
+class FrameWriter {
+	int fd;
+	FrameFileHeader header;
+	vector<FrameIndexEntry> index;
+	vector<float> buffer;
+	uint64_t offset;
+
+	// Set for any encoding other than raw floats
+	FrameEncoder* encoder;
+	vector<uint8_t> encoded;
+	float frameError[FRAME_MAX_COMPONENTS];
+
+	/*
+		data: const void*; bytes to write
+		bytes: size_t; number of bytes
+		at: uint64_t; file offset to write at
+
+		Return type: void
+	*/
+	void writeAt(const void* data, size_t bytes, uint64_t at) {
+		/*
+		Writes all of data at the given offset, retrying short writes.
+		*/
+		const char* next = static_cast<const char*>(data);
+		while (bytes > 0) {
+			ssize_t written = pwrite(fd, next, bytes, at);
+			if (written < 0) {
+				throw runtime_error("frame file: write failed");
+			}
+			next += written;
+			bytes -= written;
+			at += written;
+		}
+	}
+
+public:
+	/*
+		fileName: string; file to create, replacing any existing one
+		rows: int; number of rows (x direction)
+		cols: int; number of columns (y direction)
+		encoding: FrameEncoding; how to store the frames
+		components: int; values per cell, 2 for a velocity
+	*/
+	FrameWriter(string fileName, int rows, int cols, const FrameEncoding &encoding = FrameEncoding(), int components = 2)
+			: buffer((size_t)rows * cols * components), encoder(nullptr) {
+		if (encoding.scalarType != FRAME_SCALAR_FLOAT32) {
+			encoder = new FrameEncoder(encoding.scalarType, components, (size_t)rows * cols,
+					encoding.keyframeInterval, encoding.entropy);
+		}
+		fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			delete encoder;
+			throw runtime_error("frame file: cannot create " + fileName);
+		}
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, FRAME_FILE_MAGIC, sizeof(header.magic));
+		header.version = FRAME_FILE_VERSION;
+		header.headerBytes = sizeof(header);
+		header.rows = rows;
+		header.cols = cols;
+		header.components = components;
+		header.scalarType = encoding.scalarType;
+		header.frameBytes = buffer.size() * sizeof(float);
+		header.keyframeInterval = encoder != nullptr ? max(encoding.keyframeInterval, 1) : 1;
+		writeAt(&header, sizeof(header), 0);
+		offset = sizeof(header);
+	}
+
+	FrameWriter(const FrameWriter&) = delete;
+	FrameWriter& operator=(const FrameWriter&) = delete;
+
+	~FrameWriter() {
+		if (fd >= 0) {
+			try {
+				close();
+			} catch (const runtime_error&) {
+				// Nothing sensible to do about it during destruction
+			}
+		}
+		delete encoder;
+	}
+
+	int rows() const { return header.rows; }
+	int cols() const { return header.cols; }
+	// Number of floats in a frame
+	size_t frameSize() const { return buffer.size(); }
+
+	/*
+		data: const float*; frameSize() floats in the frame layout
+
+		Return type: void
+	*/
+	void writeFrame(const float* data) {
+		/*
+		Appends one frame to the file, encoding it first unless frames are
+		stored raw.
+		*/
+		TELEMETRY_SCOPE(STAGE_OUTPUT);
+		const void* bytes = data;
+		uint64_t size = header.frameBytes;
+		if (encoder != nullptr) {
+			encoder->encode(data, encoded, frameError);
+			for (uint32_t c = 0; c < header.components; ++c) {
+				header.maxError = max(header.maxError, frameError[c]);
+			}
+			bytes = encoded.data();
+			size = encoded.size();
+		}
+		writeAt(bytes, size, offset);
+		index.push_back(FrameIndexEntry {offset, size});
+		offset += size;
+		TELEMETRY_COUNT(COUNTER_BYTES_WRITTEN, size);
+	}
+
+	/*
+		horizVelocityGrid: MACGrid; holds horizontal velocity components at 1/2 indices
+		vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
+
+		Return type: void
+	*/
+	void writeVelocityField(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid) {
+		/*
+		Appends the center velocities of the given fields as one frame.
+		*/
+		packVelocityFrame(horizVelocityGrid, vertVelocityGrid, header.rows, header.cols, buffer.data());
+		writeFrame(buffer.data());
+	}
+
+	/*
+		Return type: void
+	*/
+	void close() {
+		/*
+		Appends the frame index, fills in the header and closes the file.
+		*/
+		if (fd < 0) {
+			return;
+		}
+		// Encoded frames vary in size, so align the index behind them
+		uint64_t align = alignof(FrameIndexEntry);
+		header.frameCount = index.size();
+		header.indexOffset = (offset + align - 1) / align * align;
+		writeAt(index.data(), index.size() * sizeof(FrameIndexEntry), header.indexOffset);
+		writeAt(&header, sizeof(header), 0);
+		int result = ::close(fd);
+		fd = -1;
+		if (result != 0) {
+			throw runtime_error("frame file: close failed");
+		}
+	}
+};
+
+/*
+	Read-only view of a frame file through mmap. For raw files frame() hands
+	out pointers into the mapping, so reading a frame copies nothing and only
+	touches the pages of that frame. Encoded frames are decoded into a buffer
+	the reader owns; reading them in order decodes each one once, while
+	jumping to a frame decodes forward from the key frame before it.
+*/
+class FrameReader {
+	const char* mapping;
+	size_t mappedBytes;
+	FrameFileHeader header;
+	// Copied out of the mapping, where files of older writers may not align it
+	vector<FrameIndexEntry> index;
+	uint64_t frames;
+
+	// Set for encoded files, with the frame currently held in `decoded'
+	FrameDecoder* decoder;
+	vector<float> decoded;
+	int decodedFrame;
+
+	void fail(const string &message) {
+		if (mapping != nullptr) {
+			munmap(const_cast<char*>(mapping), mappedBytes);
+			mapping = nullptr;
+		}
+		delete decoder;
+		decoder = nullptr;
+		throw runtime_error("frame file: " + message);
+	}
+
+	const uint8_t* frameBytes(int n) const {
+		return reinterpret_cast<const uint8_t*>(mapping + index[n].offset);
+	}
+
+public:
+	/*
+		fileName: string; frame file to open
+	*/
+	FrameReader(string fileName) : mapping(nullptr), mappedBytes(0), frames(0),
+			decoder(nullptr), decodedFrame(-1) {
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("frame file: cannot open " + fileName);
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(FrameFileHeader)) {
+			::close(fd);
+			throw runtime_error("frame file: " + fileName + " is too short");
+		}
+		mappedBytes = info.st_size;
+		void* mapped = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (mapped == MAP_FAILED) {
+			throw runtime_error("frame file: cannot map " + fileName);
+		}
+		mapping = static_cast<const char*>(mapped);
+
+		memcpy(&header, mapping, sizeof(header));
+		if (memcmp(header.magic, FRAME_FILE_MAGIC, sizeof(header.magic)) != 0) {
+			fail(fileName + " is not a frame file");
+		}
+		if (header.version == 1) {
+			// Predates the encoding fields, which were zero then
+			header.keyframeInterval = 1;
+			header.maxError = 0.0f;
+		}
+		bool raw = header.scalarType == FRAME_SCALAR_FLOAT32;
+		if (header.version > FRAME_FILE_VERSION || (header.version == 1 && !raw)) {
+			fail(fileName + " has an unsupported version");
+		}
+		if (!raw && header.scalarType != FRAME_SCALAR_FLOAT16 && header.scalarType != FRAME_SCALAR_UNORM16 &&
+				header.scalarType != FRAME_SCALAR_UNORM8) {
+			fail(fileName + " has an unsupported layout");
+		}
+
+		uint64_t frameBytes = (uint64_t)header.rows * header.cols * header.components * sizeof(float);
+		if (header.frameBytes != frameBytes) {
+			fail(fileName + " has an inconsistent frame size");
+		}
+		if (header.indexOffset != 0) {
+			frames = header.frameCount;
+			if (header.indexOffset + frames * sizeof(FrameIndexEntry) > mappedBytes) {
+				fail(fileName + " has a truncated index");
+			}
+			index.resize(frames);
+			memcpy(index.data(), mapping + header.indexOffset, frames * sizeof(FrameIndexEntry));
+			for (uint64_t n = 0; n < frames; ++n) {
+				if ((raw && index[n].bytes != frameBytes) || index[n].offset + index[n].bytes > header.indexOffset) {
+					fail(fileName + " has a corrupt index");
+				}
+			}
+		} else if (raw && frameBytes > 0) {
+			// Writer didn't finish; recover every complete frame
+			frames = (mappedBytes - header.headerBytes) / frameBytes;
+		}
+
+		if (!raw) {
+			try {
+				decoder = new FrameDecoder(header.scalarType, header.components, (size_t)header.rows * header.cols);
+			} catch (const invalid_argument&) {
+				fail(fileName + " has an unsupported layout");
+			}
+			decoded.resize((size_t)header.rows * header.cols * header.components);
+		}
+	}
+
+	FrameReader(const FrameReader&) = delete;
+	FrameReader& operator=(const FrameReader&) = delete;
+
+	~FrameReader() {
+		if (mapping != nullptr) {
+			munmap(const_cast<char*>(mapping), mappedBytes);
+		}
+		delete decoder;
+	}
+
+	int frameCount() const { return (int)frames; }
+	int rows() const { return header.rows; }
+	int cols() const { return header.cols; }
+	int components() const { return header.components; }
+	uint32_t scalarType() const { return header.scalarType; }
+
+	// Largest error of any decoded value in the file
+	float maxError() const { return header.maxError; }
+
+	/*
+		n: int; frame number, 0 ... frameCount()-1
+		c: int; component
+
+		Return type: float
+	*/
+	float frameError(int n, int c) const {
+		/*
+		Returns the largest error of component c in frame n as recorded by
+		the encoder, 0 for raw frames.
+		*/
+		if (decoder == nullptr) {
+			return 0.0f;
+		}
+		EncodedFrameHeader encoded;
+		memcpy(&encoded, frameBytes(n), sizeof(encoded));
+		return encoded.maxError[c];
+	}
+
+	/*
+		n: int; frame number, 0 ... frameCount()-1
+
+		Return type: const float*
+	*/
+	const float* frame(int n) {
+		/*
+		Returns the (x, y) pairs of frame n. For raw files this points into
+		the mapping and stays valid for as long as the reader exists. For
+		encoded files it points to the decoded frame, which the next call
+		replaces.
+		*/
+		if (decoder == nullptr) {
+			uint64_t at = !index.empty() ? index[n].offset : header.headerBytes + (uint64_t)n * header.frameBytes;
+			return reinterpret_cast<const float*>(mapping + at);
+		}
+		if (n == decodedFrame) {
+			return decoded.data();
+		}
+
+		int first = n;
+		if (n != decodedFrame + 1) {
+			while (first > 0 && !FrameDecoder::isKeyFrame(frameBytes(first), index[first].bytes)) {
+				--first;
+			}
+		}
+		for (int k = first; k <= n; ++k) {
+			decoder->decode(frameBytes(k), index[k].bytes, decoded.data());
+		}
+		decodedFrame = n;
+		return decoded.data();
+	}
+
+	/*
+		n: int; frame number
+		i: int; row
+		j: int; column
+
+		Return type: Vec2
+	*/
+	Vec2 velocity(int n, int i, int j) {
+		/*
+		Returns the center velocity of cell (i,j) in frame n.
+		*/
+		const float* cell = frame(n) + ((size_t)i * header.cols + j) * 2;
+		return Vec2 {cell[0], cell[1]};
+	}
+};
+
+#endif
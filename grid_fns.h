@@ -1,216 +1,278 @@
 #ifndef __GRIDFUNCTIONS__
 #define __GRIDFUNCTIONS__
 
+#include "mac_grid.h"
+#include "Simd.h"
+#include <cmath>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <iostream>
 using namespace std;
 
-
 /*
-	inputFileName: string; name of input file to be read from
-	Data format: Each row holds space seperated values for that row in toFill.
-		row 0 data
-		row 1 data
-		...
-		row n data
-		---------------------------
-		Ex:
-		---------------------------
-		1.2 1 3.4 3 23 2 ... 3 1
-		3 9 9.3 8 23 0 ... 0 9
-		...
-		4 9.6 3 25 28 2.5 ... 3 6
-
-	Return type: vector<float>*
+	Two component vector returned by value from the velocity samplers,
+	so sampling a cell never allocates.
 */
-vector<float>* getInputData(string inputFileName) {
-	/*
-	Returns vector holding inputFileName's input data
-	*/
-	ifstream inputFile;
-	string strValue;
-	float fltValue;
-	vector<float>* values = new vector<float>;
-
-	inputFile.open(inputFileName, ios::in);
-	while(inputFile >> strValue) {
-		if (strValue != "\n") {
-			fltValue = stof(strValue);
-			values->push_back(fltValue);
-		}
-	}
-	return values;
-}
+struct Vec2 {
+	float x;
+	float y;
+};
+
 
 /*
-	toFill: 2D vector of floats; holds default values, needs to be initialized
-	inputFileName: string; file name of the input file
+	horizVelocityGrid: MACGrid; holds horizontal velocity components at 1/2 indices
+	i: integer; index for ith row
+	j: integer; index for jth column
 
-	Altered by reference: toFill
-	Return type: void
+	Return type: float
 */
-void fillGrid(vector< vector<float> > &toFill, string inputFileName) {
+float horCenterVel(const MACGrid &horizVelocityGrid, int i, int j) {
 	/*
-	Gets values from input file, fills toFill with them
+	Returns horizontal velocity at center of grid cell.
+	Averages horizontal velocities at left and right sides of the cell.
 	*/
-	int numRows = toFill.size();
-	int numCols = toFill.at(0).size();
-
-	const vector<float>* inputData = getInputData(inputFileName);
-
-	for(size_t i = 0; i < numRows; ++i) {
-		for (size_t j = 0; j < numCols; ++j) {
-			toFill.at(i).at(j) = inputData->at(i*numCols+j);
-		}
-	}
-
-	delete inputData;
+	float numeratorTerm1 = horizVelocityGrid.staggered(i-.5, j);
+	float numeratorTerm2 = horizVelocityGrid.staggered(i+.5, j);
+	return (numeratorTerm1 + numeratorTerm2) / 2;
 }
 
+
 /*
-	pressureGrid: 2D vector of floats; holds pressure values
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 	i: integer; index for ith row
 	j: integer; index for jth column
 
 	Return type: float
 */
-float correctPGet(const vector< vector<float> > &pressureGrid, int i, int j){
+float verCenterVel(const MACGrid &vertVelocityGrid, int i, int j) {
 	/*
-	Gets the (i,j)th value from the pressure grid.
-	Used for consistency with horizontal and vertical Velocity getters.
+	Returns vertical velocity at center of grid cell.
+	Averages vertical velocities at top and bottom sides of the cell.
 	*/
-	return pressureGrid.at(i).at(j);
+	float numeratorTerm1 = vertVelocityGrid.staggered(i, j-.5);
+	float numeratorTerm2 = vertVelocityGrid.staggered(i, j+.5);
+	return (numeratorTerm1 + numeratorTerm2) / 2;
 }
 
+
 /*
-	horizVelocityGrid: 2D vector of floats; holds horizontal velocity components at 1/2 indices
+	horizVelocityGrid: MACGrid; holds vertical horizontal components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 	i: integer; index for ith row
 	j: integer; index for jth column
 
-	Return type: float
+	Return type: Vec2
 */
-float correctHVGet(const vector< vector<float> > &horizVelocityGrid, int i, int j){
+Vec2 centerVel(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid, int i, int j) {
 	/*
-	Gets the correct half indice (i,j)th value from the horizVelocityGrid grid.
-	Expects i to be a half index Ex: 4-.5
-	Truncates index then adds 1; handles both i-.5 and i+.5
+	Returns x and y components of velocity at center of the cell
 	*/
-	return horizVelocityGrid.at(i+1).at(j);
+	return Vec2 {horCenterVel(horizVelocityGrid, i, j), verCenterVel(vertVelocityGrid, i, j)};
 }
 
 
 /*
-	verticalVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
+	horizVelocityGrid: MACGrid; holds vertical horizontal components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 	i: integer; index for ith row
 	j: integer; index for jth column
 
-	Return type: float
+	Return type: Vec2
 */
-float correctVVGet(const vector< vector<float> > &verticalVelocityGrid, int i, int j){
+Vec2 rightSideVel(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid, int i, int j) {
 	/*
-	Gets the correct half indice (i,j)th value from the verticalVelocityGrid grid.
-	Expects j to be a half index Ex: 4-.5
-	Truncates index then adds 1; handles both j-.5 and j+.5
+	Returns x and y components of velocity at right side of the cell.
+	Averages the vertical velocities at the top and bottoms of the cells to the left and right.
 	*/
-	return verticalVelocityGrid.at(i).at(j+1);
+	float horizComponent = horizVelocityGrid.staggered(i+.5, j);
+
+	float vertComponentNumerator1 = vertVelocityGrid.staggered(i, j-.5) + vertVelocityGrid.staggered(i, j+.5);
+	float vertComponentNumerator2 = vertVelocityGrid.staggered(i+1, j-.5) + vertVelocityGrid.staggered(i+1, j+.5);
+	float vertComponent = (vertComponentNumerator1 + vertComponentNumerator2) / 4;
+	return Vec2 {horizComponent, vertComponent};
 }
 
 /*
-	horizVelocityGrid: 2D vector of floats; holds horizontal velocity components at 1/2 indices
+	horizVelocityGrid: MACGrid; holds vertical horizontal components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 	i: integer; index for ith row
 	j: integer; index for jth column
 
-	Return type: float
+	Return type: Vec2
 */
-float horCenterVel(const vector< vector<float> > &horizVelocityGrid, int i, int j) {
+Vec2 topSideVel(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid, int i, int j) {
 	/*
-	Returns horizontal velocity at center of grid cell.
-	Averages horizontal velocities at left and right sides of the cell.
+	Returns x and y components of velocity at top side of the cell.
+	Averages the horizontal velocities at the left and right of the cells to the top and bottom.
 	*/
-	float numeratorTerm1 = correctHVGet(horizVelocityGrid, i-.5, j);
-	float numeratorTerm2 = correctHVGet(horizVelocityGrid, i+.5, j);
-	return (numeratorTerm1 + numeratorTerm2) / 2;
+	float horizComponentNumerator1 = horizVelocityGrid.staggered(i-.5, j) + horizVelocityGrid.staggered(i+.5, j);
+	float horizComponentNumerator2 = horizVelocityGrid.staggered(i-.5, j+1) + horizVelocityGrid.staggered(i+.5, j+1);
+	float horizComponent = (horizComponentNumerator1 + horizComponentNumerator2) / 4;
+
+	float vertComponent = vertVelocityGrid.staggered(i, j+.5);
+	return Vec2 {horizComponent, vertComponent};
 }
 
 
 /*
-	vertVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
-	i: integer; index for ith row
-	j: integer; index for jth column
+	values: const float*; first value of the row
+	count: int; number of values
 
 	Return type: float
 */
-float verCenterVel(const vector< vector<float> > &vertVelocityGrid, int i, int j) {
+float maxAbsRowScalar(const float* values, int count) {
 	/*
-	Returns vertical velocity at center of grid cell.
-	Averages vertical velocities at top and bottom sides of the cell.
+	Returns the largest magnitude among values[0] ... values[count-1], 0 if
+	count is 0. NaNs are skipped.
 	*/
-	float numeratorTerm1 = correctVVGet(vertVelocityGrid, i, j-.5);
-	float numeratorTerm2 = correctVVGet(vertVelocityGrid, i, j+.5);
-	return (numeratorTerm1 + numeratorTerm2) / 2;
+	// Four running maxima so consecutive compares don't wait on each other
+	float m[4] = {0, 0, 0, 0};
+	int j = 0;
+	for (; j + 4 <= count; j += 4) {
+		for (int k = 0; k < 4; ++k) {
+			m[k] = max(m[k], fabsf(values[j + k]));
+		}
+	}
+	for (; j < count; ++j) {
+		m[0] = max(m[0], fabsf(values[j]));
+	}
+	return max(max(m[0], m[1]), max(m[2], m[3]));
 }
 
+#ifdef FLUID_X86_KERNELS
+__attribute__((target("avx2")))
+float maxAbsRowAVX2(const float* values, int count) {
+	/*
+	Eight-wide version of maxAbsRowScalar with the same result.
+	*/
+	const __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	__m256 m0 = _mm256_setzero_ps();
+	__m256 m1 = _mm256_setzero_ps();
+	int j = 0;
+	// max_ps returns its second operand if either is NaN, so NaNs are skipped
+	for (; j + 16 <= count; j += 16) {
+		m0 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(values + j), magnitude), m0);
+		m1 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(values + j + 8), magnitude), m1);
+	}
+	for (; j + 8 <= count; j += 8) {
+		m0 = _mm256_max_ps(_mm256_and_ps(_mm256_loadu_ps(values + j), magnitude), m0);
+	}
+	m0 = _mm256_max_ps(m0, m1);
+	__m128 half = _mm_max_ps(_mm256_castps256_ps128(m0), _mm256_extractf128_ps(m0, 1));
+	half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+	// The tail stays in this function: calling the non-VEX scalar version
+	// from here costs an AVX/SSE transition on every row
+	float m = _mm_cvtss_f32(half);
+	for (; j < count; ++j) {
+		m = max(m, fabsf(values[j]));
+	}
+	return m;
+}
+#endif
 
 /*
-	horizVelocityGrid: 2D vector of floats; holds vertical horizontal components at 1/2 indices
-	vertVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
-	i: integer; index for ith row
-	j: integer; index for jth column
+	horizVelocityGrid: MACGrid; holds horizontal velocity components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 
-	Return type: vector<float>* of size 2
+	Return type: float
 */
-vector<float>* centerVel(const vector< vector<float> > &horizVelocityGrid, const vector< vector<float> > &vertVelocityGrid, int i, int j) {
+float maxVelocity(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid) {
 	/*
-	Returns x and y components of velocity at center of the cell
+	Returns the largest magnitude of any velocity component stored in the
+	grids, in cells per unit time. This bounds how far advection can move
+	anything, which is what the CFL condition limits.
 	*/
-	vector<float>* velocityComponents  = new vector<float>;
-	velocityComponents->push_back(horCenterVel(horizVelocityGrid, i, j));
-	velocityComponents->push_back(verCenterVel(vertVelocityGrid, i, j));
-	return velocityComponents;
+	float m = 0;
+	const MACGrid* grids[2] = {&horizVelocityGrid, &vertVelocityGrid};
+	for (const MACGrid* grid : grids) {
+		for (int i = 0; i < grid->rows(); ++i) {
+#ifdef FLUID_X86_KERNELS
+			if (cpuHasAVX2()) {
+				m = max(m, maxAbsRowAVX2(grid->row(i), grid->cols()));
+				continue;
+			}
+#endif
+			m = max(m, maxAbsRowScalar(grid->row(i), grid->cols()));
+		}
+	}
+	return m;
 }
 
-
 /*
-	horizVelocityGrid: 2D vector of floats; holds vertical horizontal components at 1/2 indices
-	vertVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
-	i: integer; index for ith row
-	j: integer; index for jth column
+	maxVel: float; largest velocity component, as returned by maxVelocity
+	duration: float; time to cover
+	cfl: float; largest number of cells anything may move in one substep
 
-	Return type: vector<float>* of size 2
+	Return type: int
 */
-vector<float>* rightSideVel(const vector< vector<float> > &horizVelocityGrid, const vector< vector<float> > &vertVelocityGrid, int i, int j) {
+int cflSubsteps(float maxVel, float duration, float cfl) {
 	/*
-	Returns x and y components of velocity at right side of the cell.
-	Averages the vertical velocities at the top and bottoms of the cells to the left and right.
+	Returns the fewest equal substeps covering duration in which nothing
+	moves further than cfl cells, at least 1.
 	*/
-	float horizComponent = correctHVGet(horizVelocityGrid, i+.5, j);\
+	// Slightly lenient so that rounding in the time left over from earlier
+	// substeps doesn't add one
+	double steps = ceil((double)maxVel * duration / cfl * (1 - 1e-5));
+	// Also catches NaN velocities
+	if (!(steps > 1)) {
+		return 1;
+	}
+	return (int)min(steps, 1e6);
+}
 
-	float vertComponentNumerator1 = correctVVGet(vertVelocityGrid, i, j-.5) + correctVVGet(vertVelocityGrid, i, j+.5);
-	float vertComponentNumerator2 = correctVVGet(vertVelocityGrid, i+1, j-.5) + correctVVGet(vertVelocityGrid, i+1, j+.5);
-	float vertComponent = (vertComponentNumerator1 + vertComponentNumerator2) / 4;
-	return new vector<float> {horizComponent, vertComponent};
+/*
+	count: int; number of floats needed
+
+	Return type: float*
+*/
+float* rowScratch(int count) {
+	/*
+	Returns a per-thread buffer of at least 2*count floats for holding a row of
+	sampled velocities. It only grows, so after the first step at a given grid
+	size sampling never calls the allocator.
+	*/
+	static thread_local vector<float> scratch;
+	if (scratch.size() < 2 * (size_t)count) {
+		scratch.resize(2 * (size_t)count);
+	}
+	return scratch.data();
 }
 
 /*
-	horizVelocityGrid: 2D vector of floats; holds vertical horizontal components at 1/2 indices
-	vertVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
+	Batched form of centerVel. Fills caller-owned arrays with the x and y
+	components for cells (i,0) ... (i,count-1) of row i, giving the same
+	values as calling centerVel for every j, but without recomputing the
+	half-index offsets per cell.
+
+	horizVelocityGrid: MACGrid; holds vertical horizontal components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 	i: integer; index for ith row
-	j: integer; index for jth column
+	count: integer; number of cells to sample, starting at j = 0
+	outX: float*; receives count x components
+	outY: float*; receives count y components
 
-	Return type: vector<float>* of size 2
+	Altered by reference: outX and outY
+	Return type: void
 */
-vector<float>* topSideVel(const vector< vector<float> > &horizVelocityGrid, const vector< vector<float> > &vertVelocityGrid, int i, int j) {
+void centerVelRow(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid, int i, int count, float* outX, float* outY) {
 	/*
-	Returns x and y components of velocity at top side of the cell.
-	Averages the horizontal velocities at the left and right of the cells to the top and bottom.
+	Fills outX/outY with the center velocities of row i.
 	*/
-	float horizComponentNumerator1 = correctHVGet(horizVelocityGrid, i-.5, j) + correctHVGet(horizVelocityGrid, i+.5, j);
-	float horizComponentNumerator2 = correctHVGet(horizVelocityGrid, i-.5, j+1) + correctHVGet(horizVelocityGrid, i+.5, j+1);
-	float horizComponent = (horizComponentNumerator1 + horizComponentNumerator2) / 4;
+	const float* left = horizVelocityGrid.staggeredRow(i-.5);
+	const float* right = horizVelocityGrid.staggeredRow(i+.5);
+	const float* vert = vertVelocityGrid.staggeredRow(i);
 
-	float vertComponent = correctVVGet(vertVelocityGrid, i, j+.5);
-	return new vector<float> {horizComponent, vertComponent};
+	for (int j = 0; j < count; ++j) {
+		outX[j] = (left[j] + right[j]) / 2;
+	}
+	if (count > 0) {
+		// j-.5 truncates to the same face as j+.5 in the first column
+		outY[0] = verCenterVel(vertVelocityGrid, i, 0);
+	}
+	for (int j = 1; j < count; ++j) {
+		outY[j] = (vert[j-1] + vert[j]) / 2;
+	}
 }
 #endif
@@ -0,0 +1,378 @@
+#ifndef __GRIDLOADER__
+#define __GRIDLOADER__
+
+#include "mac_grid.h"
+#include "grid_fns.h"
+#include "frame_file.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+/*
+	Loading of initial conditions. Text files are mapped into memory and
+	parsed in place with from_chars, split into chunks that are parsed on
+	separate threads, and the values go straight into the destination grid.
+	Files in the binary frame format (see frame_file.h) are recognised by
+	their magic and need no parsing at all.
+*/
+
+// Files smaller than this per thread are parsed on fewer threads
+const size_t GRID_LOADER_CHUNK_BYTES = 1 << 20;
+
+/*
+	Read-only mapping of a whole file, unmapped again on destruction.
+*/
+class MappedFile {
+	const char* mapping;
+	size_t mappedBytes;
+
+public:
+	/*
+		fileName: string; file to map
+	*/
+	MappedFile(string fileName) : mapping(nullptr), mappedBytes(0) {
+		int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw runtime_error("grid loader: cannot open " + fileName);
+		}
+		struct stat info;
+		if (fstat(fd, &info) != 0) {
+			::close(fd);
+			throw runtime_error("grid loader: cannot stat " + fileName);
+		}
+		mappedBytes = info.st_size;
+		if (mappedBytes > 0) {
+			void* address = mmap(nullptr, mappedBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (address == MAP_FAILED) {
+				::close(fd);
+				throw runtime_error("grid loader: cannot map " + fileName);
+			}
+			mapping = static_cast<const char*>(address);
+			madvise(const_cast<char*>(mapping), mappedBytes, MADV_WILLNEED);
+		}
+		::close(fd);
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		if (mapping != nullptr) {
+			munmap(const_cast<char*>(mapping), mappedBytes);
+		}
+	}
+
+	const char* data() const { return mapping; }
+	size_t size() const { return mappedBytes; }
+	const char* end() const { return mapping + mappedBytes; }
+};
+
+inline bool isSeparator(char c) {
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/*
+	begin: const char*; start of a block of text
+	end: const char*; one past its end
+
+	Return type: size_t
+*/
+size_t countValues(const char* begin, const char* end) {
+	/*
+	Returns the number of whitespace separated tokens in [begin, end).
+	*/
+	size_t count = 0;
+	bool inToken = false;
+	for (const char* c = begin; c != end; ++c) {
+		bool separator = isSeparator(*c);
+		count += !separator && !inToken;
+		inToken = !separator;
+	}
+	return count;
+}
+
+/*
+	begin: const char*; start of a block of text
+	end: const char*; one past its end
+	store: callable; store(value) is called with every value in order
+
+	Return type: void
+*/
+template<typename Store>
+void parseValues(const char* begin, const char* end, Store store) {
+	/*
+	Parses the whitespace separated floats in [begin, end). Throws on
+	anything that isn't a number.
+	*/
+	const char* c = begin;
+	for (;;) {
+		while (c != end && isSeparator(*c)) {
+			++c;
+		}
+		if (c == end) {
+			return;
+		}
+		// from_chars doesn't take the leading '+' that stof did
+		const char* token = *c == '+' ? c + 1 : c;
+		float value;
+		from_chars_result result = from_chars(token, end, value);
+		if (result.ec != errc() || (result.ptr != end && !isSeparator(*result.ptr))) {
+			const char* stop = c;
+			while (stop != end && !isSeparator(*stop)) {
+				++stop;
+			}
+			throw runtime_error("grid loader: invalid value '" + string(c, stop) + "'");
+		}
+		store(value);
+		c = result.ptr;
+	}
+}
+
+/*
+	text: MappedFile; file to split
+	chunks: vector<const char*> by reference; receives the chunk boundaries
+
+	Altered by reference: chunks
+	Return type: void
+*/
+void splitChunks(const MappedFile &text, vector<const char*> &chunks) {
+	/*
+	Cuts the file into one chunk per thread that will parse it, each ending
+	at whitespace so that no value is split between two chunks. Chunk k is
+	[chunks[k], chunks[k+1]).
+	*/
+	size_t threads = max(thread::hardware_concurrency(), 1u);
+	size_t count = min(threads, text.size() / GRID_LOADER_CHUNK_BYTES + 1);
+	chunks.assign(1, text.data());
+	for (size_t k = 1; k < count; ++k) {
+		const char* cut = max(text.data() + text.size() * k / count, chunks.back());
+		while (cut != text.end() && !isSeparator(*cut)) {
+			++cut;
+		}
+		chunks.push_back(cut);
+	}
+	chunks.push_back(text.end());
+}
+
+/*
+	count: size_t; number of chunks
+	work: callable; work(k) processes chunk k
+
+	Return type: void
+*/
+template<typename Work>
+void forEachChunk(size_t count, Work work) {
+	/*
+	Runs work on every chunk, the first on the calling thread and the rest
+	on threads of their own.
+	*/
+	vector<thread> helpers;
+	vector<exception_ptr> errors(count);
+	for (size_t k = 1; k < count; ++k) {
+		helpers.emplace_back([&, k] {
+			try {
+				work(k);
+			} catch (...) {
+				errors[k] = current_exception();
+			}
+		});
+	}
+	try {
+		work(0);
+	} catch (...) {
+		errors[0] = current_exception();
+	}
+	for (thread &helper : helpers) {
+		helper.join();
+	}
+	for (exception_ptr &error : errors) {
+		if (error) {
+			rethrow_exception(error);
+		}
+	}
+}
+
+/*
+	toFill: MACGrid; grid to fill, rows() x cols() values
+	inputFileName: string; text file in the format of getInputData
+
+	Altered by reference: toFill
+	Return type: void
+*/
+void fillGridFromText(MACGrid &toFill, string inputFileName) {
+	/*
+	Parses the file straight into toFill. The file has to hold exactly one
+	value per cell of the grid.
+	*/
+	MappedFile text(inputFileName);
+	vector<const char*> chunks;
+	splitChunks(text, chunks);
+	size_t count = chunks.size() - 1;
+
+	// First index of every chunk, from a quick count of the values in each
+	vector<size_t> first(count + 1, 0);
+	forEachChunk(count, [&](size_t k) {
+		first[k + 1] = countValues(chunks[k], chunks[k + 1]);
+	});
+	for (size_t k = 0; k < count; ++k) {
+		first[k + 1] += first[k];
+	}
+
+	size_t cols = toFill.cols();
+	size_t cells = (size_t)toFill.rows() * cols;
+	if (first[count] != cells) {
+		throw runtime_error("grid loader: " + inputFileName + " has " + to_string(first[count]) + " values, grid needs " +
+				to_string(toFill.rows()) + " x " + to_string(toFill.cols()));
+	}
+
+	forEachChunk(count, [&](size_t k) {
+		size_t i = cols > 0 ? first[k] / cols : 0;
+		size_t j = first[k] - i * cols;
+		parseValues(chunks[k], chunks[k + 1], [&](float value) {
+			toFill.at(i, j) = value;
+			if (++j == cols) {
+				j = 0;
+				++i;
+			}
+		});
+	});
+}
+
+/*
+	toFill: MACGrid; horizontal or vertical velocity grid to fill
+	inputFileName: string; file in the binary frame format
+	frame: int; frame to take, -1 for the last one
+
+	Altered by reference: toFill
+	Return type: void
+*/
+void fillGridFromFrames(MACGrid &toFill, string inputFileName, int frame = -1) {
+	/*
+	Seeds a velocity grid from the cell center velocities of a frame. Which
+	component to use follows from the grid's shape: a grid with one more row
+	than the frame holds the x faces, one with an extra column the y faces.
+	A face takes the average of the two cells either side of it, a face on
+	the border the velocity of its cell.
+	*/
+	FrameReader reader(inputFileName);
+	int rows = reader.rows();
+	int cols = reader.cols();
+	int component;
+	if (toFill.rows() == rows + 1 && toFill.cols() == cols) {
+		component = 0;
+	} else if (toFill.rows() == rows && toFill.cols() == cols + 1) {
+		component = 1;
+	} else {
+		throw runtime_error("grid loader: " + inputFileName + " holds " + to_string(rows) + " x " + to_string(cols) +
+				" cells, which doesn't match a " + to_string(toFill.rows()) + " x " + to_string(toFill.cols()) +
+				" velocity grid");
+	}
+	if (reader.components() != 2) {
+		throw runtime_error("grid loader: " + inputFileName + " doesn't hold velocities");
+	}
+	if (frame < 0) {
+		frame = reader.frameCount() - 1;
+	}
+	if (frame < 0 || frame >= reader.frameCount()) {
+		throw runtime_error("grid loader: " + inputFileName + " has no frame " + to_string(frame));
+	}
+
+	const float* values = reader.frame(frame);
+	auto center = [&](int i, int j) {
+		i = min(max(i, 0), rows - 1);
+		j = min(max(j, 0), cols - 1);
+		return values[2 * ((size_t)i * cols + j) + component];
+	};
+	for (int i = 0; i < toFill.rows(); ++i) {
+		float* row = toFill.row(i);
+		for (int j = 0; j < toFill.cols(); ++j) {
+			if (component == 0) {
+				row[j] = (center(i - 1, j) + center(i, j)) / 2;
+			} else {
+				row[j] = (center(i, j - 1) + center(i, j)) / 2;
+			}
+		}
+	}
+}
+
+/*
+	inputFileName: string; name of the file to check
+
+	Return type: bool
+*/
+bool isFrameFile(string inputFileName) {
+	/*
+	Returns whether the file starts with the magic of the binary frame format.
+	*/
+	char magic[sizeof(FRAME_FILE_MAGIC)];
+	int fd = open(inputFileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	bool match = pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+			memcmp(magic, FRAME_FILE_MAGIC, sizeof(magic)) == 0;
+	::close(fd);
+	return match;
+}
+
+/*
+	inputFileName: string; name of input file to be read from
+	Data format: Each row holds space seperated values for that row in toFill.
+		row 0 data
+		row 1 data
+		...
+		row n data
+		---------------------------
+		Ex:
+		---------------------------
+		1.2 1 3.4 3 23 2 ... 3 1
+		3 9 9.3 8 23 0 ... 0 9
+		...
+		4 9.6 3 25 28 2.5 ... 3 6
+
+	Return type: vector<float>*
+*/
+vector<float>* getInputData(string inputFileName) {
+	/*
+	Returns vector holding inputFileName's input data
+	*/
+	MappedFile text(inputFileName);
+	vector<float>* values = new vector<float>;
+	values->reserve(countValues(text.data(), text.end()));
+	parseValues(text.data(), text.end(), [&](float value) {
+		values->push_back(value);
+	});
+	return values;
+}
+
+/*
+	toFill: MACGrid; holds default values, needs to be initialized
+	inputFileName: string; file name of the input file, text as read by
+		getInputData or a velocity file in the binary frame format
+
+	Altered by reference: toFill
+	Return type: void
+*/
+void fillGrid(MACGrid &toFill, string inputFileName) {
+	/*
+	Gets values from input file, fills toFill with them. A binary frame file
+	seeds the grid from its last frame, so the output of one run can start
+	the next.
+	*/
+	if (isFrameFile(inputFileName)) {
+		fillGridFromFrames(toFill, inputFileName);
+	} else {
+		fillGridFromText(toFill, inputFileName);
+	}
+}
+
+#endif
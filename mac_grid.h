@@ -0,0 +1,200 @@
+#ifndef __MACGRID__
+#define __MACGRID__
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <utility>
+using namespace std;
+
+// Byte alignment of every grid allocation and of the start of every row
+const size_t MACGRID_ALIGN = 64;
+
+/*
+	Staggered (MAC) grid of floats kept in one aligned allocation.
+
+	Layout is row-major over i, so row i holds the values for j = 0 ... cols-1
+	contiguously, matching the [i][j] indexing of the nested vectors this
+	replaces. Rows are padded out to a multiple of MACGRID_ALIGN bytes so that
+	each row starts on a cache line.
+
+	xShift/yShift are the half-index offsets of the stored quantity.
+	The horizontal velocity grid is stored with xShift = 1, so staggered(i-.5, j)
+	and staggered(i+.5, j) give the velocities on the left and right sides of
+	cell (i,j); the vertical velocity grid does the same in j with yShift = 1.
+
+	at() and staggered() do no bounds checking; callers are expected to stay
+	inside rows() x cols().
+*/
+class MACGrid {
+	float* data;
+	int numRows;
+	int numCols;
+	int rowStride;
+	int xShift;
+	int yShift;
+
+	/*
+		cols: int; number of values in a row
+
+		Return type: int
+	*/
+	static int paddedStride(int cols) {
+		/*
+		Rounds cols up so that a row fills a whole number of aligned blocks.
+		*/
+		const int perBlock = MACGRID_ALIGN / sizeof(float);
+		return (cols + perBlock - 1) / perBlock * perBlock;
+	}
+
+	void allocate() {
+		size_t bytes = (size_t)numRows * rowStride * sizeof(float);
+		data = static_cast<float*>(aligned_alloc(MACGRID_ALIGN, bytes > 0 ? bytes : MACGRID_ALIGN));
+		if (data == nullptr) {
+			throw bad_alloc();
+		}
+	}
+
+public:
+	/*
+		rows: int; number of rows (x direction)
+		cols: int; number of columns (y direction)
+		initValue: float; value every cell starts with
+		xShift: int; half-index offset applied to i by staggered()
+		yShift: int; half-index offset applied to j by staggered()
+	*/
+	MACGrid(int rows, int cols, float initValue = 0, int xShift = 0, int yShift = 0)
+			: numRows(rows), numCols(cols), rowStride(paddedStride(cols)), xShift(xShift), yShift(yShift) {
+		allocate();
+		fill(initValue);
+	}
+
+	MACGrid(const MACGrid &other)
+			: numRows(other.numRows), numCols(other.numCols), rowStride(other.rowStride),
+			  xShift(other.xShift), yShift(other.yShift) {
+		allocate();
+		memcpy(data, other.data, (size_t)numRows * rowStride * sizeof(float));
+	}
+
+	MACGrid(MACGrid &&other)
+			: data(other.data), numRows(other.numRows), numCols(other.numCols), rowStride(other.rowStride),
+			  xShift(other.xShift), yShift(other.yShift) {
+		other.data = nullptr;
+		other.numRows = other.numCols = 0;
+	}
+
+	MACGrid& operator=(const MACGrid &other) {
+		if (this == &other) {
+			return *this;
+		}
+		if (numRows != other.numRows || rowStride != other.rowStride) {
+			// Shapes differ, so storage can't be reused
+			MACGrid copy(other);
+			swap(copy);
+			return *this;
+		}
+		numCols = other.numCols;
+		xShift = other.xShift;
+		yShift = other.yShift;
+		memcpy(data, other.data, (size_t)numRows * rowStride * sizeof(float));
+		return *this;
+	}
+
+	MACGrid& operator=(MACGrid &&other) {
+		swap(other);
+		return *this;
+	}
+
+	~MACGrid() {
+		free(data);
+	}
+
+	void swap(MACGrid &other) {
+		std::swap(data, other.data);
+		std::swap(numRows, other.numRows);
+		std::swap(numCols, other.numCols);
+		std::swap(rowStride, other.rowStride);
+		std::swap(xShift, other.xShift);
+		std::swap(yShift, other.yShift);
+	}
+
+	/*
+		value: float; value to write into every cell, padding included
+	*/
+	void fill(float value) {
+		size_t count = (size_t)numRows * rowStride;
+		for (size_t k = 0; k < count; ++k) {
+			data[k] = value;
+		}
+	}
+
+	int rows() const { return numRows; }
+	int cols() const { return numCols; }
+	// Distance in floats between the starts of consecutive rows
+	int stride() const { return rowStride; }
+
+	/* Unchecked access to the stored (i,j)th value */
+	float at(int i, int j) const {
+		return data[(size_t)i * rowStride + j];
+	}
+
+	float& at(int i, int j) {
+		return data[(size_t)i * rowStride + j];
+	}
+
+	/*
+		Unchecked access using the grid's half-index offsets.
+		Expects a truncated half index, the way correctHVGet/correctVVGet did:
+		for the horizontal grid, i-.5 and i+.5 select the left and right faces.
+	*/
+	float staggered(int i, int j) const {
+		return data[(size_t)(i + xShift) * rowStride + j + yShift];
+	}
+
+	/*
+		Pointer p such that p[j] == staggered(i, j).
+		Lets row-at-a-time loops apply the half-index offsets once per row.
+	*/
+	const float* staggeredRow(int i) const {
+		return data + (size_t)(i + xShift) * rowStride + yShift;
+	}
+
+	/* Pointer to the first value of row i */
+	const float* row(int i) const {
+		return data + (size_t)i * rowStride;
+	}
+
+	float* row(int i) {
+		return data + (size_t)i * rowStride;
+	}
+};
+
+/*
+	Double-buffered MACGrid, following FluidQuantity's src/dst buffers.
+
+	Operations that can't be done in place, such as advection, read from src()
+	and write to dst(). flip() then swaps the two buffers in O(1), so the
+	result becomes visible to subsequent operations without copying the field.
+*/
+class MACField {
+	MACGrid source;
+	MACGrid destination;
+
+public:
+	/*
+		Same arguments as MACGrid; both buffers start out filled with initValue.
+	*/
+	MACField(int rows, int cols, float initValue = 0, int xShift = 0, int yShift = 0)
+			: source(rows, cols, initValue, xShift, yShift), destination(rows, cols, initValue, xShift, yShift) {}
+
+	MACGrid& src() { return source; }
+	const MACGrid& src() const { return source; }
+	MACGrid& dst() { return destination; }
+	const MACGrid& dst() const { return destination; }
+
+	void flip() {
+		source.swap(destination);
+	}
+};
+
+#endif
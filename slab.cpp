@@ -0,0 +1,132 @@
+#include "FluidSolver.cpp"
+#include <chrono>
+#include <string>
+#include <stdlib.h>
+#include <iostream>
+
+/*
+	Runs one simulation split into horizontal slabs across RANKS processes on
+	one machine, see SlabDomain.h. Every rank is pinned to its share of the
+	NUMA nodes and threads over the CPUs it got, so its slab stays in memory
+	near it. Rank 0 reports the throughput.
+
+	With --check, the run is repeated in this process on one grid and the
+	largest difference in density to the slabs is reported, next to the
+	largest density.
+
+	Usage: slab RANKS FRAMES WIDTH HEIGHT [--threads N] [--solid] [--check]
+	Build like solver.cpp, e.g. g++ -O2 -std=c++17 -pthread slab.cpp -lrt
+*/
+
+struct SlabOptions {
+	int ranks;
+	int frames;
+	int width, height;
+	int threads;
+	bool solid;
+};
+
+/*
+	solver: FluidSolver; the whole domain, or one rank's slab of it
+	options: SlabOptions; the run to make
+
+	Return type: long; substeps taken
+*/
+long runFrames(FluidSolver<double> &solver, const SlabOptions &options) {
+	/*
+	Advances the simulation every rank and the check run make, in the same order.
+	*/
+	const double TIME_PER_FRAME = 1 / 15.0;
+	if (options.solid) {
+		solver.addSolid(0.4, 0.5, 0.2, 0.1);
+	}
+	// At least two cells wide and high, so the inflow covers cells of
+	// every field and --check compares actual smoke on small grids too
+	double cellSize = 1.0 / min(options.width, options.height);
+	double inflowWidth = max(0.1, 2 * cellSize);
+	double inflowHeight = max(0.05, 2 * cellSize);
+	long substeps = 0;
+	for (int frame = 0; frame < options.frames; ++frame) {
+		solver.addInflow(0.5 - inflowWidth / 2, 0.2, inflowWidth, inflowHeight, 1.0, 0.0, 3.0);
+		substeps += solver.advance(TIME_PER_FRAME, 1);
+	}
+	return substeps;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc < 5) {
+		cerr << "Usage: slab RANKS FRAMES WIDTH HEIGHT [--threads N] [--solid] [--check]" << endl;
+		return 1;
+	}
+
+	SlabOptions options;
+	options.ranks = atoi(argv[1]);
+	options.frames = atoi(argv[2]);
+	options.width = atoi(argv[3]);
+	options.height = atoi(argv[4]);
+	options.threads = 0;
+	options.solid = false;
+	bool check = false;
+	for (int arg = 5; arg < argc; ++arg) {
+		string option = argv[arg];
+		if (option == "--threads" && arg + 1 < argc) {
+			options.threads = atoi(argv[++arg]);
+		} else if (option == "--solid") {
+			options.solid = true;
+		} else if (option == "--check") {
+			check = true;
+		} else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	if (options.ranks < 1 || options.frames < 0 || options.width < 2 || options.height < SLAB_HALO * options.ranks) {
+		cerr << "Need at least one rank, a grid at least 2 wide and " << SLAB_HALO << " rows per rank" << endl;
+		return 1;
+	}
+
+	vector<double> gathered;
+	bool succeeded = launchSlabs(options.ranks, options.width, options.height, SLAB_HALO,
+		[&](SlabDomain &domain, int cpus) {
+			FluidSolver<double> solver(options.width, options.height, 0.1, &domain);
+			solver.setThreadCount(options.threads > 0 ? options.threads : cpus);
+
+			auto start = chrono::steady_clock::now();
+			long substeps = runFrames(solver, options);
+			domain.barrier();
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+			if (domain.rank() == 0) {
+				cout << "Ran " << options.width << "x" << options.height << " on " << domain.rankCount()
+					 << " ranks for " << options.frames << " frames in " << substeps << " substeps, "
+					 << seconds << " s" << endl;
+				cout << "Throughput " << substeps / seconds << " steps/s, rank 0 owns "
+					 << domain.ownedRows() << " rows on " << solver.threadCount() << " threads" << endl;
+			}
+			solver.gatherDensity();
+		}, &gathered);
+	if (!succeeded) {
+		cerr << "A rank failed" << endl;
+		return 1;
+	}
+
+	if (check) {
+		FluidSolver<double> reference(options.width, options.height, 0.1);
+		reference.setPressureSolver(SOLVER_RED_BLACK_SOR);
+		reference.setDirectSolve(false);
+		reference.setThreadCount(options.threads);
+		runFrames(reference, options);
+
+		double difference = 0.0;
+		double largest = 0.0;
+		for (int y = 0; y < options.height; ++y) {
+			for (int x = 0; x < options.width; ++x) {
+				difference = max(difference, fabs(reference.densityAt(x, y) - gathered[y * options.width + x]));
+				largest = max(largest, fabs(reference.densityAt(x, y)));
+			}
+		}
+		cout << "Largest density difference to one process: " << difference
+			 << " (largest density " << largest << ")" << endl;
+	}
+	return 0;
+}
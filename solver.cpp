@@ -1,6 +1,11 @@
+#include "mac_grid.h"
 #include "grid_fns.h"
 #include "utils.h"
 #include "advect.h"
+#include "frame_file.h"
+#include "async_writer.h"
+#include "grid_loader.h"
+#include "checkpoint.h"
 #include <string>
 #include <stdlib.h>
 #include <iostream>
@@ -9,7 +14,8 @@ int main(int argc, char* argv[]){
 /* Below is basic skeleton of a fluid solver. Each function will be implemented,
 and combine to give us a simulator.*/
 
-	string fileName = "outputVelocities.txt";
+	string fileName = "outputVelocities.bin";
+	bool textOutput = false;
 	int numFrames = 500;
 	int xDim = 32;
 	int yDim = 32;
@@ -23,41 +29,182 @@ and combine to give us a simulator.*/
 		xDim = atoi(argv[2]);
 		yDim = atoi(argv[3]);
 	}
-	// Make sure no existing data already in save destination, save number of frames we produce.
-	clearOutputFile(fileName, numFrames, xDim, yDim);
+	// Frames are written in the binary frame format unless text is asked for.
+	// Binary frames can be stored smaller: --half, --u16 or --u8 quantize
+	// them, --delta stores most as differences to the frame before and
+	// --rans compresses the result.
+	// --seed takes the initial velocities from the last frame of a binary
+	// output file instead of the initial velocity text files.
+	// --checkpoint N saves the state to checkpoint.bin every N frames and
+	// --restart resumes from such a file.
+	// --telemetry FILE writes stage timings and counters when built with
+	// FLUID_TELEMETRY: as CSV, as Chrome trace events for names ending in
+	// .trace.json, or as JSON for other .json names.
+	FrameEncoding encoding;
+	string seedFile;
+	string restartFile;
+	int checkpointInterval = 0;
+	string telemetryFile;
+	// Substeps move nothing further than this many cells, 0 for the old
+	// fixed step of 1/30
+	float cfl = 1;
+	for (int arg = 4; arg < argc; ++arg) {
+		string option = argv[arg];
+		if (option == "--seed" && arg + 1 < argc) {
+			seedFile = argv[++arg];
+		} else if (option == "--checkpoint" && arg + 1 < argc) {
+			checkpointInterval = atoi(argv[++arg]);
+		} else if (option == "--restart" && arg + 1 < argc) {
+			restartFile = argv[++arg];
+		} else if (option == "--telemetry" && arg + 1 < argc) {
+			telemetryFile = argv[++arg];
+		} else if (option == "--cfl" && arg + 1 < argc) {
+			cfl = atof(argv[++arg]);
+		} else if (option == "--text") {
+			textOutput = true;
+			fileName = "outputVelocities.txt";
+		} else if (option == "--half") {
+			encoding.scalarType = FRAME_SCALAR_FLOAT16;
+		} else if (option == "--u16") {
+			encoding.scalarType = FRAME_SCALAR_UNORM16;
+		} else if (option == "--u8") {
+			encoding.scalarType = FRAME_SCALAR_UNORM8;
+		} else if (option == "--delta") {
+			encoding.keyframeInterval = 30;
+		} else if (option == "--rans") {
+			encoding.entropy = true;
+		} else {
+			cerr << "Unknown option " << option << endl;
+			return 1;
+		}
+	}
+	if (encoding.scalarType == FRAME_SCALAR_FLOAT32 && (encoding.keyframeInterval > 1 || encoding.entropy)) {
+		// Deltas and entropy coding work on quantized values
+		encoding.scalarType = FRAME_SCALAR_FLOAT16;
+	}
 
 	// 1. Initialize grids with fluid
-	vector< vector<float> > pressureGrid(xDim, vector<float>(yDim, initValue));
-	vector< vector<float> > horizVelocityGrid(xDim+1, vector<float>(yDim, initValue));
-	vector< vector<float> > vertVelocityGrid(xDim, vector<float>(yDim+1, initValue));
+	MACGrid pressureGrid(xDim, yDim, initValue);
+	// Velocity fields are double-buffered: advect writes into dst, flip makes it current
+	MACField horizVelocityField(xDim+1, yDim, initValue, 1, 0);
+	MACField vertVelocityField(xDim, yDim+1, initValue, 0, 1);
 
-	fillGrid(horizVelocityGrid, "initialHorizVelocities.txt");
-	fillGrid(vertVelocityGrid, "initialVertVelocities.txt");
+	// A restart takes the velocities from the checkpoint instead
+	if (restartFile.empty()) {
+		fillGrid(horizVelocityField.src(), seedFile.empty() ? "initialHorizVelocities.txt" : seedFile);
+		fillGrid(vertVelocityField.src(), seedFile.empty() ? "initialVertVelocities.txt" : seedFile);
+	}
 
-	// Used for updating fields ins advect function
-	vector< vector<float> > updatedHorizGrid(xDim+1, vector<float>(yDim, initValue));
-	vector< vector<float> > updatedVertGrid(xDim, vector<float>(yDim+1, initValue));
+	const float TIME_PER_FRAME = 1 / 15.0;
+	int firstFrame = 0;
+	if (!restartFile.empty()) {
+		CheckpointReader checkpoint(restartFile);
+		MACGrid &horiz = horizVelocityField.src();
+		MACGrid &vert = vertVelocityField.src();
+		checkpoint.restore("horizVelocity", horiz.row(0), horiz.rows(), horiz.cols(), horiz.stride());
+		checkpoint.restore("vertVelocity", vert.row(0), vert.rows(), vert.cols(), vert.stride());
+		firstFrame = checkpoint.frame();
+		// Frames before the checkpoint are in the interrupted run's output
+		size_t extension = fileName.rfind('.');
+		fileName = fileName.substr(0, extension) + "_" + to_string(firstFrame) + fileName.substr(extension);
+		cout << "Restarting at frame " << firstFrame << ", writing " << fileName << endl;
+	}
+	CheckpointWriter* checkpoints = checkpointInterval > 0 ? new CheckpointWriter("checkpoint.bin") : nullptr;
 
+	// Opened only now, since the seed may be the previous run's output file
+	FrameWriter* frames = nullptr;
+	AsyncFrameWriter* output = nullptr;
+	if (textOutput) {
+		// Make sure no existing data already in save destination, save number of frames we produce.
+		clearOutputFile(fileName, numFrames - firstFrame, xDim, yDim);
+	} else {
+		// Frames are written on a background thread while the next ones are computed
+		frames = new FrameWriter(fileName, xDim, yDim, encoding);
+		output = new AsyncFrameWriter(*frames, 4, BACKPRESSURE_BLOCK);
+	}
 
-	// Used for creating timestep, eventually, don't need for right now
-	vector<float>* bottomLeftVel = rightSideVel(horizVelocityGrid, vertVelocityGrid, 0, 0);
-	float maxVel = magnitude(*bottomLeftVel);
-	delete bottomLeftVel;
 
-	const float TIME_PER_FRAME = 1 / 15.0;
-	for (int i = 0; i < numFrames; ++i) {
+	long substeps = 0;
+
+	for (int i = firstFrame; i < numFrames; ++i) {
 		t = 0;
-		saveVelocityField(horizVelocityGrid, vertVelocityGrid, xDim, yDim, fileName);
-		deltaT = 1 / 30.0;
-		while (t < TIME_PER_FRAME) {
-			advect(horizVelocityGrid, vertVelocityGrid, updatedHorizGrid, updatedVertGrid, xDim, yDim, deltaT);
-			horizVelocityGrid = updatedHorizGrid;
-			vertVelocityGrid = updatedVertGrid;
-	 		// pressure Projection
-	 		// advect free surface
-			t = t + deltaT;
+		long frameSubsteps = substeps;
+		TELEMETRY_STEP();
+		if (checkpoints != nullptr && i > firstFrame && i % checkpointInterval == 0) {
+			// Only copies the grids, the file is written in the background
+			Checkpoint &checkpoint = checkpoints->begin(i, i * TIME_PER_FRAME);
+			const MACGrid &horiz = horizVelocityField.src();
+			const MACGrid &vert = vertVelocityField.src();
+			checkpoint.add("horizVelocity", horiz.row(0), horiz.rows(), horiz.cols(), horiz.stride());
+			checkpoint.add("vertVelocity", vert.row(0), vert.rows(), vert.cols(), vert.stride());
+			checkpoints->commit();
+		}
+		if (textOutput) {
+			saveVelocityField(horizVelocityField.src(), vertVelocityField.src(), xDim, yDim, fileName);
+		} else {
+			output->submitVelocityField(horizVelocityField.src(), vertVelocityField.src());
 		}
+		if (cfl > 0) {
+			// Each substep is sized from the current flow, so steps shrink as
+			// soon as it speeds up and grow again once it calms down
+			float remaining = TIME_PER_FRAME;
+			while (remaining > 0) {
+				float maxVel = maxVelocity(horizVelocityField.src(), vertVelocityField.src());
+				int steps = cflSubsteps(maxVel, remaining, cfl);
+				deltaT = steps > 1 ? remaining / steps : remaining;
+				advect(horizVelocityField, vertVelocityField, xDim, yDim, deltaT);
+				horizVelocityField.flip();
+				vertVelocityField.flip();
+				remaining = steps > 1 ? remaining - deltaT : 0;
+				substeps++;
+			}
+		} else {
+			deltaT = 1 / 30.0;
+			while (t < TIME_PER_FRAME) {
+				advect(horizVelocityField, vertVelocityField, xDim, yDim, deltaT);
+				horizVelocityField.flip();
+				vertVelocityField.flip();
+		 		// pressure Projection
+		 		// advect free surface
+				t = t + deltaT;
+				substeps++;
+			}
+		}
+		TELEMETRY_COUNT(COUNTER_SUBSTEPS, substeps - frameSubsteps);
 	// 	save frame i
 	}
-	saveVelocityField(horizVelocityGrid, vertVelocityGrid, xDim, yDim, fileName);
+	if (textOutput) {
+		saveVelocityField(horizVelocityField.src(), vertVelocityField.src(), xDim, yDim, fileName);
+	} else {
+		output->submitVelocityField(horizVelocityField.src(), vertVelocityField.src());
+		output->close();
+		FrameQueueStats stats = output->stats();
+		cout << "Wrote " << stats.framesWritten << " frames, dropped " << stats.framesDropped
+			 << ", stalled " << stats.stallSeconds << " s waiting on output" << endl;
+		delete output;
+		delete frames;
+	}
+	cout << "Took " << substeps << " substeps for " << numFrames - firstFrame << " frames" << endl;
+	if (checkpoints != nullptr) {
+		checkpoints->close();
+		CheckpointStats stats = checkpoints->stats();
+		cout << "Wrote " << stats.checkpointsWritten << " checkpoints, stalled " << stats.stallSeconds
+			 << " s waiting on them" << endl;
+		delete checkpoints;
+	}
+	if (!telemetryFile.empty()) {
+#ifdef FLUID_TELEMETRY
+		auto endsWith = [&](const string &suffix) {
+			return telemetryFile.size() >= suffix.size() &&
+				telemetryFile.compare(telemetryFile.size() - suffix.size(), suffix.size(), suffix) == 0;
+		};
+		TelemetryFormat format = endsWith(".trace.json") ? TELEMETRY_CHROME_TRACE :
+			endsWith(".json") ? TELEMETRY_JSON : TELEMETRY_CSV;
+		if (!Telemetry::global().write(telemetryFile, format)) {
+			cerr << "Could not write telemetry to " << telemetryFile << endl;
+		}
+#else
+		cerr << "Built without FLUID_TELEMETRY, not writing " << telemetryFile << endl;
+#endif
+	}
 }
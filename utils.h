@@ -2,11 +2,11 @@
 #define __UTILS__
 
 #include "grid_fns.h"
+#include "Telemetry.h"
 #include <cmath>
 #include <string>
 #include <vector>
 #include <fstream>
-#include <sstream>
 using namespace std;
 
 /*
@@ -28,68 +28,66 @@ void clearOutputFile(string fileName, int numFrames, int xDim, int yDim) {
 }
 
 /*
-	vec: vector of floats by reference; the vector to be output
+	out: ostream by reference; the stream to write to
+	vec: Vec2; the vector to be output
 
-	Return type: string
+	Return type: void
 */
-string outputVector(vector<float> &vec) {
+void outputVector(ostream &out, const Vec2 &vec) {
 	/*
-	Returns vec's values separated by spaces.
+	Writes vec's values separated by spaces.
 	*/
-	stringstream s;
-	for (size_t i = 0; i < vec.size()-1; ++i) {
-		s << vec.at(i) << " ";
-	}
-	s << vec.at(vec.size()-1);
-	return s.str();
+	out << vec.x << " " << vec.y;
 }
 
 /*
-	horizVelocityGrid: 2D vector of floats; holds vertical horizontal components at 1/2 indices
-	vertVelocityGrid: 2D vector of floats; holds vertical velocity components at 1/2 indices
+	horizVelocityGrid: MACGrid; holds vertical horizontal components at 1/2 indices
+	vertVelocityGrid: MACGrid; holds vertical velocity components at 1/2 indices
 	xDim: int; number of cells in x direction
 	yDim: int; number of cells in y direction
 	fileName: string; the file to output to
 
 	Return type: void
 */
-void saveVelocityField(vector< vector<float> > &horizVelocityGrid, vector< vector<float> > &vertVelocityGrid, int xDim, int yDim, string fileName) {
+void saveVelocityField(const MACGrid &horizVelocityGrid, const MACGrid &vertVelocityGrid, int xDim, int yDim, string fileName) {
 	/*
 	Saves center velocities of given horizontal and vertical velocity fields to fileName.
 	*/
-	vector<float>* centerVelocity;
+	TELEMETRY_SCOPE(STAGE_OUTPUT);
+	float* centerX = rowScratch(yDim);
+	float* centerY = centerX + yDim;
 	ofstream outputFile;
 	outputFile.open(fileName, ios::app);
+#ifdef FLUID_TELEMETRY
+	outputFile.seekp(0, ios::end);
+	streamoff start = outputFile.tellp();
+#endif
 	outputFile << "Start Matrix" << endl;
-	for (size_t i = 0; i < xDim; ++i) {
-		for (size_t j = 0; j < yDim-1; ++j) {
-			centerVelocity = centerVel(horizVelocityGrid, vertVelocityGrid, i, j);
-			outputFile << outputVector(*centerVelocity);
+	for (int i = 0; i < xDim; ++i) {
+		centerVelRow(horizVelocityGrid, vertVelocityGrid, i, yDim, centerX, centerY);
+		for (int j = 0; j < yDim-1; ++j) {
+			outputVector(outputFile, Vec2 {centerX[j], centerY[j]});
 			outputFile << ";";
-			delete centerVelocity;
 		}
-		centerVelocity = centerVel(horizVelocityGrid, vertVelocityGrid, i, yDim-1);
-		outputFile << outputVector(*centerVelocity);
-		delete centerVelocity;
+		outputVector(outputFile, Vec2 {centerX[yDim-1], centerY[yDim-1]});
 		outputFile << endl;
 	}
 	outputFile << "End Matrix" << endl;
+#ifdef FLUID_TELEMETRY
+	TELEMETRY_COUNT(COUNTER_BYTES_WRITTEN, outputFile.tellp() - start);
+#endif
 	outputFile.close();
 }
 
 
 /*
-input: vector of floats; vector for which to calc magnitude
+input: Vec2; vector for which to calc magnitude
 
 Return type: float
 */
-float magnitude(vector<float> &input){
+float magnitude(const Vec2 &input){
 	// Returns magnitude of input
-	float mag = 0;
-	for (size_t i = 0; i < input.size(); ++i) {
-		mag += pow(input.at(i), 2);
-	}
-	return pow(mag, .5);
+	return sqrt(input.x * input.x + input.y * input.y);
 }
 
 #endif